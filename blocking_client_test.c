@@ -1,9 +1,25 @@
+/* Measures how the size of the reply header changes throughput, goodput
+ * and latency. The server puts a number of padding bytes between rep_hdr
+ * and the value, standing for metadata that rides along with a reply.
+ *
+ * -H takes a list of padding sizes and -S one server per padding size,
+ * each one set up to pad its replies by that much. -V splits the keys
+ * into value size classes by their upper bounds. Every pair of padding
+ * and value class is one point, measured for -T seconds by a blocking
+ * client with one GET in flight.
+ *
+ * With -r the tool is a latency probe instead, to run next to
+ * transmission_test. -P threads, pinned to the CPUs of -C, each send -r
+ * GETs per second over the keys of the dataset, one at a time, and spin
+ * on the socket for the reply. -B sets SO_BUSY_POLL on top. Every second
+ * and at the end the probe prints its own latency distribution, apart
+ * from the bulk load. -T 0 probes until interrupted. */
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
-#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <stddef.h>
 #include <unistd.h>
@@ -13,8 +29,13 @@
 #include <errno.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 
-#include "hashtable.h"
+#include "dataset.h"
+#include "latency.h"
 
 #define log_error(_f, _m...) do{\
     fprintf(stderr, "[Error][%10s:%4d]" _f, __FUNCTION__, __LINE__, ##_m);\
@@ -26,11 +47,9 @@
 
 #define GET 0
 #define SAMPLE_OBJECT_SIZE  128
-#define RCV_BUF_SIZE    (1<<12)
-
-#ifdef _USE_DUMMY_FIELD_HDR
-#define DUMMY_FIELD_SIZE    (1<<10)
-#endif
+#define RCV_BUF_SIZE    (1<<16)
+#define MAX_POINTS      (32)        /* entries of -H and of -V */
+#define MAX_PROBE_THREADS   (64)
 
 typedef struct req_hdr_ req_hdr;
 typedef struct rep_hdr_ rep_hdr;
@@ -40,249 +59,471 @@ struct req_hdr_ {
     uint8_t keyLen;
 } __attribute__((packed));
 
+/* followed by the padding, then valLen bytes of value */
 struct rep_hdr_ {
     uint8_t replyType;
     uint16_t valLen;
-#ifdef _USE_DUMMY_FIELD_HDR
-    uint8_t __dummy[DUMMY_FIELD_SIZE];
-#endif
     uint8_t val[];
 } __attribute__((packed));
 
-static uint8_t app_rcv_buf[RCV_BUF_SIZE];
+typedef struct point_stats_s {
+    uint64_t num_replies;
+    uint64_t num_verify_fail;
+    uint64_t rx_bytes;          /* header, padding and value */
+    uint64_t value_bytes;
+    uint64_t total_latency_ns;
+    latency_hist_t hist;
+} point_stats_t;
+
+static __thread uint8_t app_rcv_buf[RCV_BUF_SIZE];
 
 static void SetupKeyValue(void);
 static void DestroyKeyValue(void);
-static int CreateConnection(void);
-static int SendGetRequest(const int fd);
-static int ReceiveReply(const int fd);
+static int ParseList(char *s, uint32_t *out, const int max);
+static int CreateConnection(const int server);
+static int SendGetRequest(const int fd, const uint32_t k);
+static ssize_t ReadSome(const int fd, void *buf, const size_t len);
+static int ReceiveReply(const int fd, const uint32_t k, const uint32_t pad, point_stats_t *st);
+static void RunPoint(const int pad_idx, const int class_idx);
+static void *ProbeThread(void *arg);
+static void SumProbeStats(point_stats_t *sum);
+static void RunProbe(void);
 static void CloseConnection(const int fd);
 static void SigInteruuptHandler(int signo);
 
-static in_port_t dport;
-static in_addr_t daddr;
+static in_port_t dport_[MAX_POINTS];
+static in_addr_t daddr_[MAX_POINTS];
+static int num_servers_ = 0;
 
 static void **key_;
-static void **value_;
+static uint16_t *key_len_;
+static uint32_t *value_len_;
 static uint32_t num_key_values_ = 1;
+static const char *dataset_path_ = DATASET_PATH;
+static dataset_t *dataset_;
+
+static uint32_t hdr_pad_[MAX_POINTS] = {0};
+static int num_pads_ = 1;
+/* upper bounds of the value size classes, a class holds the values
+ * longer than the bound before it */
+static uint32_t value_class_[MAX_POINTS] = {UINT32_MAX};
+static int num_classes_ = 1;
+static uint32_t duration_sec_ = 5;
+static uint32_t *class_keys_;
+static point_stats_t stats_;
+
+/* probe mode */
+static uint32_t probe_rate_ = 0;        /* GETs per second and thread, 0 runs the sweep */
+static int num_probe_threads_ = 1;
+static uint32_t probe_cpus_[MAX_PROBE_THREADS];
+static int num_probe_cpus_ = 0;
+static int busy_poll_us_ = 0;
+static point_stats_t *probe_stats_;
 
 static bool run_test_ = true;
 
 static void
 SetupKeyValue(void) {
 
-    int count = 0;
-    char line[1U << 16];
-    FILE *sample_key_value_file;
-    char *key, *val, *saveptr, *endptr, *p;
-    uint16_t keyLen;
-    uint32_t valLen;
+    uint32_t count;
 
-    sample_key_value_file = fopen("sample_key_value.txt", "r");
-    if (!sample_key_value_file) {
-        log_error("fopen() error, %s\n", strerror(errno));
+    dataset_ = dataset_open(dataset_path_);
+    if (!dataset_) {
+        log_error("no dataset at %s, make one with gen_random_key_value or dataset_convert\n",
+                dataset_path_);
         exit(EXIT_FAILURE);
     }
 
-    key_ = malloc(sizeof(void *) * num_key_values_);
-    if (!key_) {
-        log_error("malloc() error, %s\n", strerror(errno));
+    if (dataset_->num_items == 0) {
+        log_error("no key in %s\n", dataset_path_);
         exit(EXIT_FAILURE);
     }
-    value_ = malloc(sizeof(void *) * num_key_values_);
-    if (!value_) {
+    if (num_key_values_ > dataset_->num_items)
+        num_key_values_ = dataset_->num_items;
+
+    /* keyLen is one byte on the wire */
+    if (dataset_check_key_len(dataset_, num_key_values_, UINT8_MAX) < 0)
+        exit(EXIT_FAILURE);
+
+    key_ = malloc(sizeof(void *) * num_key_values_);
+    key_len_ = malloc(sizeof(uint16_t) * num_key_values_);
+    value_len_ = malloc(sizeof(uint32_t) * num_key_values_);
+    class_keys_ = malloc(sizeof(uint32_t) * num_key_values_);
+    if (!key_ || !key_len_ || !value_len_ || !class_keys_) {
         log_error("malloc() error, %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    while (count < num_key_values_) {
-        if (!fgets(line, 1U << 16, sample_key_value_file)) {
-            break;
-        }
-        p = strtok_r(line, ",", &saveptr);
-        keyLen = strtol(p, &endptr, 10);
-        key = strtok_r(NULL, ",", &saveptr);
-        p = strtok_r(NULL, ",", &saveptr);
-        valLen = strtol(p, &endptr, 10);
-        val = strtok_r(NULL, ",", &saveptr);
-
-        key_[count] = malloc(keyLen + 1);
-        if (!key_[count]) {
-            log_error("malloc() error, %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-
-        memcpy(key_[count], key, keyLen);
-        *(char *)(key_[count] + keyLen) = '\0';
-
-        value_[count] = malloc(valLen + 1);
-        if (!value_[count]) {
-            log_error("malloc() error, %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-        memcpy(value_[count], val, valLen);
-        *(char *)(value_[count] + valLen) = '\0';
-
-        count++;
+    /* Keys stay in the mapping, values are compared in place or
+     * regenerated, see dataset_value_cmp() */
+    for (count = 0; count < num_key_values_; count++) {
+        key_[count] = (void *)dataset_key(dataset_, count);
+        key_len_[count] = dataset_key_len(dataset_, count);
+        value_len_[count] = dataset_value_len(dataset_, count);
     }
 }
 
 static void
 DestroyKeyValue(void) {
-    int i;
-    for (i = 0; i < num_key_values_; i++) {
-        free(key_[i]);
-        free(value_[i]);
+    free(key_);
+    free(key_len_);
+    free(value_len_);
+    free(class_keys_);
+    dataset_close(dataset_);
+}
+
+/* "0,64,1024" into out, returns the number of entries or -1 */
+static int
+ParseList(char *s, uint32_t *out, const int max)
+{
+    char *saveptr, *p;
+    int n = 0;
+
+    for (p = strtok_r(s, ",", &saveptr); p; p = strtok_r(NULL, ",", &saveptr)) {
+        if (n == max)
+            return -1;
+        out[n++] = strtoul(p, NULL, 10);
     }
 
-    free(key_);
-    free(value_);
+    return n > 0 ? n : -1;
 }
 
 static int
-CreateConnection(void) 
+CreateConnection(const int server)
 {
     struct sockaddr_in addr;
     int fd;
-    int ret;
+    int one = 1;
 
     addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = daddr;
-    addr.sin_port = dport;
+    addr.sin_addr.s_addr = daddr_[server];
+    addr.sin_port = dport_[server];
 
     fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
         log_error("Failed to create socket\n");
         return -1;
     }
-    ret = connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
-    if (ret < 0) {
-        if (errno != EINPROGRESS) {
-            perror("mtcp_connect error");
-            close(fd);
-        }
-        log_trace("connect() fd:%d,ret:%d, errno:%d\n", fd, ret, errno);
-    } 
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+        log_error("setsockopt(TCP_NODELAY) fail, %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0) {
+        log_error("connect() fail, %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
     return fd;
 }
 
 static int
-SendGetRequest(const int fd)
+SendGetRequest(const int fd, const uint32_t k)
 {
-    int ret;
     req_hdr req = {
         GET,
-        strlen((char *)key_[0])
+        key_len_[k]
     };
 
     struct iovec vec[2] = {
-        {&req, 2},
-        {key_[0], req.keyLen}
+        {&req, sizeof(req_hdr)},
+        {key_[k], req.keyLen}
     };
 
-    //log_trace("Send request packet\n");
+    if (writev(fd, vec, 2) != sizeof(req_hdr) + req.keyLen) {
+        log_error("writev() fail, %s\n", strerror(errno));
+        return -1;
+    }
 
-    ret = writev(fd, vec, 2);
-    if (ret < 0) {
-        if (errno != EINPROGRESS) {
-            perror("connect");
-            close(fd);
-            return -1;
-        }
+    return 0;
+}
+
+/* read() that spins while a non-blocking socket has nothing */
+static ssize_t
+ReadSome(const int fd, void *buf, const size_t len)
+{
+    ssize_t ret;
+
+    while ((ret = read(fd, buf, len)) < 0 && (errno == EAGAIN || errno == EINTR)) {
+        if (!run_test_)
+            break;
     }
-    return ret; 
+
+    return ret;
 }
 
+/* Reads the reply to key k, skips the padding and verifies the value */
 static int
-ReceiveReply(const int fd)
+ReceiveReply(const int fd, const uint32_t k, const uint32_t pad, point_stats_t *st)
 {
-    int len;;
-    int off = 0;
-    int to_be_rcvd = strlen((char *)value_[0]) + sizeof(rep_hdr);
-    rep_hdr rep; //= (rep_hdr *)app_rcv_buf;
-    bool first = true;
-/*
-    while((len = read(fd, app_rcv_buf + off, (1 << 16) - off)) > 0) {
-
-        if ((ret = memcmp(rep->val + off, (uint8_t *)value_[0] + off, 10)) != 0) {
-            char *ptr = (char *)rep->val + off;
-            ptr[len] = '\0';
-            log_error("value error ret:%d\n%s\n", ret, ptr);
+    rep_hdr rep;
+    uint32_t want, off = 0, got = 0;
+    ssize_t len;
+    bool ok;
+
+    while (got < sizeof(rep_hdr)) {
+        len = ReadSome(fd, (uint8_t *)&rep + got, sizeof(rep_hdr) - got);
+        if (len <= 0)
+            goto fail;
+        got += len;
+    }
+
+    ok = rep.valLen == value_len_[k];
+    want = pad + rep.valLen;
+    got = 0;
+    while (got < want) {
+        len = ReadSome(fd, app_rcv_buf, want - got < RCV_BUF_SIZE ? want - got : RCV_BUF_SIZE);
+        if (len <= 0)
+            goto fail;
+
+        /* the padding comes first, only what follows it is value */
+        if (got + len > pad) {
+            uint32_t skip = got < pad ? pad - got : 0;
+            uint32_t n = len - skip;
+
+            if (ok && (off + n > value_len_[k] ||
+                    dataset_value_cmp(dataset_, k, off, app_rcv_buf + skip, n) != 0))
+                ok = false;
+            off += n;
         }
+        got += len;
+    }
 
-        off += len;
-        log_trace("rcvd_byte:%d\n", off);
+    if (!ok)
+        __atomic_add_fetch(&st->num_verify_fail, 1, __ATOMIC_RELAXED);
+    st->rx_bytes += sizeof(rep_hdr) + want;
+    st->value_bytes += rep.valLen;
+    return 0;
 
-        if (to_be_rcvd == off)
-            break;
+fail :
+    /* a probe interrupted while it spins */
+    if (run_test_)
+        log_error("read() fail, %s\n", len == 0 ? "closed" : strerror(errno));
+    return -1;
+}
 
-    } */
+static void
+CloseConnection(const int fd) {
+    close(fd);
+}
 
-    while ((len = read(fd, app_rcv_buf, RCV_BUF_SIZE)) > 0) 
-    {
-        if (first) {
-            rep_hdr *ptr;
-            first = false;
-            ptr = (rep_hdr *)app_rcv_buf;
-
-            rep.valLen = ptr->valLen;
-            rep.replyType = ptr->replyType;
-
-            if (rep.valLen != strlen((char *)value_[0])) {
-                log_error("value length error, valLen:%u, object len:%lu\n",
-                rep.valLen, strlen((char *)value_[0]));
-                close(fd);
-            }
-
-            if (memcmp(ptr->val, value_[0], len - sizeof(rep_hdr)) != 0) {
-                log_error("received object error\n");
-                close(fd);
-                return -1;
-            }
+/* One point of the sweep, GETs of the keys of the value class, one at a
+ * time, against the server that pads by hdr_pad_[pad_idx] */
+static void
+RunPoint(const int pad_idx, const int class_idx)
+{
+    const uint32_t lo = class_idx > 0 ? value_class_[class_idx - 1] : 0;
+    const uint32_t hi = value_class_[class_idx];
+    uint64_t start, end, ts, ns;
+    double p99;
+    uint32_t i, n = 0;
+    double sec;
+    int fd;
 
-            off += (len - sizeof(rep_hdr));
-        } else {
-            if (memcmp(app_rcv_buf, value_[0] + off, len) != 0) {
-                log_error("received object error\n");
-                close(fd);
-                return -1;
-            }
+    for (i = 0; i < num_key_values_; i++) {
+        if (value_len_[i] > lo && value_len_[i] <= hi)
+            class_keys_[n++] = i;
+    }
+    if (n == 0) {
+        fprintf(stdout, "%8u %10u  no keys\n", hdr_pad_[pad_idx], hi);
+        return;
+    }
+
+    memset(&stats_, 0, sizeof(stats_));
+    fd = CreateConnection(pad_idx);
+    if (fd < 0)
+        exit(EXIT_FAILURE);
+
+    start = latency_now_ns();
+    end = start + duration_sec_ * 1000000000LU;
+    for (i = 0; run_test_ && (ts = latency_now_ns()) < end; i++) {
+        if (SendGetRequest(fd, class_keys_[i % n]) < 0 ||
+                ReceiveReply(fd, class_keys_[i % n], hdr_pad_[pad_idx], &stats_) < 0)
+            exit(EXIT_FAILURE);
+        ns = latency_now_ns() - ts;
+        stats_.num_replies++;
+        stats_.total_latency_ns += ns;
+        stats_.hist.count[latency_bucket(ns)]++;
+    }
+    sec = (latency_now_ns() - start) / 1e9;
+    CloseConnection(fd);
+
+    p99 = latency_percentile(&stats_.hist, stats_.num_replies, 990) / 1000;
+
+    fprintf(stdout, "%8u %10u %10.1lf %12.0lf %12.3lf %12.3lf %10.1lf %9.0lf %8lu\n",
+            hdr_pad_[pad_idx], hi,
+            stats_.num_replies ? (double)stats_.value_bytes / stats_.num_replies : 0,
+            stats_.num_replies / sec,
+            stats_.rx_bytes / (sec * (1 << 20)), stats_.value_bytes / (sec * (1 << 20)),
+            stats_.num_replies ? (double)stats_.total_latency_ns / stats_.num_replies / 1000 : 0,
+            p99, stats_.num_verify_fail);
+}
 
-            off += len;
+/* One probe, a GET every 1/probe_rate_ seconds over the whole dataset.
+ * A reply later than the next slot moves the schedule instead of
+ * sending a burst to catch up. */
+static void *
+ProbeThread(void *arg)
+{
+    const int thread_no = (int)(intptr_t)arg;
+    point_stats_t *st = &probe_stats_[thread_no];
+    const uint64_t interval = 1000000000LU / probe_rate_;
+    struct timespec next_ts;
+    cpu_set_t cpus;
+    uint64_t next, ts, ns;
+    uint32_t k = thread_no;
+    int fd, flags;
+
+    if (num_probe_cpus_ > 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(probe_cpus_[thread_no % num_probe_cpus_], &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0) {
+            log_error("pthread_setaffinity_np() fail, cpu %u\n",
+                    probe_cpus_[thread_no % num_probe_cpus_]);
+            exit(EXIT_FAILURE);
         }
+    }
 
-        if (to_be_rcvd != off)
-            break;
+    fd = CreateConnection(0);
+    if (fd < 0)
+        exit(EXIT_FAILURE);
+
+    if (busy_poll_us_ > 0 &&
+            setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us_, sizeof(busy_poll_us_)) < 0) {
+        log_error("setsockopt(SO_BUSY_POLL) fail, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
     }
 
-    if (len <= 0) {
-        close(fd);
+    /* replies are polled for, never slept on */
+    flags = fcntl(fd, F_GETFL, 0);
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        log_error("fcntl() fail, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
     }
 
-    if (rep.valLen != strlen((char *)value_[0])) 
-    {
-        log_error("value length error, valLen:%u, object len:%lu\n",
-                rep.valLen, strlen((char *)value_[0]));
-        close(fd);
-        return -1;
+    next = latency_now_ns();
+    while (run_test_) {
+        next_ts.tv_sec = next / 1000000000LU;
+        next_ts.tv_nsec = next % 1000000000LU;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_ts, NULL);
+
+        k = (k + num_probe_threads_) % num_key_values_;
+        ts = latency_now_ns();
+        if (SendGetRequest(fd, k) < 0)
+            exit(EXIT_FAILURE);
+        if (ReceiveReply(fd, k, hdr_pad_[0], st) < 0) {
+            if (!run_test_)
+                break;
+            exit(EXIT_FAILURE);
+        }
+        ns = latency_now_ns() - ts;
+        /* RunProbe reads these every second while the probe runs */
+        __atomic_add_fetch(&st->total_latency_ns, ns, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&st->hist.count[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&st->num_replies, 1, __ATOMIC_RELAXED);
+
+        next += interval;
+        if (next < ts + ns)
+            next = ts + ns;
     }
-/*
-    if (memcmp(rep->val, value_[0], rep->valLen) != 0) 
-    {
-        char *ptr = (char *)rep->val;
-        ptr[rep->valLen] = '\0';
-        log_error("received object error\n, received:%s\n, sample object:%s\n",
-                ptr, (char *)value_[0]);
-        close(fd);
-        return -1;
-    }*/
 
-    return off; 
+    CloseConnection(fd);
+    return NULL;
 }
 
+/* Adds up the latency stats of all probes, with atomic loads as the
+ * probes may still be running */
 static void
-CloseConnection(const int fd) {
-    close(fd);
+SumProbeStats(point_stats_t *sum)
+{
+    int i, j;
+
+    memset(sum, 0, sizeof(point_stats_t));
+    for (i = 0; i < num_probe_threads_; i++) {
+        sum->num_replies += __atomic_load_n(&probe_stats_[i].num_replies, __ATOMIC_RELAXED);
+        sum->num_verify_fail += __atomic_load_n(&probe_stats_[i].num_verify_fail, __ATOMIC_RELAXED);
+        sum->total_latency_ns += __atomic_load_n(&probe_stats_[i].total_latency_ns, __ATOMIC_RELAXED);
+        for (j = 0; j < LAT_NUM_BUCKETS; j++)
+            sum->hist.count[j] += __atomic_load_n(&probe_stats_[i].hist.count[j], __ATOMIC_RELAXED);
+    }
+}
+
+/* Starts the probes and prints their latency every second, for the
+ * second just passed, and once more over the whole run */
+static void
+RunProbe(void)
+{
+    pthread_t threads[MAX_PROBE_THREADS];
+    point_stats_t *sum, *last;
+    latency_hist_t hist;
+    uint64_t start, end;
+    uint64_t num_replies;
+    int i, j;
+
+    probe_stats_ = calloc(num_probe_threads_, sizeof(point_stats_t));
+    sum = calloc(2, sizeof(point_stats_t));
+    if (!probe_stats_ || !sum) {
+        log_error("calloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    last = &sum[1];
+
+    for (i = 0; i < num_probe_threads_; i++) {
+        if (pthread_create(&threads[i], NULL, ProbeThread, (void *)(intptr_t)i) != 0) {
+            log_error("pthread_create() fail\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    start = latency_now_ns();
+    end = start + duration_sec_ * 1000000000LU;
+    while (run_test_ && (duration_sec_ == 0 || latency_now_ns() < end)) {
+        sleep(1);
+
+        SumProbeStats(sum);
+
+        /* counted off the histogram, the reply counter may be a sample
+         * ahead or behind it */
+        num_replies = 0;
+        for (j = 0; j < LAT_NUM_BUCKETS; j++) {
+            hist.count[j] = sum->hist.count[j] - last->hist.count[j];
+            num_replies += hist.count[j];
+        }
+        fprintf(stdout, "[Probe] #reqs:%-8lu avg:%8.1lfus p50:%6.0lfus p99:%6.0lfus p999:%6.0lfus"
+                " # verify fails : %lu\n", num_replies,
+                num_replies ? (double)(sum->total_latency_ns - last->total_latency_ns) / num_replies / 1000 : 0,
+                latency_percentile(&hist, num_replies, 500) / 1000,
+                latency_percentile(&hist, num_replies, 990) / 1000,
+                latency_percentile(&hist, num_replies, 999) / 1000,
+                sum->num_verify_fail - last->num_verify_fail);
+        memcpy(last, sum, sizeof(point_stats_t));
+    }
+
+    run_test_ = false;
+    for (i = 0; i < num_probe_threads_; i++)
+        pthread_join(threads[i], NULL);
+
+    /* the totals, now that every probe stopped */
+    SumProbeStats(sum);
+    for (j = 0; j < LAT_NUM_BUCKETS && sum->hist.count[j] == 0; j++)
+        ;
+    fprintf(stdout, "[Result] probe of %d threads, %u GETs/sec each, %.1lfs\n"
+            "#reqs:%lu min:%.0lfus avg:%.1lfus p50:%.0lfus p90:%.0lfus p99:%.0lfus p999:%.0lfus"
+            " # verify fails : %lu\n",
+            num_probe_threads_, probe_rate_, (latency_now_ns() - start) / 1e9,
+            sum->num_replies, j < LAT_NUM_BUCKETS ? latency_bucket_ns(j) / 1000 : 0,
+            sum->num_replies ? (double)sum->total_latency_ns / sum->num_replies / 1000 : 0,
+            latency_percentile(&sum->hist, sum->num_replies, 500) / 1000,
+            latency_percentile(&sum->hist, sum->num_replies, 900) / 1000,
+            latency_percentile(&sum->hist, sum->num_replies, 990) / 1000,
+            latency_percentile(&sum->hist, sum->num_replies, 999) / 1000,
+            sum->num_verify_fail);
+
+    free(sum);
+    free(probe_stats_);
 }
 
 static void
@@ -291,38 +532,107 @@ SigInteruuptHandler(int signo)
     run_test_ = false;
 }
 
-int 
+int
 main(const int argc, char *argv[]) {
 
-    int fd, len, opt;
-    daddr = inet_addr("10.0.30.110");
-    dport = htons(65000);
+    char *saveptr, *p, *colon;
+    int opt, i, j;
+
+    daddr_[0] = inet_addr("10.0.30.110");
+    dport_[0] = htons(65000);
 
     signal(SIGINT, SigInteruuptHandler);
 
-    while((opt = getopt(argc, argv, "n:")) != -1)
+    while((opt = getopt(argc, argv, "n:S:H:V:T:r:P:C:B:i:")) != -1)
     {
         switch(opt) {
             case 'n' :
                 num_key_values_ = atoi(optarg);
                 break;
+            case 'i' :
+                dataset_path_ = optarg;
+                break;
+            case 'S' :
+                for (p = strtok_r(optarg, ",", &saveptr); p; p = strtok_r(NULL, ",", &saveptr)) {
+                    colon = strchr(p, ':');
+                    if (!colon || num_servers_ == MAX_POINTS) {
+                        log_error("invalid server %s, ip:port[,ip:port...]\n", p);
+                        return -1;
+                    }
+                    *colon = '\0';
+                    if (inet_pton(AF_INET, p, &daddr_[num_servers_]) != 1) {
+                        log_error("invalid server address %s\n", p);
+                        return -1;
+                    }
+                    dport_[num_servers_] = htons(atoi(colon + 1));
+                    num_servers_++;
+                }
+                break;
+            case 'H' :
+                if ((num_pads_ = ParseList(optarg, hdr_pad_, MAX_POINTS)) < 0) {
+                    log_error("invalid padding list %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'V' :
+                if ((num_classes_ = ParseList(optarg, value_class_, MAX_POINTS)) < 0) {
+                    log_error("invalid value size list %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'T' :
+                duration_sec_ = atoi(optarg);
+                break;
+            case 'r' :
+                probe_rate_ = atoi(optarg);
+                break;
+            case 'P' :
+                num_probe_threads_ = atoi(optarg);
+                break;
+            case 'C' :
+                if ((num_probe_cpus_ = ParseList(optarg, probe_cpus_, MAX_PROBE_THREADS)) < 0) {
+                    log_error("invalid cpu list %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'B' :
+                busy_poll_us_ = atoi(optarg);
+                break;
+            default :
+                log_error("invalid argument %c error\n", (char)opt);
+                return -1;
         }
     }
 
+    if (num_servers_ == 0)
+        num_servers_ = 1;
+    if (num_servers_ != num_pads_) {
+        log_error("need one server per padding size, %d servers for %d sizes\n",
+                num_servers_, num_pads_);
+        return -1;
+    }
+
     SetupKeyValue();
-    fd = CreateConnection();
 
-    while (run_test_) {
-        len = SendGetRequest(fd);
-        log_trace("Send byte length : %d\n", len);
-        len = ReceiveReply(fd);
-        if (len < 0) {
-            exit(EXIT_FAILURE);
+    if (probe_rate_ > 0) {
+        if (num_pads_ != 1 || num_probe_threads_ < 1 || num_probe_threads_ > MAX_PROBE_THREADS) {
+            log_error("a probe takes one server and 1 to %d threads\n", MAX_PROBE_THREADS);
+            return -1;
         }
-        log_trace("Received byte length : %d\n", len);
-        break;
+        RunProbe();
+        DestroyKeyValue();
+        return 0;
     }
-    CloseConnection(fd);
+
+    fprintf(stdout, "%8s %10s %10s %12s %12s %12s %10s %9s %8s\n",
+            "pad", "value<=", "avg value", "reqs/sec", "rx(MB/sec)", "good(MB/sec)",
+            "avg(us)", "p99(us)", "verify");
+
+    for (i = 0; i < num_pads_ && run_test_; i++) {
+        for (j = 0; j < num_classes_ && run_test_; j++)
+            RunPoint(i, j);
+    }
+
     DestroyKeyValue();
     return 0;
 }
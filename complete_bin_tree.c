@@ -164,7 +164,8 @@ complete_bin_tree_get_random_item(void) {
     assert(n_items > 0);
 
     do {
-        uint64_t seq = rand() % n_items;  
+        /* sequence numbers start at 1, the root */
+        uint64_t seq = rand() % n_items + 1;
         it = SearchItem(seq);
     } while (!__atomic_load_n(&it->active, __ATOMIC_RELAXED));
 
@@ -11,7 +11,6 @@ connection_pool_t *
 connection_create_pool(const ssize_t num_total_elements) 
 {
     connection_pool_t *cp;
-    int i;
     
     cp = malloc(sizeof(connection_pool_t));
     if (!cp){
@@ -19,27 +18,66 @@ connection_create_pool(const ssize_t num_total_elements)
         exit(EXIT_FAILURE);
     }
 
+    cp->chunks = NULL;
+    cp->head = NULL;
+    cp->num_total_elements = num_total_elements;
+    cp->num_allocated_elements = 0;
+    cp->num_free_elements = num_total_elements;
+
+    return cp;
+}
+
+/* Backs up to CONNECTION_POOL_CHUNK more connections with huge pages,
+ * rounded to whole pages */
+static int
+GrowPool(connection_pool_t *cp)
+{
+    connection_chunk_t *chunk;
     long hugepagesize = gethugepagesize();
-    size_t len = (sizeof(connection_t) * num_total_elements / hugepagesize + 1) * hugepagesize;
+    const ssize_t remaining = cp->num_total_elements - cp->num_allocated_elements;
+    ssize_t n = remaining < CONNECTION_POOL_CHUNK ? remaining : CONNECTION_POOL_CHUNK;
+    size_t len;
+    ssize_t i;
+
+    if (n <= 0)
+        return -1;
+
+    /* the tail of the last page holds more connections for free */
+    len = (sizeof(connection_t) * n / hugepagesize + 1) * hugepagesize;
+    n = (ssize_t)(len / sizeof(connection_t)) < remaining ? (ssize_t)(len / sizeof(connection_t)) : remaining;
 
-    cp->mem = get_huge_pages(len ,GHP_DEFAULT);
-    if (!cp->mem) {
+    chunk = malloc(sizeof(connection_chunk_t));
+    if (!chunk) {
+        fprintf(stderr, "malloc() error, %s\n", strerror(errno));
+        return -1;
+    }
+
+    chunk->mem = get_huge_pages(len ,GHP_DEFAULT);
+    if (!chunk->mem) {
         fprintf(stderr, "get_huge_pages() error, %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+        free(chunk);
+        return -1;
     }
+    chunk->num_elements = n;
 
-    for (i = 0; i < num_total_elements - 1; i++) {
-        cp->mem[i].state = CONNECTION_UNUSED;
-        cp->mem[i].next = &cp->mem[i+1];
+    for (i = 0; i < n - 1; i++) {
+        chunk->mem[i].state = CONNECTION_UNUSED;
+        chunk->mem[i].next = &chunk->mem[i+1];
+        chunk->mem[i].hstate = NULL;
+        chunk->mem[i].buf = NULL;
     }
 
-    cp->mem[num_total_elements - 1].next = NULL;
+    chunk->mem[n - 1].state = CONNECTION_UNUSED;
+    chunk->mem[n - 1].next = cp->head;
+    chunk->mem[n - 1].hstate = NULL;
+    chunk->mem[n - 1].buf = NULL;
 
-    cp->head = &cp->mem[0];
-    cp->num_total_elements = num_total_elements;
-    cp->num_free_elements = num_total_elements;
+    chunk->next = cp->chunks;
+    cp->chunks = chunk;
+    cp->head = &chunk->mem[0];
+    cp->num_allocated_elements += n;
 
-    return cp;
+    return 0;
 }
 
 connection_t *
@@ -47,9 +85,9 @@ connection_allocate(connection_pool_t *cp)
 {
     connection_t *c;
 
-    if (!cp->head) {
-        printf("%ld\n", cp->num_free_elements);
-        assert(cp->num_free_elements == 0);
+    if (!cp->head && GrowPool(cp) < 0) {
+        assert(cp->num_free_elements == 0 ||
+               cp->num_allocated_elements < cp->num_total_elements);
         return NULL;
     }
 
@@ -80,17 +118,39 @@ connection_deallocate(connection_pool_t *cp, connection_t *c)
     c->state = CONNECTION_UNUSED;
     c->it = NULL;
     c->buflen = 0;
+    c->ring_head = 0;
+    c->ring_count = 0;
+    c->ring_unsent = 0;
+    c->txoff = 0;
+    c->rep_hdrlen = 0;
+    c->rep_off = 0;
+    c->txlen = 0;
+    c->uring_ops = 0;
+    c->tx_busy = false;
+    c->setup_done = false;
     cp->num_free_elements++;
 }
 
 void
 connection_destroy_pool(connection_pool_t **cp)
 {
-    int i;
-    for (i = 0; i < (*cp)->num_total_elements; i++) {
-        close((*cp)->mem[i].fd);
+    connection_chunk_t *chunk, *next;
+    connection_t *c;
+    ssize_t i;
+
+    for (chunk = (*cp)->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        for (i = 0; i < chunk->num_elements; i++) {
+            c = &chunk->mem[i];
+            if (c->state != CONNECTION_UNUSED)
+                close(c->fd);
+            if (c->hstate)
+                XXH3_freeState(c->hstate);
+            free(c->buf);
+        }
+        free_huge_pages(chunk->mem);
+        free(chunk);
     }
-    free_huge_pages((*cp)->mem);
     free(*cp);
     *cp = NULL;
 }
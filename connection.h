@@ -6,7 +6,19 @@
 #include <sys/types.h>
 #include <wchar.h>
 #include <time.h>
+#include <stdbool.h>
+#include <xxhash.h>
 #include "hashtable.h"
+#include "coroutine.h"
+
+/* requests that may be in flight on one connection at a time,
+ * must be a power of 2 */
+#define CONNECTION_MAX_PIPELINE_DEPTH   64
+#define CONNECTION_RING_MASK            (CONNECTION_MAX_PIPELINE_DEPTH - 1)
+
+/* connections a pool backs with memory at a time, pools grow on demand
+ * up to their size */
+#define CONNECTION_POOL_CHUNK           (1024)
 
 enum connection_state {
     CONNECTION_USED                 =   0,
@@ -15,23 +27,57 @@ enum connection_state {
     CONNECTION_WAIT_FOR_REPLY       =   3,
     CONNECTION_RCV_REPLY_AGAIN      =   4,
     CONNECTION_UNUSED               =   5,
+    CONNECTION_CLOSING              =   6,
 };
 
 typedef struct connection_s {
     int fd;
     enum connection_state state;
+    uint16_t server;        /* index of the target server, set by the owner */
     struct connection_s *next;
     struct timespec ts;
     kv_hashtable_item_t *it;
-    uint8_t buf[16384];
+    uint8_t *buf;           /* io_uring send staging, allocated on first use */
     uint16_t buflen;
+    /* ring of in-flight requests, replies arrive in ring order */
+    kv_hashtable_item_t *ring[CONNECTION_MAX_PIPELINE_DEPTH];
+    uint64_t ring_ts[CONNECTION_MAX_PIPELINE_DEPTH];  /* CLOCK_MONOTONIC ns the request was queued */
+    uint8_t ring_op[CONNECTION_MAX_PIPELINE_DEPTH];   /* request type of each slot */
+    uint8_t ring_frame[CONNECTION_MAX_PIPELINE_DEPTH];    /* keys of the frame starting here, 0 inside a multi-get */
+    uint16_t ring_head;
+    uint16_t ring_count;
+    uint16_t ring_unsent;   /* requests at the tail not fully written yet */
+    uint32_t txoff;         /* bytes of the first unsent request already written */
+    /* reply currently being parsed from the stream */
+    uint8_t rep_hdr[4];
+    uint8_t rep_hdrlen;
+    uint32_t rep_valLen;
+    uint32_t rep_off;
+    uint16_t rep_pad;       /* header padding still to skip */
+    bool rep_verify;
+    XXH3_state_t *hstate;   /* digest of the reply being parsed, created on demand */
+    struct timespec open_ts;    /* CLOCK_MONOTONIC, taken before socket() */
+    bool setup_done;
+    /* io_uring backend */
+    uint32_t txlen;         /* bytes staged in buf for the pending send */
+    uint8_t uring_ops;      /* submitted requests not completed yet */
+    bool tx_busy;
+    /* coro backend */
+    coroutine_t co;
 } connection_t;
 
-typedef struct connection_pool_s {
+typedef struct connection_chunk_s {
+    struct connection_chunk_s *next;
     connection_t *mem;
+    ssize_t num_elements;
+} connection_chunk_t;
+
+typedef struct connection_pool_s {
+    connection_chunk_t *chunks;
     connection_t *head;
     ssize_t num_total_elements;
-    ssize_t num_free_elements;
+    ssize_t num_allocated_elements; /* backed by a chunk so far */
+    ssize_t num_free_elements;      /* may still be handed out, allocated or not */
 }connection_pool_t;
 
 connection_pool_t *connection_create_pool(const ssize_t num_total_elements);
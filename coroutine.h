@@ -0,0 +1,46 @@
+#ifndef __COROUTINE_H__
+#define __COROUTINE_H__
+
+/* Stackless coroutines in the style of protothreads. The body of a
+ * coroutine function sits between CO_BEGIN and CO_END, and the function
+ * is called again on every event of the object it runs for. CO_YIELD
+ * returns CO_WAITING and the next call resumes right after it, so a
+ * flow of several non-blocking steps reads top to bottom.
+ *
+ * Locals do not survive a yield, keep the state in the object. A yield
+ * may not sit inside a switch of its own. The resume point is a line
+ * number, one yield per line. */
+
+typedef struct coroutine_s {
+    int line;               /* resume point, 0 before the first call */
+} coroutine_t;
+
+enum co_status {
+    CO_WAITING  =   0,
+    CO_DONE     =   1,
+};
+
+#define CO_INIT(_co)        ((_co)->line = 0)
+
+#define CO_BEGIN(_co)       switch ((_co)->line) { case 0:
+
+#define CO_YIELD(_co)       do {\
+    (_co)->line = __LINE__;\
+    return CO_WAITING;\
+    case __LINE__: ;\
+} while(0)
+
+/* yields, then keeps yielding until _cond holds. _cond is evaluated on
+ * every later call, with the event that call brought, and a local it
+ * sets is good until the next yield. */
+#define CO_AWAIT(_co, _cond) do {\
+    (_co)->line = __LINE__;\
+    return CO_WAITING;\
+    case __LINE__:\
+    if (!(_cond))\
+        return CO_WAITING;\
+} while(0)
+
+#define CO_END(_co)         } (_co)->line = 0; return CO_DONE
+
+#endif
@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <xxhash.h>
+#include "dataset.h"
+
+#define INDEX_BUF_ENTRIES   (1 << 14)
+#define PAYLOAD_BUF_SIZE    (1 << 22)
+#define SYNTH_CMP_CHUNK     (256)
+
+static int FlushIndex(dataset_writer_t *w);
+static int FlushPayload(dataset_writer_t *w);
+static uint64_t Mix64(uint64_t z);
+
+int
+dataset_write_at(const int fd, const void *buf, size_t len, uint64_t off)
+{
+    const uint8_t *p = buf;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = pwrite(fd, p, len, off);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("pwrite() error");
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+        off += ret;
+    }
+    return 0;
+}
+
+uint64_t
+dataset_index_offset(const uint64_t num_items)
+{
+    (void)num_items;
+    return sizeof(dataset_header_t);
+}
+
+uint64_t
+dataset_payload_offset(const uint64_t num_items)
+{
+    return dataset_index_offset(num_items) + num_items * sizeof(dataset_entry_t);
+}
+
+void
+dataset_fill_entry(dataset_entry_t *e, const uint64_t off, const void *key, const uint16_t key_len,
+        const void *value, const uint32_t value_len)
+{
+    e->off = off;
+    e->value_len = value_len;
+    e->key_len = key_len;
+    e->reserved = 0;
+    e->hash = XXH3_64bits(key, key_len);
+    e->digest = XXH3_64bits(value, value_len);
+}
+
+void
+dataset_init_header(dataset_header_t *hdr, const uint64_t num_items, const uint64_t payload_len,
+        const uint32_t flags, const uint64_t seed)
+{
+    memset(hdr, 0, sizeof(dataset_header_t));
+    hdr->magic = DATASET_MAGIC;
+    hdr->version = DATASET_VERSION;
+    hdr->entry_size = sizeof(dataset_entry_t);
+    hdr->num_items = num_items;
+    hdr->index_off = dataset_index_offset(num_items);
+    hdr->payload_off = dataset_payload_offset(num_items);
+    hdr->payload_len = payload_len;
+    hdr->flags = flags;
+    hdr->seed = seed;
+}
+
+/* splitmix64 finalizer */
+static inline uint64_t
+Mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Counter based: word j of a value is the mix of a per value key plus
+ * j, so that any slice is generated without the bytes before it */
+void
+dataset_synth_value(uint8_t *buf, const uint64_t hash, const uint64_t seed,
+        const uint32_t value_len, const uint32_t off, uint32_t len)
+{
+    const uint64_t k = Mix64(hash ^ Mix64(seed + value_len));
+    uint64_t j = off >> 3, w;
+    uint32_t skip = off & 7, n;
+
+    while (len > 0) {
+        w = dataset_letters(Mix64(k + j * 0x9e3779b97f4a7c15ULL));
+        n = 8 - skip < len ? 8 - skip : len;
+        memcpy(buf, (uint8_t *)&w + skip, n);
+        buf += n;
+        len -= n;
+        skip = 0;
+        j++;
+    }
+}
+
+int
+dataset_synth_cmp(const void *buf, const uint64_t hash, const uint64_t seed,
+        const uint32_t value_len, const uint32_t off, uint32_t len)
+{
+    uint8_t expect[SYNTH_CMP_CHUNK];
+    const uint8_t *p = buf;
+    uint32_t pos = off, n;
+
+    if ((uint64_t)off + len > value_len)
+        return -1;
+
+    while (len > 0) {
+        n = len < SYNTH_CMP_CHUNK ? len : SYNTH_CMP_CHUNK;
+        dataset_synth_value(expect, hash, seed, value_len, pos, n);
+        if (memcmp(p, expect, n) != 0)
+            return -1;
+        p += n;
+        pos += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int
+dataset_value_cmp(const dataset_t *ds, const uint64_t i, const uint32_t off,
+        const void *buf, const uint32_t len)
+{
+    if ((uint64_t)off + len > dataset_value_len(ds, i))
+        return -1;
+
+    if (ds->synth)
+        return dataset_synth_cmp(buf, dataset_hash(ds, i), ds->seed, dataset_value_len(ds, i), off, len);
+
+    return memcmp(buf, dataset_value(ds, i) + off, len) != 0 ? -1 : 0;
+}
+
+int
+dataset_check_key_len(const dataset_t *ds, const uint64_t n, const uint32_t max_key_len)
+{
+    uint64_t i;
+
+    for (i = 0; i < n && i < ds->num_items; i++) {
+        if (dataset_key_len(ds, i) > max_key_len) {
+            fprintf(stderr, "key %lu is %u bytes, a request holds %u at most\n",
+                    i, dataset_key_len(ds, i), max_key_len);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+dataset_t *
+dataset_open(const char *path)
+{
+    int fd;
+    struct stat st;
+    void *map;
+    const dataset_header_t *hdr;
+    const dataset_entry_t *e;
+    dataset_t *ds;
+    uint64_t i;
+    bool synth;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Fail to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        perror("fstat() error");
+        close(fd);
+        return NULL;
+    }
+
+    if ((size_t)st.st_size < sizeof(dataset_header_t)) {
+        fprintf(stderr, "%s is not a dataset, too short\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap() error");
+        return NULL;
+    }
+
+    hdr = map;
+    if (hdr->magic != DATASET_MAGIC || hdr->version != DATASET_VERSION ||
+            hdr->entry_size != sizeof(dataset_entry_t)) {
+        fprintf(stderr, "%s is not a version %d dataset\n", path, DATASET_VERSION);
+        goto err;
+    }
+
+    if (hdr->index_off < sizeof(dataset_header_t) ||
+            hdr->num_items > (st.st_size - hdr->index_off) / sizeof(dataset_entry_t) ||
+            hdr->payload_off < hdr->index_off + hdr->num_items * sizeof(dataset_entry_t) ||
+            hdr->payload_off > (uint64_t)st.st_size ||
+            hdr->payload_len > st.st_size - hdr->payload_off) {
+        fprintf(stderr, "%s is truncated or corrupt\n", path);
+        goto err;
+    }
+
+    synth = (hdr->flags & DATASET_FLAG_SYNTH) != 0;
+    e = (const dataset_entry_t *)((uint8_t *)map + hdr->index_off);
+    for (i = 0; i < hdr->num_items; i++) {
+        if (e[i].off > hdr->payload_len ||
+                (uint64_t)e[i].key_len + (synth ? 0 : e[i].value_len) > hdr->payload_len - e[i].off) {
+            fprintf(stderr, "%s: item %lu out of the payload\n", path, i);
+            goto err;
+        }
+    }
+
+    ds = malloc(sizeof(dataset_t));
+    if (!ds) {
+        perror("malloc() error");
+        goto err;
+    }
+
+    ds->map = map;
+    ds->map_len = st.st_size;
+    ds->num_items = hdr->num_items;
+    ds->index = e;
+    ds->payload = (const uint8_t *)map + hdr->payload_off;
+    ds->synth = synth;
+    ds->seed = hdr->seed;
+
+    /* Every client walks the whole payload right away */
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    return ds;
+
+err:
+    munmap(map, st.st_size);
+    return NULL;
+}
+
+void
+dataset_close(dataset_t *ds)
+{
+    if (!ds)
+        return;
+    munmap(ds->map, ds->map_len);
+    free(ds);
+}
+
+dataset_writer_t *
+dataset_writer_open(const char *path, const uint64_t num_items)
+{
+    dataset_writer_t *w;
+
+    w = calloc(1, sizeof(dataset_writer_t));
+    if (!w) {
+        perror("calloc() error");
+        return NULL;
+    }
+
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        fprintf(stderr, "Fail to create %s: %s\n", path, strerror(errno));
+        free(w);
+        return NULL;
+    }
+
+    w->num_items = num_items;
+    w->index_buf = malloc(INDEX_BUF_ENTRIES * sizeof(dataset_entry_t));
+    w->payload_buf = malloc(PAYLOAD_BUF_SIZE);
+    if (!w->index_buf || !w->payload_buf) {
+        perror("malloc() error");
+        close(w->fd);
+        free(w->index_buf);
+        free(w->payload_buf);
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+static int
+FlushIndex(dataset_writer_t *w)
+{
+    if (w->index_buflen == 0)
+        return 0;
+    if (dataset_write_at(w->fd, w->index_buf, w->index_buflen,
+                dataset_index_offset(w->num_items) + w->index_flushed) < 0)
+        return -1;
+    w->index_flushed += w->index_buflen;
+    w->index_buflen = 0;
+    return 0;
+}
+
+static int
+FlushPayload(dataset_writer_t *w)
+{
+    if (w->payload_buflen == 0)
+        return 0;
+    if (dataset_write_at(w->fd, w->payload_buf, w->payload_buflen,
+                dataset_payload_offset(w->num_items) + w->payload_flushed) < 0)
+        return -1;
+    w->payload_flushed += w->payload_buflen;
+    w->payload_buflen = 0;
+    return 0;
+}
+
+int
+dataset_writer_add(dataset_writer_t *w, const void *key, const uint16_t key_len,
+        const void *value, const uint32_t value_len)
+{
+    dataset_entry_t e;
+    size_t len = (size_t)key_len + value_len;
+
+    if (w->next >= w->num_items) {
+        fprintf(stderr, "dataset holds %lu items only\n", w->num_items);
+        return -1;
+    }
+
+    dataset_fill_entry(&e, w->payload_len, key, key_len, value, value_len);
+
+    if (w->index_buflen + sizeof(dataset_entry_t) > INDEX_BUF_ENTRIES * sizeof(dataset_entry_t) &&
+            FlushIndex(w) < 0)
+        return -1;
+    memcpy(w->index_buf + w->index_buflen, &e, sizeof(dataset_entry_t));
+    w->index_buflen += sizeof(dataset_entry_t);
+
+    if (w->payload_buflen + len > PAYLOAD_BUF_SIZE && FlushPayload(w) < 0)
+        return -1;
+
+    if (len > PAYLOAD_BUF_SIZE) {
+        /* Bigger than the buffer, straight to the file */
+        uint64_t off = dataset_payload_offset(w->num_items) + w->payload_flushed;
+        if (dataset_write_at(w->fd, key, key_len, off) < 0 ||
+                dataset_write_at(w->fd, value, value_len, off + key_len) < 0)
+            return -1;
+        w->payload_flushed += len;
+    } else {
+        memcpy(w->payload_buf + w->payload_buflen, key, key_len);
+        memcpy(w->payload_buf + w->payload_buflen + key_len, value, value_len);
+        w->payload_buflen += len;
+    }
+
+    w->payload_len += len;
+    w->next++;
+
+    return 0;
+}
+
+int
+dataset_writer_close(dataset_writer_t *w)
+{
+    dataset_header_t hdr;
+    int ret = 0;
+
+    if (FlushIndex(w) < 0 || FlushPayload(w) < 0)
+        ret = -1;
+
+    if (w->next != w->num_items) {
+        fprintf(stderr, "dataset got %lu of %lu items\n", w->next, w->num_items);
+        ret = -1;
+    }
+
+    /* The header goes last, a half written file never passes
+     * dataset_open() */
+    if (ret == 0) {
+        dataset_init_header(&hdr, w->num_items, w->payload_len, 0, 0);
+        if (dataset_write_at(w->fd, &hdr, sizeof(hdr), 0) < 0)
+            ret = -1;
+    }
+
+    if (close(w->fd) < 0) {
+        perror("close() error");
+        ret = -1;
+    }
+
+    free(w->index_buf);
+    free(w->payload_buf);
+    free(w);
+
+    return ret;
+}
@@ -0,0 +1,148 @@
+#ifndef __DATASET_H__
+#define __DATASET_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Binary key-value dataset, mapped and read in place.
+ *
+ *   dataset_header_t
+ *   dataset_entry_t  index[num_items]
+ *   payload          key and value of every item, back to back
+ *
+ * All fields are little-endian. An entry points at its key, the value
+ * follows right after it.
+ *
+ * With DATASET_FLAG_SYNTH the payload holds the keys only. Every value
+ * is a function of the key hash, the value length and the seed in the
+ * header, regenerated by dataset_synth_value() wherever it is needed,
+ * so that clients never keep values around. The digest of an entry is
+ * still the one of its synthesized value. */
+#define DATASET_MAGIC       (0x315344564b43494eLU)  /* "NICKVDS1" */
+#define DATASET_VERSION     (1)
+#define DATASET_PATH        "sample_key_value.dat"
+
+#define DATASET_FLAG_SYNTH  (0x1)
+
+typedef struct dataset_header_s {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t entry_size;        /* sizeof(dataset_entry_t) */
+    uint64_t num_items;
+    uint64_t index_off;         /* from the start of the file */
+    uint64_t payload_off;
+    uint64_t payload_len;
+    uint32_t flags;             /* DATASET_FLAG_* */
+    uint32_t reserved;
+    uint64_t seed;              /* of the values with DATASET_FLAG_SYNTH */
+} dataset_header_t;
+
+typedef struct dataset_entry_s {
+    uint64_t off;               /* of the key, from payload_off */
+    uint32_t value_len;
+    uint16_t key_len;
+    uint16_t reserved;
+    uint64_t hash;              /* XXH3 of the key */
+    uint64_t digest;            /* XXH3 of the value */
+} dataset_entry_t;
+
+typedef struct dataset_s {
+    void *map;
+    size_t map_len;
+    uint64_t num_items;
+    const dataset_entry_t *index;
+    const uint8_t *payload;
+    bool synth;                 /* DATASET_FLAG_SYNTH, no dataset_value() */
+    uint64_t seed;
+} dataset_t;
+
+/* Writes a dataset of num_items in order, the index and payload go
+ * through buffers of their own */
+typedef struct dataset_writer_s {
+    int fd;
+    uint64_t num_items;
+    uint64_t next;              /* items added so far */
+    uint64_t payload_len;
+    uint8_t *index_buf;
+    size_t index_buflen;
+    uint64_t index_flushed;     /* bytes of the index on disk */
+    uint8_t *payload_buf;
+    size_t payload_buflen;
+    uint64_t payload_flushed;
+} dataset_writer_t;
+
+#define dataset_key(_ds, _i)        ((_ds)->payload + (_ds)->index[_i].off)
+#define dataset_value(_ds, _i)      (dataset_key(_ds, _i) + (_ds)->index[_i].key_len)
+#define dataset_key_len(_ds, _i)    ((_ds)->index[_i].key_len)
+#define dataset_value_len(_ds, _i)  ((_ds)->index[_i].value_len)
+#define dataset_hash(_ds, _i)       ((_ds)->index[_i].hash)
+#define dataset_digest(_ds, _i)     ((_ds)->index[_i].digest)
+
+/* Eight random bytes into eight letters at once: every byte b picks
+ * letter b * 52 / 256, 'A'-'Z' then 'a'-'z' */
+static inline uint64_t
+dataset_letters(const uint64_t x)
+{
+    const uint64_t m = 0x00ff00ff00ff00ffULL;
+    uint64_t v;
+
+    v = (((x & m) * 52) >> 8) & m;
+    v |= (((((x >> 8) & m) * 52) >> 8) & m) << 8;
+    v += 0x4141414141414141ULL;
+    v += (((v + 0x2525252525252525ULL) & 0x8080808080808080ULL) >> 7) * 6;
+
+    return v;
+}
+
+/* Bytes [off, off + len) of the synthesized value of value_len bytes
+ * for the key whose XXH3 is hash. Any range comes out the same as the
+ * matching slice of the whole value. */
+void dataset_synth_value(uint8_t *buf, const uint64_t hash, const uint64_t seed,
+        const uint32_t value_len, const uint32_t off, uint32_t len);
+/* 0 if buf matches bytes [off, off + len) of that value */
+int dataset_synth_cmp(const void *buf, const uint64_t hash, const uint64_t seed,
+        const uint32_t value_len, const uint32_t off, uint32_t len);
+/* 0 if buf matches bytes [off, off + len) of the value of item i,
+ * stored or synthesized */
+int dataset_value_cmp(const dataset_t *ds, const uint64_t i, const uint32_t off,
+        const void *buf, const uint32_t len);
+
+/* 0 if none of the first n items has a key longer than max_key_len,
+ * else -1 with a message. The clients' req_hdr holds keyLen in one
+ * byte, they check against UINT8_MAX. */
+int dataset_check_key_len(const dataset_t *ds, const uint64_t n, const uint32_t max_key_len);
+
+/* Maps the file read-only and checks the header and index bounds.
+ * Returns NULL on error. */
+dataset_t *dataset_open(const char *path);
+void dataset_close(dataset_t *ds);
+
+/* File offsets of the parts of a dataset of num_items */
+uint64_t dataset_index_offset(const uint64_t num_items);
+uint64_t dataset_payload_offset(const uint64_t num_items);
+
+/* Fills the index entry of an item whose key lies off bytes into the
+ * payload */
+void dataset_fill_entry(dataset_entry_t *e, const uint64_t off, const void *key, const uint16_t key_len,
+        const void *value, const uint32_t value_len);
+
+/* Fills the header of a dataset of num_items with payload_len bytes of
+ * payload, flags and seed for DATASET_FLAG_SYNTH */
+void dataset_init_header(dataset_header_t *hdr, const uint64_t num_items, const uint64_t payload_len,
+        const uint32_t flags, const uint64_t seed);
+
+/* pwrite() of all len bytes at off, retried on short writes and EINTR.
+ * For writers that lay a dataset out themselves. */
+int dataset_write_at(const int fd, const void *buf, size_t len, uint64_t off);
+
+/* Creates path for exactly num_items, added one by one. Returns NULL on
+ * error. */
+dataset_writer_t *dataset_writer_open(const char *path, const uint64_t num_items);
+int dataset_writer_add(dataset_writer_t *w, const void *key, const uint16_t key_len,
+        const void *value, const uint32_t value_len);
+/* Flushes and writes the header, -1 if fewer items than promised came
+ * or a write failed */
+int dataset_writer_close(dataset_writer_t *w);
+
+#endif
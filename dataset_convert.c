@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "dataset.h"
+
+/* Imports a keyLen,key,valLen,val text file into the binary dataset the
+ * clients map, see dataset.h. Keys and values are sliced by their
+ * lengths, so a comma in a value or a line longer than any buffer is
+ * fine.
+ *
+ * With -m it materializes a synthesized dataset instead, writing out
+ * every value for a server that loads plain datasets. */
+
+static int ParseLine(char *line, const ssize_t len, char **key, uint16_t *keyLen,
+        char **val, uint32_t *valLen);
+static int Materialize(const char *in, const char *out);
+
+static int
+ParseLine(char *line, const ssize_t len, char **key, uint16_t *keyLen,
+        char **val, uint32_t *valLen)
+{
+    char *p = line, *end = line + len, *next;
+    unsigned long n;
+
+    errno = 0;
+    n = strtoul(p, &next, 10);
+    if (errno || next == p || *next != ',' || n > UINT16_MAX)
+        return -1;
+    p = next + 1;
+    if (n > (unsigned long)(end - p))
+        return -1;
+    *key = p;
+    *keyLen = n;
+    p += n;
+
+    if (p >= end || *p != ',')
+        return -1;
+    p++;
+
+    n = strtoul(p, &next, 10);
+    if (errno || next == p || *next != ',' || n > UINT32_MAX)
+        return -1;
+    p = next + 1;
+    if (n > (unsigned long)(end - p))
+        return -1;
+    *val = p;
+    *valLen = n;
+
+    return 0;
+}
+
+static int
+Materialize(const char *in, const char *out)
+{
+    dataset_t *ds;
+    dataset_writer_t *w;
+    uint8_t *val;
+    uint32_t max_valLen = 0;
+    uint64_t i;
+
+    if (!(ds = dataset_open(in)))
+        return -1;
+
+    if (!ds->synth) {
+        fprintf(stderr, "%s holds its values already\n", in);
+        dataset_close(ds);
+        return -1;
+    }
+
+    for (i = 0; i < ds->num_items; i++) {
+        if (dataset_value_len(ds, i) > max_valLen)
+            max_valLen = dataset_value_len(ds, i);
+    }
+
+    val = malloc(max_valLen + 1);
+    if (!val) {
+        perror("malloc() error");
+        dataset_close(ds);
+        return -1;
+    }
+
+    if (!(w = dataset_writer_open(out, ds->num_items))) {
+        free(val);
+        dataset_close(ds);
+        return -1;
+    }
+
+    for (i = 0; i < ds->num_items; i++) {
+        dataset_synth_value(val, dataset_hash(ds, i), ds->seed, dataset_value_len(ds, i),
+                0, dataset_value_len(ds, i));
+        if (dataset_writer_add(w, dataset_key(ds, i), dataset_key_len(ds, i),
+                    val, dataset_value_len(ds, i)) < 0) {
+            dataset_writer_close(w);
+            remove(out);
+            free(val);
+            dataset_close(ds);
+            return -1;
+        }
+    }
+
+    free(val);
+
+    if (dataset_writer_close(w) < 0) {
+        dataset_close(ds);
+        return -1;
+    }
+
+    printf("%lu items materialized, %s -> %s\n", ds->num_items, in, out);
+    dataset_close(ds);
+
+    return 0;
+}
+
+int
+main(const int argc, char *argv[])
+{
+    FILE *in;
+    dataset_writer_t *w;
+    char *line = NULL, *key, *val;
+    size_t cap = 0;
+    ssize_t len;
+    uint64_t num_items = 0, lineno = 0;
+    uint16_t keyLen;
+    uint32_t valLen;
+
+    if (argc == 4 && strcmp(argv[1], "-m") == 0)
+        return Materialize(argv[2], argv[3]);
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s sample_key_value.txt %s\n"
+                "       %s -m synthesized.dat %s\n", argv[0], DATASET_PATH, argv[0], DATASET_PATH);
+        return -1;
+    }
+
+    in = fopen(argv[1], "r");
+    if (!in) {
+        perror("fopen() error");
+        return -1;
+    }
+
+    /* The index sits before the payload, count the items first */
+    while ((len = getline(&line, &cap, in)) > 0) {
+        if (len > 1 || line[0] != '\n')
+            num_items++;
+    }
+    rewind(in);
+
+    w = dataset_writer_open(argv[2], num_items);
+    if (!w) {
+        fclose(in);
+        free(line);
+        return -1;
+    }
+
+    while ((len = getline(&line, &cap, in)) > 0) {
+        lineno++;
+        if (len == 1 && line[0] == '\n')
+            continue;
+        if (ParseLine(line, len, &key, &keyLen, &val, &valLen) < 0) {
+            fprintf(stderr, "%s:%lu: not a keyLen,key,valLen,val line\n", argv[1], lineno);
+            goto err;
+        }
+        if (dataset_writer_add(w, key, keyLen, val, valLen) < 0)
+            goto err;
+    }
+
+    fclose(in);
+    free(line);
+
+    if (dataset_writer_close(w) < 0)
+        return -1;
+
+    printf("%lu items, %s -> %s\n", num_items, argv[1], argv[2]);
+
+    return 0;
+
+err:
+    fclose(in);
+    free(line);
+    dataset_writer_close(w);
+    remove(argv[2]);
+    return -1;
+}
@@ -2,85 +2,295 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stddef.h>
-#include <xxhash.h>
+#include <string.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <xxhash.h>
 #include "rng.h"
+#include "dataset.h"
+
+/* The tuples are cut into blocks of BLOCK_ITEMS, each one drawn from RNG
+ * streams of its own, so that threads generate blocks in any order and
+ * the file only depends on the seed. A first pass draws the lengths to
+ * size every block, a second pass draws them again along with the
+ * strings and writes every block at its own offset of the final file.
+ *
+ * With -y the values are synthesized from the keys and the seed, see
+ * dataset.h, and the binary dataset keeps the keys only. */
 
 #define MAX_VALUE_BUF_SIZE    (1<<20)
 #define MAX_KEY_BUF_SIZE      (1<<10)
+#define BLOCK_ITEMS           (1<<16)
+#define OUT_BUF_SIZE          (1<<23)
+#define MAX_THREADS           (256)
+#define TEXT_OVERHEAD         (24)      /* two lengths, commas and newline */
+
+typedef struct gen_thread_s {
+    pthread_t tid;
+    uint8_t *buf;
+    size_t buflen;
+    uint64_t file_off;          /* of buf[0] */
+    dataset_entry_t *entries;
+    uint8_t *value;             /* synthesized for its digest, with -y */
+    int ret;
+} gen_thread_t;
+
+static void GenerateRandomString(rng_state_t *st, uint8_t *buf, const size_t len);
+static void DrawLengths(rng_state_t *st, uint16_t *keyLen, uint32_t *valueLen);
+static uint64_t TupleLen(const uint16_t keyLen, const uint32_t valueLen);
+static int Flush(gen_thread_t *t);
+static void *SizeBlocks(void *arg);
+static void *WriteBlocks(void *arg);
+static int RunThreads(void *(*fn)(void *));
+
+static uint64_t num_tuples_;
+static uint16_t max_keyLen_;
+static uint32_t max_valueLen_;
+static bool uniform_value_size_ = false;
+static bool text_ = false;
+static bool synth_ = false;
+static uint64_t seed_;
+static int num_threads_;
+static int fd_;
 
-static void GenerateRandomString(char *buf, const ssize_t buflen, const ssize_t keyLen);
+static uint64_t num_blocks_;
+static uint64_t next_block_;
+static uint64_t *block_off_;    /* bytes of every block, then their offsets */
+static uint64_t data_off_;      /* where the tuples start in the file */
+
+static gen_thread_t threads_[MAX_THREADS];
 
 static void
-GenerateRandomString(char *buf, const ssize_t buflen, const ssize_t keyLen) 
+GenerateRandomString(rng_state_t *st, uint8_t *buf, const size_t len)
 {
-    int i, rn1, rn2;
+    size_t i;
+    uint64_t w;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        w = dataset_letters(rng_next(st));
+        memcpy(buf + i, &w, 8);
+    }
 
-    if (buflen < keyLen)  {
-        perror("buflen < keyLen");
-        return;
+    if (i < len) {
+        w = dataset_letters(rng_next(st));
+        memcpy(buf + i, &w, len - i);
     }
+}
+
+static void
+DrawLengths(rng_state_t *st, uint16_t *keyLen, uint32_t *valueLen)
+{
+    *keyLen =  uniform_value_size_ ? max_keyLen_ :
+        rng_gev_r(st, 30.7984, 8.20449, 0.078688) % (max_keyLen_ - 1) + 1;
+    *valueLen = uniform_value_size_ ? max_valueLen_ :
+                                      rng_gpd_r(st, 0, 214.476, 0.348238) % max_valueLen_;
+}
+
+/* bytes of one tuple in the output */
+static uint64_t
+TupleLen(const uint16_t keyLen, const uint32_t valueLen)
+{
+    char num[16];
+
+    if (!text_)
+        return (uint64_t)keyLen + (synth_ ? 0 : valueLen);
+
+    return snprintf(num, sizeof(num), "%u", keyLen) + snprintf(num, sizeof(num), "%u", valueLen) +
+        keyLen + valueLen + 4;
+}
 
-    buf[keyLen] = '\0';
+static int
+Flush(gen_thread_t *t)
+{
+    if (t->buflen && dataset_write_at(fd_, t->buf, t->buflen, t->file_off) < 0)
+        return -1;
+    t->file_off += t->buflen;
+    t->buflen = 0;
+    return 0;
+}
 
-    for (i = 0; i < keyLen; i++) {
-        rn1 = rng_int32() % 2;
-        rn2 = rng_int32() % 26;
+static void *
+SizeBlocks(void *arg)
+{
+    rng_state_t st;
+    uint64_t b, i, n, bytes;
+    uint16_t keyLen;
+    uint32_t valueLen;
 
-        if (rn1) {
-            buf[i] = 'a' + rn2;
-        } else {
-            buf[i] = 'A' + rn2;
+    while ((b = __sync_fetch_and_add(&next_block_, 1)) < num_blocks_) {
+        rng_state_init(&st, seed_, 2 * b);
+        n = num_tuples_ - b * BLOCK_ITEMS < BLOCK_ITEMS ? num_tuples_ - b * BLOCK_ITEMS : BLOCK_ITEMS;
+        bytes = 0;
+        for (i = 0; i < n; i++) {
+            DrawLengths(&st, &keyLen, &valueLen);
+            bytes += TupleLen(keyLen, valueLen);
         }
+        block_off_[b] = bytes;
+    }
+
+    return NULL;
+}
+
+static void *
+WriteBlocks(void *arg)
+{
+    gen_thread_t *t = arg;
+    rng_state_t len_st, str_st;
+    uint64_t b, i, n, payload_off;
+    uint16_t keyLen;
+    uint32_t valueLen;
+    uint8_t *p, *key;
+
+    while ((b = __sync_fetch_and_add(&next_block_, 1)) < num_blocks_) {
+        rng_state_init(&len_st, seed_, 2 * b);
+        rng_state_init(&str_st, seed_, 2 * b + 1);
+        n = num_tuples_ - b * BLOCK_ITEMS < BLOCK_ITEMS ? num_tuples_ - b * BLOCK_ITEMS : BLOCK_ITEMS;
+        t->file_off = data_off_ + block_off_[b];
+        payload_off = block_off_[b];
+
+        for (i = 0; i < n; i++) {
+            if (t->buflen >= OUT_BUF_SIZE && Flush(t) < 0)
+                goto err;
+
+            DrawLengths(&len_st, &keyLen, &valueLen);
+            p = t->buf + t->buflen;
+
+            if (text_) {
+                p += sprintf((char *)p, "%u,", keyLen);
+                GenerateRandomString(&str_st, p, keyLen);
+                key = p;
+                p += keyLen;
+                p += sprintf((char *)p, ",%u,", valueLen);
+                if (synth_)
+                    dataset_synth_value(p, XXH3_64bits(key, keyLen), seed_, valueLen, 0, valueLen);
+                else
+                    GenerateRandomString(&str_st, p, valueLen);
+                p += valueLen;
+                *p++ = '\n';
+            } else if (synth_) {
+                GenerateRandomString(&str_st, p, keyLen);
+                dataset_synth_value(t->value, XXH3_64bits(p, keyLen), seed_, valueLen, 0, valueLen);
+                dataset_fill_entry(&t->entries[i], payload_off, p, keyLen, t->value, valueLen);
+                payload_off += keyLen;
+                p += keyLen;
+            } else {
+                GenerateRandomString(&str_st, p, keyLen);
+                GenerateRandomString(&str_st, p + keyLen, valueLen);
+                dataset_fill_entry(&t->entries[i], payload_off, p, keyLen, p + keyLen, valueLen);
+                payload_off += keyLen + valueLen;
+                p += keyLen + valueLen;
+            }
+
+            t->buflen = p - t->buf;
+        }
+
+        if (Flush(t) < 0)
+            goto err;
+
+        if (!text_ && dataset_write_at(fd_, t->entries, n * sizeof(dataset_entry_t),
+                    dataset_index_offset(num_tuples_) + b * BLOCK_ITEMS * sizeof(dataset_entry_t)) < 0)
+            goto err;
+    }
+
+    return NULL;
+
+err:
+    t->ret = -1;
+    return NULL;
+}
+
+static int
+RunThreads(void *(*fn)(void *))
+{
+    int i, ret = 0;
+
+    next_block_ = 0;
+
+    for (i = 0; i < num_threads_; i++) {
+        threads_[i].ret = 0;
+        if (pthread_create(&threads_[i].tid, NULL, fn, &threads_[i]) != 0) {
+            perror("pthread_create() error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < num_threads_; i++) {
+        pthread_join(threads_[i].tid, NULL);
+        if (threads_[i].ret < 0)
+            ret = -1;
     }
+
+    return ret;
 }
+
 static void
 PrintOption(void) {
 
     printf("-n : number of key-value tuples to generate\n" \
            "-k : maximum key size\n" \
            "-v : maximum value size\n"  \
-           "-u : generate uniform sized value\n");
+           "-u : generate uniform sized value\n" \
+           "-o : output file, " DATASET_PATH " or sample_key_value.txt with -t\n" \
+           "-t : write the keyLen,key,valLen,val text format instead\n" \
+           "-s : seed, the same seed gives the same file (default: time)\n" \
+           "-j : number of threads (default: online cpus)\n" \
+           "-y : synthesize values from the keys and the seed, the dataset keeps keys only\n");
 }
 /* 64 704*/
 int
 main(const int argc, char *argv[])
 {
     int opt;
-    int num_tuples;
-    FILE *file;
-    int i;
-    unsigned short max_keyLen, keyLen;
-    unsigned int max_valueLen, valueLen;
-    char key_[MAX_KEY_BUF_SIZE];
-    char value_[MAX_VALUE_BUF_SIZE];
-    bool uniform_value_size = false;
-
-    if (argc != 7 && argc != 8) {
-        if (argc != 2) {
-            fprintf(stderr, "# of arguments error : %d\n", argc);
-            return -1;
-        }
+    const char *path = NULL;
+    uint64_t i, total;
+    dataset_header_t hdr;
+    struct timespec start, end;
+
+    if (argc < 7 && argc != 2) {
+        fprintf(stderr, "# of arguments error : %d\n", argc);
+        return -1;
     }
 
-    while ((opt = getopt(argc, argv, "n:v:k:hu")) != -1)
+    seed_ = time(NULL);
+    num_threads_ = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "n:v:k:o:s:j:huty")) != -1)
     {
         switch(opt) {
             case 'n' :
-                num_tuples = atoi(optarg);
+                num_tuples_ = strtoull(optarg, NULL, 10);
                 break;
             case 'v' :
-                max_valueLen = atoi(optarg);
+                max_valueLen_ = atoi(optarg);
                 break;
             case 'k' :
-                max_keyLen = atoi(optarg);
+                max_keyLen_ = atoi(optarg);
                 break;
             case 'u' :
-                uniform_value_size = true;
+                uniform_value_size_ = true;
+                break;
+            case 'o' :
+                path = optarg;
+                break;
+            case 't' :
+                text_ = true;
+                break;
+            case 'y' :
+                synth_ = true;
+                break;
+            case 's' :
+                seed_ = strtoull(optarg, NULL, 0);
+                break;
+            case 'j' :
+                num_threads_ = atoi(optarg);
                 break;
             case 'h' :
                 PrintOption();
-                break;
+                return 0;
 
             default :
                 printf("Wrong option %c, enter -h option for help\n", (char)opt);
@@ -88,23 +298,97 @@ main(const int argc, char *argv[])
         }
     }
 
-    if(!(file = fopen("sample_key_value.txt", "w"))) 
-    {
-        perror("fopen() error");
+    if (max_keyLen_ >= MAX_KEY_BUF_SIZE || max_valueLen_ >= MAX_VALUE_BUF_SIZE ||
+            max_keyLen_ < (uniform_value_size_ ? 1 : 2) || max_valueLen_ < 1) {
+        fprintf(stderr, "key size must be in [2, %d) and value size in [1, %d)\n",
+                MAX_KEY_BUF_SIZE, MAX_VALUE_BUF_SIZE);
+        return -1;
+    }
+
+    if (num_threads_ < 1 || num_threads_ > MAX_THREADS) {
+        fprintf(stderr, "number of threads must be in [1, %d]\n", MAX_THREADS);
         return -1;
     }
 
-    for (i = 0; i < num_tuples; i++) {
-        keyLen =  uniform_value_size ? max_keyLen :
-            rng_gev(30.7984, 8.20449, 0.078688) % (max_keyLen - 1) + 1;
-        valueLen = uniform_value_size? max_valueLen :
-                                       rng_gpd(0, 214.476, 0.348238) % max_valueLen;
-        GenerateRandomString(key_, MAX_KEY_BUF_SIZE, keyLen);
-        GenerateRandomString(value_, MAX_VALUE_BUF_SIZE, valueLen);
-        fprintf(file, "%u,%s,%u,%s\n", keyLen, key_, valueLen, value_);
+    if (!path)
+        path = text_ ? "sample_key_value.txt" : DATASET_PATH;
+
+    fd_ = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+        perror("open() error");
+        return -1;
+    }
+
+    num_blocks_ = (num_tuples_ + BLOCK_ITEMS - 1) / BLOCK_ITEMS;
+    block_off_ = malloc(sizeof(uint64_t) * (num_blocks_ + 1));
+    if (!block_off_) {
+        perror("malloc() error");
+        return -1;
     }
 
-    fclose(file);
+    for (i = 0; i < num_threads_; i++) {
+        threads_[i].buf = malloc(OUT_BUF_SIZE + max_keyLen_ + max_valueLen_ + TEXT_OVERHEAD);
+        threads_[i].entries = text_ ? NULL : malloc(sizeof(dataset_entry_t) * BLOCK_ITEMS);
+        threads_[i].value = synth_ ? malloc(max_valueLen_) : NULL;
+        if (!threads_[i].buf || (!text_ && !threads_[i].entries) || (synth_ && !threads_[i].value)) {
+            perror("malloc() error");
+            return -1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    RunThreads(SizeBlocks);
+
+    /* block sizes into offsets */
+    for (i = 0, total = 0; i < num_blocks_; i++) {
+        uint64_t bytes = block_off_[i];
+        block_off_[i] = total;
+        total += bytes;
+    }
+
+    data_off_ = text_ ? 0 : dataset_payload_offset(num_tuples_);
+    if (ftruncate(fd_, data_off_ + total) < 0) {
+        perror("ftruncate() error");
+        close(fd_);
+        unlink(path);
+        return -1;
+    }
+
+    if (RunThreads(WriteBlocks) < 0) {
+        close(fd_);
+        unlink(path);
+        return -1;
+    }
+
+    /* The header goes last, see dataset_writer_close() */
+    if (!text_) {
+        dataset_init_header(&hdr, num_tuples_, total, synth_ ? DATASET_FLAG_SYNTH : 0, seed_);
+        if (dataset_write_at(fd_, &hdr, sizeof(hdr), 0) < 0) {
+            close(fd_);
+            unlink(path);
+            return -1;
+        }
+    }
+
+    if (close(fd_) < 0) {
+        perror("close() error");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%lu tuples, %lu bytes to %s in %.2fs, seed %lu, %d threads\n",
+            num_tuples_, data_off_ + total, path,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+            seed_, num_threads_);
+
+    for (i = 0; i < num_threads_; i++) {
+        free(threads_[i].buf);
+        free(threads_[i].entries);
+        free(threads_[i].value);
+    }
+    free(block_off_);
 
     return 0;
 }
@@ -1,5 +1,6 @@
 #include "hashtable.h"
 #include "complete_bin_tree.h"
+#include <hugetlbfs.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -31,26 +32,28 @@ static FILE *hashtable_log = NULL;
 #endif
 static uint64_t totalUsedMemory = 0;
 
+/* The caller holds the bucket lock, hash_val is CAL_HASH_VAL of the key */
 inline static kv_hashtable_item_t *
-GetItem(void *key, uint16_t key_len) {
+GetItem(const uint64_t hash_val) {
 
-	uint64_t hash_val = CAL_HASH_VAL(key, key_len);
 	uint16_t hash_tag = GET_TAG(hash_val);
 	uint32_t hash_idx = GET_BUCKET_IDX(hash_val);
 
 	kv_hashtable_bucket_t *b = &table.bucket[hash_idx];	
 	kv_hashtable_item_t *item;
 	
-	TAILQ_FOREACH(item, b->chain, link) {
+	TAILQ_FOREACH(item, BUCKET_CHAIN(b), link) {
 		if (item->tag == hash_tag)
 			return item;
 	}
 	return NULL;
 }
 
+/* value may be NULL, then only the key is stored and the value is known by
+ * its length and digest */
 inline static kv_hashtable_item_t *
 CreateHashTableItem(void *key, void *value, uint16_t key_len, uint32_t value_len, 
-        uint16_t tag, uint64_t hv) {
+        uint16_t tag, uint64_t hv, uint64_t digest) {
 
 	kv_hashtable_item_t *item;
 
@@ -65,8 +68,10 @@ CreateHashTableItem(void *key, void *value, uint16_t key_len, uint32_t value_len
     item->refCount = 0;
     item->n_requests = 0;
     item->hv = hv;
+    item->digest = digest;
+    item->value_stored = (value != NULL);
 
-    item->data = malloc(key_len + value_len);
+    item->data = malloc(item_dataLen(item));
     if (!item->data) {
         free(item);
         return NULL;
@@ -75,10 +80,11 @@ CreateHashTableItem(void *key, void *value, uint16_t key_len, uint32_t value_len
     __atomic_store_n(&item->active, 1, __ATOMIC_RELAXED);
 
     memcpy(item->data, key, key_len);
-    memcpy(item->data + key_len, value, value_len);
+    if (value)
+        memcpy(item->data + key_len, value, value_len);
 
     __atomic_fetch_add(&totalUsedMemory, 
-            key_len + value_len + sizeof(kv_hashtable_item_t), __ATOMIC_RELAXED);
+            item_dataLen(item) + sizeof(kv_hashtable_item_t), __ATOMIC_RELAXED);
 
 
 #ifdef _DEBUG_LOG
@@ -103,7 +109,7 @@ DestroyHashTableItem(kv_hashtable_item_t **item) {
 
 
     __atomic_fetch_sub(&totalUsedMemory, 
-            (*item)->key_len + (*item)->value_len + sizeof(kv_hashtable_bucket_t), __ATOMIC_RELAXED);
+            item_dataLen(*item) + sizeof(kv_hashtable_item_t), __ATOMIC_RELAXED);
 
 #ifdef _DEBUG_LOG
     fprintf(hashtable_log, "Destroy item, mem_usage:%lu, n_items:%lu\n",
@@ -119,25 +125,17 @@ TeardownHashTable :
 inline static void
 CreateHashTableBucket(kv_hashtable_bucket_t *b) {
 
-#if _USE_SPINLOCK	
-	b->lock = malloc(sizeof(pthread_spinlock_t));
-#else
-	b->lock = malloc(sizeof(pthread_mutex_t));
-#endif
-	if(!b->lock) {
-		log_error("malloc error()\n");
-		exit(EXIT_FAILURE);
-	}
-	
-	LOCK_INIT(b->lock);
+	LOCK_INIT(&b->lock);
 
+#ifdef _USE_BUCKET_LAYOUT_MALLOC
 	b->chain = malloc(sizeof(kv_hashtable_chain_t));
 	if(!b->chain) {
 		log_error("malloc error()\n");
 		exit(EXIT_FAILURE);
 	}
+#endif
 
-	TAILQ_INIT(b->chain);
+	TAILQ_INIT(BUCKET_CHAIN(b));
 }
 
 inline static void
@@ -145,21 +143,27 @@ DestroyHashTableBucket(kv_hashtable_bucket_t *b) {
 
 	kv_hashtable_item_t *p_cur, *p_next;
 	
-	p_cur = TAILQ_FIRST(b->chain);
+	p_cur = TAILQ_FIRST(BUCKET_CHAIN(b));
 	while(p_cur) {
 		p_next = TAILQ_NEXT(p_cur, link);
 		DestroyHashTableItem(&p_cur);
 		p_cur = p_next;
 	}
 
+#ifdef _USE_BUCKET_LAYOUT_MALLOC
 	free(b->chain);
-	free(b->lock);
+#endif
+	LOCK_DESTROY(&b->lock);
 }
 
 void
 hashtable_setup(const uint16_t hash_power) {
 
-	int i, ret;
+#ifndef _USE_BUCKET_LAYOUT_MALLOC
+	long hugepagesize;
+#endif
+	size_t len;
+	int i;
 
 	if (is_hashtable_setup) {
 		log_error("hashtable has already been setupt\n");
@@ -169,10 +173,24 @@ hashtable_setup(const uint16_t hash_power) {
 	table.hash_table_size = (1U << hash_power);
 	table.hash_mask = table.hash_table_size - 1;
 
-	ret = posix_memalign((void **)&table.bucket, 
-			table.hash_table_size, table.hash_table_size * sizeof(kv_hashtable_bucket_t));
+	len = table.hash_table_size * sizeof(kv_hashtable_bucket_t);
+	table.bucket = NULL;
 
-	if (ret < 0) {
+#ifndef _USE_BUCKET_LAYOUT_MALLOC
+	/* buckets with their locks and chain heads in one region of huge
+	 * pages, a lookup costs few TLB entries and setup no malloc() */
+	hugepagesize = gethugepagesize();
+	if (hugepagesize > 0) {
+		len = (len + hugepagesize - 1) / hugepagesize * hugepagesize;
+		table.bucket = get_huge_pages(len, GHP_DEFAULT);
+	}
+	if (!table.bucket)
+		trace_log("no huge pages, buckets on small pages\n");
+#endif
+	table.hugepage = (table.bucket != NULL);
+
+	if (!table.bucket &&
+			posix_memalign((void **)&table.bucket, sysconf(_SC_PAGESIZE), len) != 0) {
 		log_error("malloc error()\n");
 		exit(EXIT_FAILURE);
 	}
@@ -211,7 +229,10 @@ hashtable_teardown(void) {
 	for (i = 0; i < table.hash_table_size; i++) 
 		DestroyHashTableBucket(&table.bucket[i]);
 
-	free(table.bucket);
+	if (table.hugepage)
+		free_huge_pages(table.bucket);
+	else
+		free(table.bucket);
 
 #ifdef _DEBUG_LOG
     if (hashtable_log) {
@@ -225,12 +246,19 @@ hashtable_teardown(void) {
 kv_hashtable_item_t *
 hashtable_start_to_access(void *key, const uint16_t key_len) {
 
-    kv_hashtable_item_t *it = GetItem(key, key_len);
-
-    if (!__atomic_load_n(&it->active, __ATOMIC_RELAXED))
-        return NULL;
-
-    __atomic_fetch_add(&it->refCount, 1, __ATOMIC_RELAXED);
+	uint64_t hash_val = CAL_HASH_VAL(key, key_len);
+	uint32_t bucket_idx = GET_BUCKET_IDX(hash_val);
+    kv_hashtable_item_t *it;
+
+    /* a delete frees the item under the lock, hold it until refCount
+     * keeps the item alive */
+    READ_LOCK(&table.bucket[bucket_idx].lock);
+    it = GetItem(hash_val);
+    if (it && __atomic_load_n(&it->active, __ATOMIC_RELAXED))
+        __atomic_fetch_add(&it->refCount, 1, __ATOMIC_RELAXED);
+    else
+        it = NULL;
+    UNLOCK(&table.bucket[bucket_idx].lock);
 
     return it;
 }
@@ -240,45 +268,46 @@ hashtable_start_to_access_directly(kv_hashtable_item_t *it) {
     __atomic_fetch_add(&it->refCount, 1, __ATOMIC_RELAXED);
 }
 
-kv_hashtable_item_t *
-hashtable_put(void *key, const uint16_t key_len, void *value, const uint32_t value_len, uint16_t *flags) {
+inline static kv_hashtable_item_t *
+PutItem(void *key, const uint16_t key_len, void *value, const uint32_t value_len,
+        const uint64_t digest, uint16_t *flags) {
 
 	uint64_t hash_val = CAL_HASH_VAL(key, key_len);
 	uint16_t tag = GET_TAG(hash_val);
 	uint32_t bucket_idx = GET_BUCKET_IDX(hash_val);
 	
-	LOCK(table.bucket[bucket_idx].lock);
-	kv_hashtable_item_t *item = GetItem(key, key_len);
+	LOCK(&table.bucket[bucket_idx].lock);
+	kv_hashtable_item_t *item = GetItem(hash_val);
     *flags = 0;
 
 	if (!item) {
 
         if (totalUsedMemory + sizeof(kv_hashtable_item_t) + 
-                key_len + value_len >= MEMORY_LIMITATION)
+                key_len + (value ? value_len : 0) >= MEMORY_LIMITATION)
         {
 #ifdef _DEBUG_LOG
             fprintf(hashtable_log, "[Memory limitation], put fail\n");
 #endif
             *flags |= HASHTABLE_FLAGS_PUT_NEW_ITEM_FAIL_MEM_LIMIT;
-		    UNLOCK(table.bucket[bucket_idx].lock);
+		    UNLOCK(&table.bucket[bucket_idx].lock);
             return NULL;
         }
 
-		kv_hashtable_item_t *new_item = CreateHashTableItem(key, value, key_len, value_len, tag, hash_val);
+		kv_hashtable_item_t *new_item = CreateHashTableItem(key, value, key_len, value_len, tag, hash_val, digest);
         if (!new_item) {
 #ifdef _DEBUG_LOG
             fprintf(hashtable_log, "[Out of Memory error], not enough memory\n");
 #endif
             *flags |= HASHTABLE_FLAGS_PUT_NEW_ITEM_FAIL_OOM;
-		    UNLOCK(table.bucket[bucket_idx].lock);
+		    UNLOCK(&table.bucket[bucket_idx].lock);
             return NULL;
         }
 
-		TAILQ_INSERT_HEAD(table.bucket[bucket_idx].chain, new_item, link);
+		TAILQ_INSERT_HEAD(BUCKET_CHAIN(&table.bucket[bucket_idx]), new_item, link);
 
         complete_bin_tree_insert(new_item);
 
-		UNLOCK(table.bucket[bucket_idx].lock);
+		UNLOCK(&table.bucket[bucket_idx].lock);
 
         *flags |= HASHTABLE_FLAGS_PUT_NEW_ITEM_SUCC;
 
@@ -287,11 +316,11 @@ hashtable_put(void *key, const uint16_t key_len, void *value, const uint32_t val
 		return new_item;
 
 	} else {
-        int diff = value_len - item->value_len;
+        int diff = key_len + (value ? value_len : 0) - item_dataLen(item);
 
         if (totalUsedMemory + diff >= MEMORY_LIMITATION) {
 
-		    TAILQ_REMOVE(table.bucket[bucket_idx].chain, item, link);
+		    TAILQ_REMOVE(BUCKET_CHAIN(&table.bucket[bucket_idx]), item, link);
 
             complete_bin_tree_delete(item);
 
@@ -301,7 +330,7 @@ hashtable_put(void *key, const uint16_t key_len, void *value, const uint32_t val
 
             *flags |= HASHTABLE_FLAGS_UPDATE_ITEM_FAIL_MEM_LIMIT;
 
-		    UNLOCK(table.bucket[bucket_idx].lock);
+		    UNLOCK(&table.bucket[bucket_idx].lock);
             return NULL;
         }
 
@@ -313,16 +342,16 @@ hashtable_put(void *key, const uint16_t key_len, void *value, const uint32_t val
 
         free(item->data);
 
-        item->data = malloc(key_len + value_len);
+        item->data = malloc(key_len + (value ? value_len : 0));
         if (!item->data) {
             
-		    TAILQ_REMOVE(table.bucket[bucket_idx].chain, item, link);
+		    TAILQ_REMOVE(BUCKET_CHAIN(&table.bucket[bucket_idx]), item, link);
 
             complete_bin_tree_delete(item);
 
             DestroyHashTableItem(&item);
 
-		    UNLOCK(table.bucket[bucket_idx].lock);
+		    UNLOCK(&table.bucket[bucket_idx].lock);
 
             *flags |= HASHTABLE_FLAGS_UPDATE_ITEM_FAIL_OOM;
 
@@ -331,9 +360,12 @@ hashtable_put(void *key, const uint16_t key_len, void *value, const uint32_t val
 
         item->key_len = key_len;
         item->value_len = value_len;
+        item->digest = digest;
+        item->value_stored = (value != NULL);
 
         memcpy(item->data, key, key_len);
-        memcpy(item->data + key_len, value, value_len);
+        if (value)
+            memcpy(item->data + key_len, value, value_len);
 
         __atomic_store_n(&item->active, 1, __ATOMIC_RELAXED);
 
@@ -341,12 +373,25 @@ hashtable_put(void *key, const uint16_t key_len, void *value, const uint32_t val
 
         *flags |= HASHTABLE_FLAGS_UPDATE_ITEM_SUCC;
 
-		UNLOCK(table.bucket[bucket_idx].lock);
+		UNLOCK(&table.bucket[bucket_idx].lock);
 
 		return item;
 	}
 }
 
+kv_hashtable_item_t *
+hashtable_put(void *key, const uint16_t key_len, void *value, const uint32_t value_len, uint16_t *flags) {
+
+    return PutItem(key, key_len, value, value_len, 0, flags);
+}
+
+kv_hashtable_item_t *
+hashtable_put_digest(void *key, const uint16_t key_len, const uint32_t value_len,
+        const uint64_t digest, uint16_t *flags) {
+
+    return PutItem(key, key_len, NULL, value_len, digest, flags);
+}
+
 bool
 hashtable_delete(void *key, const uint16_t key_len) {
 
@@ -354,17 +399,17 @@ hashtable_delete(void *key, const uint16_t key_len) {
 	//uint16_t tag = GET_TAG(hash_val);
 	uint32_t bucket_idx = GET_BUCKET_IDX(hash_val);
 	
-	LOCK(table.bucket[bucket_idx].lock);
-	kv_hashtable_item_t *item = GetItem(key, key_len);
+	LOCK(&table.bucket[bucket_idx].lock);
+	kv_hashtable_item_t *item = GetItem(hash_val);
 
 	if (!item) {
 
-		UNLOCK(table.bucket[bucket_idx].lock);
+		UNLOCK(&table.bucket[bucket_idx].lock);
 		return KV_DEL_NO_VALUE;
 
 	} else {
 
-		TAILQ_REMOVE(table.bucket[bucket_idx].chain, item, link);
+		TAILQ_REMOVE(BUCKET_CHAIN(&table.bucket[bucket_idx]), item, link);
 
         complete_bin_tree_delete(item);
 
@@ -372,7 +417,7 @@ hashtable_delete(void *key, const uint16_t key_len) {
 
         __atomic_fetch_sub(&totalItem, 1, __ATOMIC_RELAXED);
 
-		UNLOCK(table.bucket[bucket_idx].lock);
+		UNLOCK(&table.bucket[bucket_idx].lock);
         
 		return KV_DEL_SUCC;
 	}
@@ -406,6 +451,11 @@ hashtable_get_number_of_objects(void) {
     return totalItem;
 }
 
+uint64_t
+hashtable_get_used_memory(void) {
+    return totalUsedMemory;
+}
+
 hash_iterator_t *
 hashtable_get_bucket_iterator(const uint32_t bucketIdx) {
 
@@ -414,14 +464,14 @@ hashtable_get_bucket_iterator(const uint32_t bucketIdx) {
 
     iter->bucketIdx = bucketIdx;
 
-    LOCK(table.bucket[bucketIdx].lock);
+    LOCK(&table.bucket[bucketIdx].lock);
     iter->b = &table.bucket[bucketIdx];
 
-    iter->cur = TAILQ_FIRST(iter->b->chain);
+    iter->cur = TAILQ_FIRST(BUCKET_CHAIN(iter->b));
 
     if (!iter->cur) { 
         free(iter);
-        UNLOCK(table.bucket[bucketIdx].lock);
+        UNLOCK(&table.bucket[bucketIdx].lock);
         return NULL;
     }
 
@@ -433,8 +483,8 @@ hashtable_get_bucket_iterator(const uint32_t bucketIdx) {
 void
 hashtable_free_bucket_iterator(hash_iterator_t *iter) {
 
+    UNLOCK(&iter->b->lock);
     free(iter);
-    UNLOCK(iter->b->lock);
 }
 
 void
@@ -10,18 +10,91 @@
 #define CAL_HASH_VAL(_key, _key_len) (XXH3_64bits(_key, _key_len))
 #define GET_TAG(_val) ((uint16_t)(_val >> 32) & 0xffff)
 
-#if _USE_SPINLOCK
+/* Bucket lock, picked at build time by BUCKET_LOCK in the Makefile
+ *   mutex      pthread mutex, the default
+ *   spin       pthread spinlock
+ *   ticket     FIFO ticket spinlock, 4 bytes
+ *   rw         pthread reader-writer lock, lookups share the bucket
+ *   byte       test-and-test-and-set spinlock, 1 byte
+ * The lock sits inline in the bucket. READ_LOCK guards lookups and is
+ * LOCK for all but rw. */
+#ifdef _USE_SPINLOCK
+#define _USE_BUCKET_LOCK_SPIN
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX()         __builtin_ia32_pause()
+#else
+#define CPU_RELAX()         __asm__ __volatile__("" ::: "memory")
+#endif
+
+#if defined(_USE_BUCKET_LOCK_SPIN)
+#define BUCKET_LOCK_NAME    "spin"
+typedef pthread_spinlock_t bucket_lock_t;
 #define LOCK_INIT(_lock)    pthread_spin_init(_lock, PTHREAD_PROCESS_PRIVATE)
 #define LOCK_DESTROY(_lock) pthread_spin_destroy(_lock)
 #define LOCK(_lock)         pthread_spin_lock(_lock)
 #define UNLOCK(_lock)       pthread_spin_unlock(_lock)
+#elif defined(_USE_BUCKET_LOCK_TICKET)
+#define BUCKET_LOCK_NAME    "ticket"
+typedef struct bucket_lock_s {
+    uint16_t next;          /* ticket of the next thread to arrive */
+    uint16_t owner;         /* ticket holding the lock */
+} bucket_lock_t;
+
+static inline void
+TicketLock(bucket_lock_t *l) {
+    uint16_t me = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != me)
+        CPU_RELAX();
+}
+
+static inline void
+TicketUnlock(bucket_lock_t *l) {
+    __atomic_store_n(&l->owner, l->owner + 1, __ATOMIC_RELEASE);
+}
+
+#define LOCK_INIT(_lock)    ((_lock)->next = (_lock)->owner = 0)
+#define LOCK_DESTROY(_lock) ((void)(_lock))
+#define LOCK(_lock)         TicketLock(_lock)
+#define UNLOCK(_lock)       TicketUnlock(_lock)
+#elif defined(_USE_BUCKET_LOCK_RW)
+#define BUCKET_LOCK_NAME    "rw"
+typedef pthread_rwlock_t bucket_lock_t;
+#define LOCK_INIT(_lock)    pthread_rwlock_init(_lock, NULL)
+#define LOCK_DESTROY(_lock) pthread_rwlock_destroy(_lock)
+#define LOCK(_lock)         pthread_rwlock_wrlock(_lock)
+#define UNLOCK(_lock)       pthread_rwlock_unlock(_lock)
+#define READ_LOCK(_lock)    pthread_rwlock_rdlock(_lock)
+#elif defined(_USE_BUCKET_LOCK_BYTE)
+#define BUCKET_LOCK_NAME    "byte"
+typedef uint8_t bucket_lock_t;
+
+static inline void
+ByteLock(bucket_lock_t *l) {
+    while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(l, __ATOMIC_RELAXED))
+            CPU_RELAX();
+    }
+}
+
+#define LOCK_INIT(_lock)    (*(_lock) = 0)
+#define LOCK_DESTROY(_lock) ((void)(_lock))
+#define LOCK(_lock)         ByteLock(_lock)
+#define UNLOCK(_lock)       __atomic_store_n(_lock, 0, __ATOMIC_RELEASE)
 #else
+#define BUCKET_LOCK_NAME    "mutex"
+typedef pthread_mutex_t bucket_lock_t;
 #define LOCK_INIT(_lock)    pthread_mutex_init(_lock, NULL)
 #define LOCK_DESTROY(_lock) pthread_mutex_destroy(_lock)
 #define LOCK(_lock)         pthread_mutex_lock(_lock)
 #define UNLOCK(_lock)       pthread_mutex_unlock(_lock)
 #endif
 
+#ifndef READ_LOCK
+#define READ_LOCK(_lock)    LOCK(_lock)
+#endif
+
 #define	KV_PUT_CHANGE_VALUE	false
 #define KV_PUT_NEW_VALUE	true
 #define KV_DEL_SUCC			true
@@ -51,6 +124,8 @@ struct kv_hashtable_item_s {
     uint64_t interArrivalTime;
     uint64_t n_requests;
     uint64_t hv;
+    uint64_t digest;            /* XXH3 of the value, 0 unless put by hashtable_put_digest() */
+    uint8_t value_stored;       /* 0 if only the key is kept in data */
     kv_hashtable_item_t *_left;
     kv_hashtable_item_t *_right;
     kv_hashtable_item_t *_parent;
@@ -64,20 +139,36 @@ TAILQ_HEAD(kv_hashtable_chain_s, kv_hashtable_item_s);
 #define item_keyLen(_it)    (_it->key_len)
 #define item_valueLen(_it)  (_it->value_len)
 #define item_tag(_it)   (_it->tag)
+#define item_digest(_it)    (_it->digest)
+#define item_dataLen(_it)   ((_it)->key_len + ((_it)->value_stored ? (_it)->value_len : 0))
+
+/* Bucket layout, picked at build time with make BUCKET_LAYOUT=
+ *   inline     chain head and lock inline, the whole table is one array
+ *              on huge pages when there are any, the default
+ *   malloc     every chain head malloc()ed on its own and the array on
+ *              small pages, the older layout kept to compare with */
+#ifdef _USE_BUCKET_LAYOUT_MALLOC
+#define BUCKET_LAYOUT_NAME  "malloc"
+#define BUCKET_CHAIN(_b)    ((_b)->chain)
+#else
+#define BUCKET_LAYOUT_NAME  "inline"
+#define BUCKET_CHAIN(_b)    (&(_b)->chain)
+#endif
 
 struct kv_hashtable_bucket_s {
-#ifdef _USE_SPINLOCK
-	pthread_spinlock_t *lock;
+#ifdef _USE_BUCKET_LAYOUT_MALLOC
+	kv_hashtable_chain_t *chain;
 #else
-	pthread_mutex_t *lock;
+	kv_hashtable_chain_t chain;
 #endif
-	kv_hashtable_chain_t *chain;
+	bucket_lock_t lock;
 };
 
 struct kv_hashtable_s {
 	uint32_t hash_table_size;
 	uint32_t hash_mask;
 	kv_hashtable_bucket_t *bucket;
+	bool hugepage;			/* bucket from get_huge_pages() */
 };
 
 struct hash_iterator_s {
@@ -93,8 +184,14 @@ kv_hashtable_item_t *hashtable_start_to_access(void *key, const uint16_t key_len
 
 void hashtable_start_to_access_directly(kv_hashtable_item_t *it);
 
+/* Stores the key and a copy of the value, no digest is computed */
 kv_hashtable_item_t *hashtable_put(void *key, const uint16_t key_len, void *value, const uint32_t value_len, uint16_t *flags);
 
+/* Stores the key with the length and digest of its value, not the value
+ * itself. For verifying by digest, the dataset has the digests ready. */
+kv_hashtable_item_t *hashtable_put_digest(void *key, const uint16_t key_len, const uint32_t value_len,
+        const uint64_t digest, uint16_t *flags);
+
 bool hashtable_delete(void *key, const uint16_t key_len);
 
 uint32_t hashtable_get_size(void);
@@ -111,6 +208,9 @@ void hashtable_teardown(void);
 
 uint64_t hashtable_get_number_of_objects(void);
 
+/* Bytes of items and their keys and values, buckets not counted */
+uint64_t hashtable_get_used_memory(void);
+
 hash_iterator_t *hashtable_get_bucket_iterator(const uint32_t bucketIdx);
 
 void hashtable_free_bucket_iterator(hash_iterator_t *iter);
@@ -0,0 +1,558 @@
+/* Microbenchmark of hashtable.c on its own, without the network.
+ *
+ * Keys and values are drawn like gen_random_key_value draws them, GEV
+ * key and GPD value sizes up to -k and -v, or fixed sizes with -u. The
+ * workloads run one after another on the same table:
+ *   put      inserts every key, each thread its slice
+ *   get      hashtable_start_to_access/stop_to_access of Zipf drawn keys
+ *   update   hashtable_put of Zipf drawn keys that are in the table
+ *   sample   hashtable_start_to_access_random_item, the tree sampler
+ *   mixed    get/update/delete by the -m percentages, Zipf drawn
+ *   delete   removes every key, each thread its slice
+ * The access traces are drawn before the clock starts. Every workload
+ * prints one CSV row, ops/sec, ns/op percentiles and the memory per
+ * object, to stdout or the file given by -f. The setup row is the time
+ * hashtable_setup() takes. Data TLB load misses per op come from perf
+ * events, -1 where the kernel does not count them.
+ *
+ * make lock_bench builds hashtable_bench_<lock> for every bucket lock,
+ * make layout_bench also hashtable_bench_layout_malloc on the older
+ * bucket layout, the layout column tells the two apart.
+ * Hot bucket contention shows with a small table and a steep Zipf,
+ * e.g. -p 10 -z 1.2 -w put,mixed -m 95/5/0 at 1 to 64 threads. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "hashtable.h"
+#include "rng.h"
+#include "latency.h"
+
+#define log_error(_f, _m...) do{\
+    fprintf(stderr, "[Error][%10s:%4d]" _f, __FUNCTION__, __LINE__, ##_m);\
+} while(0)
+
+#define log_trace(_f, _m...) do{\
+    fprintf(stdout, "[TRACE][%10s:%4d]" _f, __FUNCTION__, __LINE__, ##_m);\
+} while(0)
+
+#define MAX_THREADS         (256)
+#define MAX_KEY_LEN         (255)
+
+enum workload {
+    WORKLOAD_PUT    =   0,
+    WORKLOAD_GET    =   1,
+    WORKLOAD_UPDATE =   2,
+    WORKLOAD_SAMPLE =   3,
+    WORKLOAD_MIXED  =   4,
+    WORKLOAD_DELETE =   5,
+    NUM_WORKLOADS   =   6,
+};
+
+enum mix_op {
+    MIX_GET     =   0,
+    MIX_UPDATE  =   1,
+    MIX_DELETE  =   2,
+    NUM_MIX_OPS =   3,
+};
+
+typedef struct bench_thread_s {
+    pthread_t thread;
+    int thread_no;
+    uint32_t *trace;            /* key indices of the Zipf workloads */
+    uint8_t *trace_op;          /* mix_op of every entry in mixed */
+    uint64_t num_ops;
+    uint64_t num_misses;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int64_t tlb_misses;         /* -1 without a counter */
+    latency_hist_t hist;
+} __attribute__((aligned(64))) bench_thread_t;
+
+static void SetupKeys(void);
+static void SetupZipf(void);
+static uint32_t DrawZipf(uint64_t *state);
+static void *RunBenchThread(void *arg);
+static void RunWorkload(const enum workload w);
+static void PrintRow(const enum workload w);
+static int OpenTlbCounter(void);
+static int64_t ReadTlbCounter(const int fd);
+static int ParseMix(const char *s);
+static int ParseWorkloads(char *s);
+
+static const char *workload_name_[NUM_WORKLOADS] = {
+    "put", "get", "update", "sample", "mixed", "delete",
+};
+
+static int num_threads_ = 1;
+static uint32_t num_items_ = 1U << 20;
+static uint16_t hash_power_ = 20;
+static uint16_t max_key_len_ = 64;
+static uint32_t max_value_len_ = 1024;
+static bool uniform_size_ = false;
+static double zipf_alpha_ = 0.99;       /* 0 draws uniformly */
+static uint64_t ops_per_thread_ = 1000000;
+static uint8_t mix_[NUM_MIX_OPS] = {90, 9, 1};
+static bool run_workload_[NUM_WORKLOADS] = {true, true, true, true, true, true};
+static FILE *out_;
+
+static char *key_buf_;
+static uint64_t *key_off_;
+static uint8_t *key_len_;
+static uint32_t *value_len_;
+static char *value_buf_;                /* every value is a prefix of it */
+static double *zipf_cdf_;
+
+static bench_thread_t *threads_;
+static pthread_barrier_t barrier_;
+static enum workload workload_;
+static uint64_t rss_base_;
+
+static void
+GenerateRandomString(char *buf, const uint32_t len)
+{
+    uint32_t i, rn;
+
+    for (i = 0; i < len; i++) {
+        rn = rng_int32();
+        buf[i] = (rn & 1 ? 'a' : 'A') + (rn >> 1) % 26;
+    }
+}
+
+static void
+SetupKeys(void)
+{
+    uint64_t off = 0;
+    uint32_t i;
+
+    key_buf_ = malloc((uint64_t)num_items_ * max_key_len_);
+    key_off_ = malloc(sizeof(uint64_t) * num_items_);
+    key_len_ = malloc(sizeof(uint8_t) * num_items_);
+    value_len_ = malloc(sizeof(uint32_t) * num_items_);
+    value_buf_ = malloc(max_value_len_ + 1);
+    if (!key_buf_ || !key_off_ || !key_len_ || !value_len_ || !value_buf_) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_items_; i++) {
+        key_len_[i] = uniform_size_ ? max_key_len_ :
+            rng_gev(30.7984, 8.20449, 0.078688) % (max_key_len_ - 1) + 1;
+        value_len_[i] = uniform_size_ ? max_value_len_ :
+            rng_gpd(0, 214.476, 0.348238) % max_value_len_;
+        key_off_[i] = off;
+        GenerateRandomString(key_buf_ + off, key_len_[i]);
+        off += key_len_[i];
+    }
+
+    GenerateRandomString(value_buf_, max_value_len_);
+}
+
+/* Cumulative Zipf probabilities of the ranks, rank i is key i */
+static void
+SetupZipf(void)
+{
+    double sum = 0;
+    uint32_t i;
+
+    zipf_cdf_ = malloc(sizeof(double) * num_items_);
+    if (!zipf_cdf_) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_items_; i++) {
+        sum += 1.0 / pow(i + 1, zipf_alpha_);
+        zipf_cdf_[i] = sum;
+    }
+    for (i = 0; i < num_items_; i++)
+        zipf_cdf_[i] /= sum;
+}
+
+/* xorshift64* for the uniform draw, the rank by binary search */
+static uint32_t
+DrawZipf(uint64_t *state)
+{
+    uint32_t lo = 0, hi = num_items_ - 1, mid;
+    double u;
+
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    u = (double)((*state * 2685821657736338717LU) >> 11) / (double)(1LU << 53);
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (zipf_cdf_[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Data TLB load misses of the calling thread in user space, counting
+ * stopped until enabled. Returns -1 if the CPU or the VM has none. */
+static int
+OpenTlbCounter(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int64_t
+ReadTlbCounter(const int fd)
+{
+    uint64_t count;
+
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return count;
+}
+
+static void *
+RunBenchThread(void *arg)
+{
+    bench_thread_t *t = arg;
+    const uint32_t first = (uint64_t)num_items_ * t->thread_no / num_threads_;
+    const uint32_t last = (uint64_t)num_items_ * (t->thread_no + 1) / num_threads_;
+    uint64_t state = 0x9e3779b97f4a7c15LU * (t->thread_no + 1) + workload_;
+    kv_hashtable_item_t *it;
+    uint64_t i, n, ts, ns;
+    uint32_t k, r;
+    uint16_t flags;
+    uint8_t op = MIX_GET;
+    int tlb_fd;
+    bool zipf_drawn = workload_ == WORKLOAD_GET || workload_ == WORKLOAD_UPDATE ||
+        workload_ == WORKLOAD_MIXED;
+
+    memset(&t->hist, 0, sizeof(latency_hist_t));
+    t->num_ops = 0;
+    t->num_misses = 0;
+
+    if (zipf_drawn) {
+        for (i = 0; i < ops_per_thread_; i++) {
+            t->trace[i] = DrawZipf(&state);
+            r = (state >> 33) % 100;
+            t->trace_op[i] = r < mix_[MIX_GET] ? MIX_GET :
+                r < mix_[MIX_GET] + mix_[MIX_UPDATE] ? MIX_UPDATE : MIX_DELETE;
+        }
+    }
+    n = zipf_drawn || workload_ == WORKLOAD_SAMPLE ? ops_per_thread_ : last - first;
+    tlb_fd = OpenTlbCounter();
+
+    pthread_barrier_wait(&barrier_);
+    if (tlb_fd >= 0)
+        ioctl(tlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+    t->start_ns = latency_now_ns();
+
+    for (i = 0; i < n; i++) {
+        k = zipf_drawn ? t->trace[i] : first + i;
+        if (workload_ == WORKLOAD_MIXED)
+            op = t->trace_op[i];
+        else if (workload_ == WORKLOAD_UPDATE)
+            op = MIX_UPDATE;
+
+        ts = latency_now_ns();
+        switch (workload_) {
+            case WORKLOAD_PUT :
+                if (!hashtable_put(key_buf_ + key_off_[k], key_len_[k],
+                            value_buf_, value_len_[k], &flags))
+                    t->num_misses++;
+                break;
+            case WORKLOAD_SAMPLE :
+                it = hashtable_start_to_access_random_item();
+                hashtable_stop_to_access(it);
+                break;
+            case WORKLOAD_DELETE :
+                if (!hashtable_delete(key_buf_ + key_off_[k], key_len_[k]))
+                    t->num_misses++;
+                break;
+            default :
+                if (op == MIX_GET) {
+                    it = hashtable_start_to_access(key_buf_ + key_off_[k], key_len_[k]);
+                    if (it)
+                        hashtable_stop_to_access(it);
+                    else
+                        t->num_misses++;
+                } else if (op == MIX_UPDATE) {
+                    if (!hashtable_put(key_buf_ + key_off_[k], key_len_[k],
+                                value_buf_, value_len_[k], &flags))
+                        t->num_misses++;
+                } else if (!hashtable_delete(key_buf_ + key_off_[k], key_len_[k])) {
+                    t->num_misses++;
+                }
+                break;
+        }
+        ns = latency_now_ns() - ts;
+        t->hist.count[latency_bucket(ns)]++;
+    }
+
+    t->end_ns = latency_now_ns();
+    if (tlb_fd >= 0)
+        ioctl(tlb_fd, PERF_EVENT_IOC_DISABLE, 0);
+    t->tlb_misses = ReadTlbCounter(tlb_fd);
+    if (tlb_fd >= 0)
+        close(tlb_fd);
+    t->num_ops = n;
+
+    return NULL;
+}
+
+static void
+RunWorkload(const enum workload w)
+{
+    int i;
+
+    workload_ = w;
+    for (i = 0; i < num_threads_; i++) {
+        if (pthread_create(&threads_[i].thread, NULL, RunBenchThread, &threads_[i]) != 0) {
+            log_error("pthread_create() fail\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < num_threads_; i++)
+        pthread_join(threads_[i].thread, NULL);
+
+    PrintRow(w);
+}
+
+/* The workload's CSV row, see the header in main() */
+static void
+PrintRow(const enum workload w)
+{
+    latency_hist_t *sum;
+    uint64_t start = UINT64_MAX, end = 0, ops = 0, misses = 0;
+    int64_t tlb_misses = 0;
+    uint64_t objects = hashtable_get_number_of_objects();
+    uint64_t rss = latency_resident_bytes();
+    double sec;
+    int i, j;
+
+    sum = calloc(1, sizeof(latency_hist_t));
+    if (!sum) {
+        log_error("calloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_threads_; i++) {
+        if (threads_[i].start_ns < start)
+            start = threads_[i].start_ns;
+        if (threads_[i].end_ns > end)
+            end = threads_[i].end_ns;
+        ops += threads_[i].num_ops;
+        misses += threads_[i].num_misses;
+        if (tlb_misses >= 0)
+            tlb_misses = threads_[i].tlb_misses < 0 ? -1 : tlb_misses + threads_[i].tlb_misses;
+        for (j = 0; j < LAT_NUM_BUCKETS; j++)
+            sum->count[j] += threads_[i].hist.count[j];
+    }
+    sec = end > start ? (end - start) / 1e9 : 0;
+
+    fprintf(out_, "%s,%s,%s,%d,%u,%u,%u,%u,%s,%.2lf,%lu,%lu,%lu,%.3lf,%.0lf,%.0lf,%.0lf,%.0lf,%.0lf,%.3lf,%.1lf,%.1lf\n",
+            workload_name_[w], BUCKET_LOCK_NAME, BUCKET_LAYOUT_NAME, num_threads_, num_items_, 1U << hash_power_,
+            max_key_len_, max_value_len_, uniform_size_ ? "uniform" : "gev/gpd", zipf_alpha_,
+            ops, misses, objects, sec, sec > 0 ? ops / sec : 0,
+            latency_percentile(sum, ops, 500), latency_percentile(sum, ops, 900),
+            latency_percentile(sum, ops, 990), latency_percentile(sum, ops, 999),
+            tlb_misses >= 0 && ops ? (double)tlb_misses / ops : -1,
+            objects ? (double)hashtable_get_used_memory() / objects : 0,
+            objects && rss > rss_base_ ? (double)(rss - rss_base_) / objects : 0);
+    fflush(out_);
+
+    free(sum);
+}
+
+/* "90/9/1", percent of get/update/delete in mixed */
+static int
+ParseMix(const char *s)
+{
+    unsigned int g, u, d;
+    char end;
+
+    if (sscanf(s, "%u/%u/%u%c", &g, &u, &d, &end) != 3 || g + u + d != 100)
+        return -1;
+
+    mix_[MIX_GET] = g;
+    mix_[MIX_UPDATE] = u;
+    mix_[MIX_DELETE] = d;
+    return 0;
+}
+
+/* "put,get,mixed", the workloads to run, always in the order above */
+static int
+ParseWorkloads(char *s)
+{
+    char *saveptr, *p;
+    int i;
+
+    memset(run_workload_, 0, sizeof(run_workload_));
+    for (p = strtok_r(s, ",", &saveptr); p; p = strtok_r(NULL, ",", &saveptr)) {
+        for (i = 0; i < NUM_WORKLOADS; i++) {
+            if (strcmp(p, workload_name_[i]) == 0)
+                break;
+        }
+        if (i == NUM_WORKLOADS)
+            return -1;
+        run_workload_[i] = true;
+    }
+
+    return 0;
+}
+
+int
+main(const int argc, char *argv[])
+{
+    int opt, i;
+    const char *out_path = NULL;
+    uint64_t start;
+    double sec;
+
+    while ((opt = getopt(argc, argv, "t:n:p:k:v:z:o:m:w:f:u")) != -1) {
+        switch (opt) {
+            case 't' :
+                num_threads_ = atoi(optarg);
+                break;
+            case 'n' :
+                num_items_ = atoi(optarg);
+                break;
+            case 'p' :
+                hash_power_ = atoi(optarg);
+                break;
+            case 'k' :
+                max_key_len_ = atoi(optarg);
+                break;
+            case 'v' :
+                max_value_len_ = atoi(optarg);
+                break;
+            case 'u' :
+                uniform_size_ = true;
+                break;
+            case 'z' :
+                zipf_alpha_ = atof(optarg);
+                break;
+            case 'o' :
+                ops_per_thread_ = strtoull(optarg, NULL, 10);
+                break;
+            case 'm' :
+                if (ParseMix(optarg) < 0) {
+                    log_error("invalid mix %s (get/update/delete percent, e.g. 90/9/1)\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'w' :
+                if (ParseWorkloads(optarg) < 0) {
+                    log_error("invalid workload list %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'f' :
+                out_path = optarg;
+                break;
+            default :
+                log_error("invalid argument %c error\n", (char)opt);
+                return -1;
+        }
+    }
+
+    if (num_threads_ < 1 || num_threads_ > MAX_THREADS || num_items_ < 1 ||
+            hash_power_ < 1 || hash_power_ > 31 || max_key_len_ < 2 ||
+            max_key_len_ > MAX_KEY_LEN || max_value_len_ < 1 || max_value_len_ >= (1U << 20)) {
+        log_error("need -t in [1, %d], -n >= 1, -p in [1, 31], -k in [2, %d] and -v in [1, 2^20)\n",
+                MAX_THREADS, MAX_KEY_LEN);
+        return -1;
+    }
+    if (!run_workload_[WORKLOAD_PUT]) {
+        log_error("every workload needs the keys put first\n");
+        return -1;
+    }
+
+    out_ = stdout;
+    if (out_path && !(out_ = fopen(out_path, "w"))) {
+        log_error("fopen() error, %s\n", strerror(errno));
+        return -1;
+    }
+
+    SetupKeys();
+    SetupZipf();
+
+    threads_ = aligned_alloc(64, sizeof(bench_thread_t) * num_threads_);
+    if (!threads_) {
+        log_error("aligned_alloc() error, %s\n", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < num_threads_; i++) {
+        threads_[i].thread_no = i;
+        threads_[i].trace = malloc(sizeof(uint32_t) * ops_per_thread_);
+        threads_[i].trace_op = malloc(ops_per_thread_);
+        if (!threads_[i].trace || !threads_[i].trace_op) {
+            log_error("malloc() error, %s\n", strerror(errno));
+            return -1;
+        }
+        /* faulted in before rss_base_, the traces are not table memory */
+        memset(threads_[i].trace, 0, sizeof(uint32_t) * ops_per_thread_);
+        memset(threads_[i].trace_op, 0, ops_per_thread_);
+    }
+    pthread_barrier_init(&barrier_, NULL, num_threads_);
+
+    /* memory per object counts the bucket array too */
+    rss_base_ = latency_resident_bytes();
+    start = latency_now_ns();
+    hashtable_setup(hash_power_);
+    sec = (latency_now_ns() - start) / 1e9;
+
+    fprintf(out_, "workload,lock,layout,threads,items,buckets,max_key,max_value,sizes,zipf,"
+            "ops,misses,objects,sec,ops_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,"
+            "dtlb_misses_per_op,data_bytes_per_object,rss_bytes_per_object\n");
+    /* one op per bucket, the table is empty so there is no per object
+     * memory yet */
+    fprintf(out_, "setup,%s,%s,1,%u,%u,%u,%u,%s,%.2lf,%u,0,0,%.3lf,%.0lf,0,0,0,0,-1,,\n",
+            BUCKET_LOCK_NAME, BUCKET_LAYOUT_NAME, num_items_, 1U << hash_power_, max_key_len_, max_value_len_,
+            uniform_size_ ? "uniform" : "gev/gpd", zipf_alpha_, 1U << hash_power_,
+            sec, sec > 0 ? (1U << hash_power_) / sec : 0);
+
+    for (i = 0; i < NUM_WORKLOADS; i++) {
+        if (run_workload_[i])
+            RunWorkload(i);
+    }
+
+    hashtable_teardown();
+
+    pthread_barrier_destroy(&barrier_);
+    for (i = 0; i < num_threads_; i++) {
+        free(threads_[i].trace);
+        free(threads_[i].trace_op);
+    }
+    free(threads_);
+    free(zipf_cdf_);
+    free(key_buf_);
+    free(key_off_);
+    free(key_len_);
+    free(value_len_);
+    free(value_buf_);
+    if (out_ != stdout)
+        fclose(out_);
+
+    return 0;
+}
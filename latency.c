@@ -0,0 +1,70 @@
+#include "latency.h"
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t
+latency_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LU + now.tv_nsec;
+}
+
+uint32_t
+latency_bucket(const uint64_t ns)
+{
+    uint32_t shift;
+
+    if (ns < (1U << LAT_SUB_BITS))
+        return ns;
+
+    shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+    if (shift > 40 - LAT_SUB_BITS - 1)
+        return LAT_NUM_BUCKETS - 1;
+
+    return ((shift + 1) << LAT_SUB_BITS) + ((ns >> shift) & ((1U << LAT_SUB_BITS) - 1));
+}
+
+double
+latency_bucket_ns(const uint32_t idx)
+{
+    uint32_t shift;
+
+    if (idx < (1U << LAT_SUB_BITS))
+        return idx;
+
+    shift = (idx >> LAT_SUB_BITS) - 1;
+    return (double)(((1LU << LAT_SUB_BITS) + (idx & ((1U << LAT_SUB_BITS) - 1))) << shift) +
+           (double)(1LU << shift) / 2;
+}
+
+double
+latency_percentile(const latency_hist_t *h, const uint64_t total, const uint32_t permille)
+{
+    uint64_t acc = 0;
+    uint32_t i;
+
+    for (i = 0; i < LAT_NUM_BUCKETS && total > 0; i++) {
+        acc += h->count[i];
+        if (acc * 1000 >= total * permille)
+            return latency_bucket_ns(i);
+    }
+
+    return 0;
+}
+
+long
+latency_resident_bytes(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size, resident = 0;
+
+    if (f) {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
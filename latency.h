@@ -0,0 +1,30 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+
+/* Log-linear latency histogram, 2^LAT_SUB_BITS buckets per power of 2
+ * (about 3% error) up to 2^40 ns */
+#define LAT_SUB_BITS        (5)
+#define LAT_NUM_BUCKETS     ((40 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+typedef struct latency_hist_s {
+    uint64_t count[LAT_NUM_BUCKETS];
+} latency_hist_t;
+
+/* CLOCK_MONOTONIC in ns */
+uint64_t latency_now_ns(void);
+
+/* Bucket of a latency in ns, and the middle of the range a bucket
+ * covers, in ns */
+uint32_t latency_bucket(const uint64_t ns);
+double latency_bucket_ns(const uint32_t idx);
+
+/* Latency in ns below which permille of the total samples of h lie, 0
+ * for an empty histogram */
+double latency_percentile(const latency_hist_t *h, const uint64_t total, const uint32_t permille);
+
+/* Resident bytes of the process */
+long latency_resident_bytes(void);
+
+#endif
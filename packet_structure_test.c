@@ -1,9 +1,20 @@
+/* Sends GETs split into TCP segments by a fixed pattern of real and
+ * pseudo segments, and measures the server's throughput and latency for
+ * every pattern.
+ *
+ * A REAL segment carries one GET request. With -f it is cut into that
+ * many fragments, each one a segment of its own, so that the server has
+ * to reassemble it. A PSEUDO segment carries a padding frame: a req_hdr
+ * of type PAD followed by keyLen filler bytes, which the server parses
+ * and drops without a reply. Every segment goes out with its own send()
+ * on a TCP_NODELAY socket. MSG_EOR keeps the kernel from appending the
+ * next write to a segment that has not left yet. */
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
-#include <sys/uio.h>
 #include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <stddef.h>
 #include <unistd.h>
@@ -13,8 +24,10 @@
 #include <errno.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <time.h>
 
-#include "hashtable.h"
+#include "dataset.h"
+#include "latency.h"
 
 #define log_error(_f, _m...) do{\
     fprintf(stderr, "[Error][%10s:%4d]" _f, __FUNCTION__, __LINE__, ##_m);\
@@ -25,7 +38,11 @@
 } while(0)
 
 #define GET 0
+#define PAD 0xff                /* padding frame, no reply */
 #define SAMPLE_OBJECT_SIZE  128
+#define RCV_BUF_SIZE        (1 << 16)
+#define MAX_SEGMENTS        (8)     /* entries of one pattern */
+#define MAX_FRAGMENTS       (16)    /* -f */
 
 typedef struct req_hdr_ req_hdr;
 typedef struct rep_hdr_ rep_hdr;
@@ -35,12 +52,15 @@ struct req_hdr_ {
     uint8_t keyLen;
 } __attribute__((packed));
 
+/* the server may put hdr_pad_ bytes of padding between rep_hdr and the
+ * value, set -H like the server's */
 struct rep_hdr_ {
     uint8_t replyType;
     uint16_t valLen;
     uint8_t val[];
 } __attribute__((packed));
 
+/* the name spells the segments of one message, in order */
 enum packet_structure {
     REAL_PSEUDO                         =   0,
     PSEUDO_REAL                         =   1,
@@ -49,104 +69,161 @@ enum packet_structure {
     PSEUDO_REAL_PSEUDO_REAL             =   4,
     REAL_REAL_PSEUDO_REAL_PSEUDO_REAL   =   5,
     PSEUDO_REAL_PSEUDO_REAL_REAL_PSEUDO =   6,
+    REAL                                =   7,  /* baseline, no padding */
+    NUM_PACKET_STRUCTURES               =   8,
 };
 
-static uint8_t app_rcv_buf[1<<16];
+static const char *packet_structure_name_[NUM_PACKET_STRUCTURES] = {
+    "REAL_PSEUDO",
+    "PSEUDO_REAL",
+    "REAL_REAL_PSEUDO_PSEUDO",
+    "PSEUDO_PSEUDO_REAL_REAL",
+    "PSEUDO_REAL_PSEUDO_REAL",
+    "REAL_REAL_PSEUDO_REAL_PSEUDO_REAL",
+    "PSEUDO_REAL_PSEUDO_REAL_REAL_PSEUDO",
+    "REAL",
+};
+
+/* One closed-loop connection, a message is sent once the replies to all
+ * REAL segments of the previous one are in */
+typedef struct conn_s {
+    int fd;
+    uint32_t key[MAX_SEGMENTS];     /* keys of the message in flight */
+    uint16_t num_real;
+    uint16_t num_replied;
+    uint8_t rep_hdr[sizeof(rep_hdr)];
+    uint8_t rep_hdrlen;
+    uint32_t rep_pad;               /* header padding still to skip */
+    uint32_t rep_valLen;
+    uint32_t rep_off;
+    bool rep_ok;
+    uint64_t send_ns;
+} conn_t;
+
+typedef struct pattern_stats_s {
+    uint64_t num_msgs;
+    uint64_t num_reqs;
+    uint64_t num_segments;
+    uint64_t num_verify_fail;
+    uint64_t total_latency_ns;
+    latency_hist_t hist;        /* per message */
+} pattern_stats_t;
+
+static uint8_t app_rcv_buf[RCV_BUF_SIZE];
 
 static void SetupKeyValue(void);
 static void DestroyKeyValue(void);
+static int ParsePattern(const enum packet_structure ps, bool *segs);
 static int CreateConnection(void);
-static int SendGetRequest(const int fd);
-static int ReceiveReply(const int fd);
-static void CloseConnection(const int fd);
+static int SendSegment(const int fd, const void *buf, const size_t len);
+static int SendMessage(conn_t *c);
+static int ReceiveReply(conn_t *c);
+static void CloseConnection(conn_t *c);
+static void RunPattern(const enum packet_structure ps);
 static void SigInteruuptHandler(int signo);
 
 static in_port_t dport;
 static in_addr_t daddr;
 
 static void **key_;
-static void **value_;
+static uint16_t *key_len_;
+static uint32_t *value_len_;
 static uint32_t num_key_values_ = 1;
+static const char *dataset_path_ = DATASET_PATH;
+static dataset_t *dataset_;
+
+static uint32_t num_conns_ = 16;
+static uint32_t duration_sec_ = 5;      /* per pattern */
+static uint32_t num_fragments_ = 1;
+static uint8_t pad_len_ = 64;
+static uint16_t hdr_pad_ = 0;           /* reply header padding */
+static uint32_t next_key_ = 0;
+static uint8_t pad_frame_[sizeof(req_hdr) + UINT8_MAX];
+static bool pattern_[MAX_SEGMENTS];     /* true for a REAL segment */
+static int pattern_len_;
+static pattern_stats_t stats_;
 
 static bool run_test_ = true;
 
 static void
 SetupKeyValue(void) {
 
-    int count = 0;
-    char line[1U << 16];
-    FILE *sample_key_value_file;
-    char *key, *val, *saveptr, *endptr, *p;
-    uint16_t keyLen;
-    uint32_t valLen;
+    uint32_t count;
 
-    sample_key_value_file = fopen("sample_key_value.txt", "r");
-    if (!sample_key_value_file) {
-        log_error("fopen() error, %s\n", strerror(errno));
+    dataset_ = dataset_open(dataset_path_);
+    if (!dataset_) {
+        log_error("no dataset at %s, make one with gen_random_key_value or dataset_convert\n",
+                dataset_path_);
         exit(EXIT_FAILURE);
     }
 
-    key_ = malloc(sizeof(void *) * num_key_values_);
-    if (!key_) {
-        log_error("malloc() error, %s\n", strerror(errno));
+    if (dataset_->num_items == 0) {
+        log_error("no key in %s\n", dataset_path_);
         exit(EXIT_FAILURE);
     }
-    value_ = malloc(sizeof(void *) * num_key_values_);
-    if (!value_) {
+    if (num_key_values_ > dataset_->num_items)
+        num_key_values_ = dataset_->num_items;
+
+    /* keyLen is one byte on the wire, SendMessage() sizes its frame by it */
+    if (dataset_check_key_len(dataset_, num_key_values_, UINT8_MAX) < 0)
+        exit(EXIT_FAILURE);
+
+    key_ = malloc(sizeof(void *) * num_key_values_);
+    key_len_ = malloc(sizeof(uint16_t) * num_key_values_);
+    value_len_ = malloc(sizeof(uint32_t) * num_key_values_);
+    if (!key_ || !key_len_ || !value_len_) {
         log_error("malloc() error, %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    while (count < num_key_values_) {
-        if (!fgets(line, 1U << 16, sample_key_value_file)) {
-            break;
-        }
-        p = strtok_r(line, ",", &saveptr);
-        keyLen = strtol(p, &endptr, 10);
-        key = strtok_r(NULL, ",", &saveptr);
-        p = strtok_r(NULL, ",", &saveptr);
-        valLen = strtol(p, &endptr, 10);
-        val = strtok_r(NULL, ",", &saveptr);
-
-        key_[count] = malloc(keyLen + 1);
-        if (!key_[count]) {
-            log_error("malloc() error, %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-
-        memcpy(key_[count], key, keyLen);
-        *(char *)(key_[count] + keyLen) = '\0';
-
-        value_[count] = malloc(valLen + 1);
-        if (!value_[count]) {
-            log_error("malloc() error, %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-        memcpy(value_[count], val, valLen);
-        *(char *)(value_[count] + valLen) = '\0';
-
-        count++;
+    /* Keys stay in the mapping, values are compared in place or
+     * regenerated, see dataset_value_cmp() */
+    for (count = 0; count < num_key_values_; count++) {
+        key_[count] = (void *)dataset_key(dataset_, count);
+        key_len_[count] = dataset_key_len(dataset_, count);
+        value_len_[count] = dataset_value_len(dataset_, count);
     }
 }
 
 static void
 DestroyKeyValue(void) {
-    int i;
-    for (i = 0; i < num_key_values_; i++) {
-        free(key_[i]);
-        free(value_[i]);
+    free(key_);
+    free(key_len_);
+    free(value_len_);
+    dataset_close(dataset_);
+}
+
+/* Splits the name of ps into its segments, returns their number */
+static int
+ParsePattern(const enum packet_structure ps, bool *segs)
+{
+    const char *p = packet_structure_name_[ps];
+    int n = 0;
+
+    while (*p && n < MAX_SEGMENTS) {
+        if (strncmp(p, "REAL", 4) == 0) {
+            segs[n++] = true;
+            p += 4;
+        } else if (strncmp(p, "PSEUDO", 6) == 0) {
+            segs[n++] = false;
+            p += 6;
+        } else {
+            return -1;
+        }
+        if (*p == '_')
+            p++;
     }
 
-    free(key_);
-    free(value_);
+    return n;
 }
 
+/* Blocking socket, epoll only tells when replies are in */
 static int
-CreateConnection(void) 
+CreateConnection(void)
 {
     struct sockaddr_in addr;
     int fd;
-    int ret;
+    int one = 1;
 
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = daddr;
@@ -154,91 +231,216 @@ CreateConnection(void)
 
     fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
-        log_error("Failed to create socket\n");
+        log_error("socket() fail, %s\n", strerror(errno));
         return -1;
     }
-    ret = connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
-    if (ret < 0) {
-        if (errno != EINPROGRESS) {
-            perror("mtcp_connect error");
-            close(fd);
-        }
-        log_trace("connect() fd:%d,ret:%d, errno:%d\n", fd, ret, errno);
-    } 
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+        log_error("setsockopt(TCP_NODELAY) fail, %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0) {
+        log_error("connect() fail, %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
     return fd;
 }
 
 static int
-SendGetRequest(const int fd)
+SendSegment(const int fd, const void *buf, const size_t len)
 {
-    int ret;
-    req_hdr req = {
-        GET,
-        strlen((char *)key_[0])
-    };
-
-    struct iovec vec[2] = {
-        {&req, 2},
-        {key_[0], req.keyLen}
-    };
-
-    //log_trace("Send request packet\n");
-
-    ret = writev(fd, vec, 2);
-    if (ret < 0) {
-        if (errno != EINPROGRESS) {
-            perror("connect");
-            close(fd);
-            return -1;
-        }
+    if (send(fd, buf, len, MSG_EOR | MSG_NOSIGNAL) != (ssize_t)len) {
+        log_error("send() fail, %s\n", strerror(errno));
+        return -1;
     }
-    return ret; 
+    stats_.num_segments++;
+    return 0;
 }
 
+/* Writes one message of the current pattern, segment by segment */
 static int
-ReceiveReply(const int fd, const enum pkt_type type)
+SendMessage(conn_t *c)
 {
-    int len;;
-    int off = 0;
-    int to_be_rcvd = strlen((char *)value_[0]) + sizeof(rep_hdr);
-
-    while((len = read(fd, app_rcv_buf + off, (1 << 16) - off)) > 0) {
-        off += len;
-        log_trace("rcvd_byte:%d\n", off);
-        
-        if (to_be_rcvd == off)
-            break;
-    } 
+    uint8_t frame[sizeof(req_hdr) + UINT8_MAX];
+    req_hdr *hdr = (req_hdr *)frame;
+    uint32_t k, len, off, frag, nfrags;
+    int i;
 
-    if (len <= 0) {
-        close(fd);
+    c->num_real = 0;
+    c->num_replied = 0;
+    c->send_ns = latency_now_ns();
+
+    for (i = 0; i < pattern_len_; i++) {
+        if (!pattern_[i]) {
+            if (SendSegment(c->fd, pad_frame_, sizeof(req_hdr) + pad_len_) < 0)
+                return -1;
+            continue;
+        }
+
+        k = next_key_++ % num_key_values_;
+        c->key[c->num_real++] = k;
+        hdr->reqtype = GET;
+        hdr->keyLen = key_len_[k];
+        memcpy(frame + sizeof(req_hdr), key_[k], key_len_[k]);
+        len = sizeof(req_hdr) + key_len_[k];
+
+        nfrags = num_fragments_ < len ? num_fragments_ : len;
+        for (frag = 0, off = 0; frag < nfrags; frag++) {
+            const uint32_t end = len * (frag + 1) / nfrags;
+            if (SendSegment(c->fd, frame + off, end - off) < 0)
+                return -1;
+            off = end;
+        }
     }
 
-    rep_hdr *rep = (rep_hdr *)app_rcv_buf;
-    if (rep->valLen != strlen((char *)value_[0])) 
-    {
-        log_error("value length error, valLen:%u, object len:%lu\n",
-                rep->valLen, strlen((char *)value_[0]));
-        close(fd);
+    return 0;
+}
+
+/* Parses what arrived, replies come in the order of the REAL segments.
+ * Returns 1 once the whole message is answered, -1 on error. */
+static int
+ReceiveReply(conn_t *c)
+{
+    rep_hdr *rep;
+    ssize_t len, off = 0, n;
+    uint64_t ns;
+    uint32_t k;
+
+    len = read(c->fd, app_rcv_buf, RCV_BUF_SIZE);
+    if (len <= 0) {
+        log_error("read() fail, %s\n", len == 0 ? "closed" : strerror(errno));
         return -1;
     }
 
-    if (memcmp(rep->val, value_[0], rep->valLen) != 0) 
-    {
-        char *ptr = (char *)rep->val;
-        ptr[rep->valLen] = '\0';
-        log_error("received object error, received:%s, sample object:%s\n",
-                ptr, (char *)value_[0]);
-        close(fd);
-        return -1;
+    while (off < len) {
+        if (c->num_replied == c->num_real) {
+            log_error("unexpected reply, fd:%d\n", c->fd);
+            return -1;
+        }
+        k = c->key[c->num_replied];
+
+        if (c->rep_hdrlen < sizeof(rep_hdr)) {
+            n = sizeof(rep_hdr) - c->rep_hdrlen;
+            n = n < len - off ? n : len - off;
+            memcpy(c->rep_hdr + c->rep_hdrlen, app_rcv_buf + off, n);
+            c->rep_hdrlen += n;
+            off += n;
+            if (c->rep_hdrlen < sizeof(rep_hdr))
+                break;
+
+            rep = (rep_hdr *)c->rep_hdr;
+            c->rep_valLen = rep->valLen;
+            c->rep_off = 0;
+            c->rep_ok = c->rep_valLen == value_len_[k];
+            c->rep_pad = hdr_pad_;
+        }
+
+        if (c->rep_pad > 0) {
+            n = c->rep_pad < len - off ? c->rep_pad : len - off;
+            c->rep_pad -= n;
+            off += n;
+            if (c->rep_pad > 0)
+                break;
+        }
+
+        n = c->rep_valLen - c->rep_off;
+        n = n < len - off ? n : len - off;
+        if (c->rep_ok && dataset_value_cmp(dataset_, k, c->rep_off, app_rcv_buf + off, n) != 0)
+            c->rep_ok = false;
+        c->rep_off += n;
+        off += n;
+
+        if (c->rep_off == c->rep_valLen) {
+            if (!c->rep_ok)
+                stats_.num_verify_fail++;
+            c->rep_hdrlen = 0;
+            c->num_replied++;
+            stats_.num_reqs++;
+        }
     }
 
-    return off; 
+    if (c->num_replied < c->num_real)
+        return 0;
+
+    ns = latency_now_ns() - c->send_ns;
+    stats_.num_msgs++;
+    stats_.total_latency_ns += ns;
+    stats_.hist.count[latency_bucket(ns)]++;
+    return 1;
 }
 
 static void
-CloseConnection(const int fd) {
-    close(fd);
+CloseConnection(conn_t *c) {
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* Runs every connection in closed loop over the pattern for the test
+ * duration and prints one row of results */
+static void
+RunPattern(const enum packet_structure ps)
+{
+    struct epoll_event ev, events[64];
+    conn_t *conns;
+    uint64_t start, end;
+    double sec;
+    int ep, nevents, i, ret;
+
+    pattern_len_ = ParsePattern(ps, pattern_);
+    assert(pattern_len_ > 0);
+    memset(&stats_, 0, sizeof(stats_));
+
+    conns = calloc(num_conns_, sizeof(conn_t));
+    ep = epoll_create1(0);
+    if (!conns || ep < 0) {
+        log_error("setup fail, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_conns_; i++) {
+        conns[i].fd = CreateConnection();
+        if (conns[i].fd < 0)
+            exit(EXIT_FAILURE);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conns[i];
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, conns[i].fd, &ev) < 0) {
+            log_error("epoll_ctl() fail, %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    start = latency_now_ns();
+    end = start + duration_sec_ * 1000000000LU;
+    for (i = 0; i < num_conns_; i++) {
+        if (SendMessage(&conns[i]) < 0)
+            exit(EXIT_FAILURE);
+    }
+
+    while (run_test_ && latency_now_ns() < end) {
+        nevents = epoll_wait(ep, events, 64, 100);
+        for (i = 0; i < nevents; i++) {
+            conn_t *c = events[i].data.ptr;
+            ret = ReceiveReply(c);
+            if (ret < 0 || (ret == 1 && SendMessage(c) < 0))
+                exit(EXIT_FAILURE);
+        }
+    }
+    sec = (latency_now_ns() - start) / 1e9;
+
+    for (i = 0; i < num_conns_; i++)
+        CloseConnection(&conns[i]);
+    close(ep);
+    free(conns);
+
+    fprintf(stdout, "%-36s %4d %12.0lf %12.0lf %12.0lf %10.1lf %9.0lf %8lu\n",
+            packet_structure_name_[ps], pattern_len_,
+            stats_.num_msgs / sec, stats_.num_reqs / sec, stats_.num_segments / sec,
+            stats_.num_msgs ? (double)stats_.total_latency_ns / stats_.num_msgs / 1000 : 0,
+            latency_percentile(&stats_.hist, stats_.num_msgs, 990) / 1000, stats_.num_verify_fail);
 }
 
 static void
@@ -247,38 +449,105 @@ SigInteruuptHandler(int signo)
     run_test_ = false;
 }
 
-int 
+int
 main(const int argc, char *argv[]) {
 
-    int fd, len, opt;
+    int opt, i, pad_len;
+    int only = -1;
+    char *colon;
+    req_hdr *pad = (req_hdr *)pad_frame_;
+
     daddr = inet_addr("10.0.30.110");
     dport = htons(65000);
 
     signal(SIGINT, SigInteruuptHandler);
 
-    while((opt = getopt(argc, argv, "n:")) != -1)
+    while((opt = getopt(argc, argv, "n:S:c:T:f:l:H:P:i:")) != -1)
     {
         switch(opt) {
             case 'n' :
                 num_key_values_ = atoi(optarg);
                 break;
+            case 'i' :
+                dataset_path_ = optarg;
+                break;
+            case 'S' :
+                colon = strchr(optarg, ':');
+                if (!colon) {
+                    log_error("invalid server %s, ip:port\n", optarg);
+                    return -1;
+                }
+                *colon = '\0';
+                if (inet_pton(AF_INET, optarg, &daddr) != 1) {
+                    log_error("invalid server address %s\n", optarg);
+                    return -1;
+                }
+                dport = htons(atoi(colon + 1));
+                break;
+            case 'c' :
+                num_conns_ = atoi(optarg);
+                break;
+            case 'T' :
+                duration_sec_ = atoi(optarg);
+                break;
+            case 'f' :
+                num_fragments_ = atoi(optarg);
+                break;
+            case 'l' :
+                pad_len = atoi(optarg);
+                if (pad_len < 0 || pad_len > UINT8_MAX) {
+                    log_error("-l takes a pad length in [0, %d]\n", UINT8_MAX);
+                    return -1;
+                }
+                pad_len_ = pad_len;
+                break;
+            case 'H' :
+                pad_len = atoi(optarg);
+                if (pad_len < 0 || pad_len > UINT16_MAX) {
+                    log_error("-H takes a reply header padding in [0, %d]\n", UINT16_MAX);
+                    return -1;
+                }
+                hdr_pad_ = pad_len;
+                break;
+            case 'P' :
+                for (i = 0; i < NUM_PACKET_STRUCTURES; i++) {
+                    if (strcmp(optarg, packet_structure_name_[i]) == 0)
+                        only = i;
+                }
+                if (only < 0) {
+                    log_error("unknown packet structure %s\n", optarg);
+                    return -1;
+                }
+                break;
+            default :
+                log_error("invalid argument %c error\n", (char)opt);
+                return -1;
         }
     }
 
+    if (num_conns_ < 1 || duration_sec_ < 1 ||
+            num_fragments_ < 1 || num_fragments_ > MAX_FRAGMENTS) {
+        log_error("need -c >= 1, -T >= 1 and -f in [1, %d]\n", MAX_FRAGMENTS);
+        return -1;
+    }
+
     SetupKeyValue();
-    fd = CreateConnection();
 
-    while (run_test_) {
-        len = SendGetRequest(fd);
-        log_trace("Send byte length : %d\n", len);
-        len = ReceiveReply(fd);
-        if (len < 0) {
-            exit(EXIT_FAILURE);
-        }
-        log_trace("Received byte length : %d\n", len);
-        break;
+    pad->reqtype = PAD;
+    pad->keyLen = pad_len_;
+    memset(pad_frame_ + sizeof(req_hdr), 'x', pad_len_);
+
+    fprintf(stdout, "%u connections, %us per pattern, %u fragments per request, %u pad bytes, "
+            "%u reply header pad bytes\n",
+            num_conns_, duration_sec_, num_fragments_, pad_len_, hdr_pad_);
+    fprintf(stdout, "%-36s %4s %12s %12s %12s %10s %9s %8s\n", "pattern", "segs",
+            "msgs/sec", "reqs/sec", "segments/sec", "avg(us)", "p99(us)", "verify");
+
+    for (i = 0; i < NUM_PACKET_STRUCTURES && run_test_; i++) {
+        if (only < 0 || only == i)
+            RunPattern(i);
     }
-    CloseConnection(fd);
+
     DestroyKeyValue();
     return 0;
 }
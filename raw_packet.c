@@ -0,0 +1,437 @@
+#include "raw_packet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#define RAW_TX_BLOCK_SIZE   (1 << 16)
+#define RAW_DATA_OFFSET     (TPACKET_ALIGN(sizeof(struct tpacket3_hdr)))
+
+#define IP_HDR(_frame)      ((struct iphdr *)((_frame) + 14))
+#define UDP_HDR(_frame)     ((struct udphdr *)((_frame) + 14 + 20))
+
+static uint32_t
+CsumPartial(const void *buf, uint32_t len, uint32_t sum)
+{
+    const uint16_t *p = buf;
+
+    while (len > 1) {
+        sum += *p++;
+        len -= 2;
+    }
+    if (len)
+        sum += *(const uint8_t *)p;
+
+    return sum;
+}
+
+static uint16_t
+CsumFold(uint32_t sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* RFC 1624, HC' = ~(~HC + ~m + m'), all values in network order */
+static uint16_t
+CsumReplace16(const uint16_t check, const uint16_t old, const uint16_t new)
+{
+    return CsumFold((uint16_t)~check + (uint16_t)~old + new);
+}
+
+int
+raw_get_ifinfo(const char *ifname, int *ifindex, uint8_t *mac)
+{
+    struct ifreq ifr;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "socket() error, %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+        fprintf(stderr, "ioctl(SIOCGIFINDEX) error, %s, %s\n", ifname, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    *ifindex = ifr.ifr_ifindex;
+
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+        fprintf(stderr, "ioctl(SIOCGIFHWADDR) error, %s, %s\n", ifname, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    close(fd);
+    return 0;
+}
+
+static int
+BindPacketSocket(const int fd, const int ifindex, const uint16_t protocol)
+{
+    struct sockaddr_ll sll;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(protocol);
+    sll.sll_ifindex = ifindex;
+
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        fprintf(stderr, "bind() error, %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int
+raw_tx_ring_open(raw_tx_ring_t *r, const int ifindex, const uint32_t frame_nr)
+{
+    struct tpacket_req3 req;
+    int ver = TPACKET_V3;
+    int one = 1;
+    const uint32_t frames_per_block = RAW_TX_BLOCK_SIZE / RAW_FRAME_SIZE;
+
+    memset(r, 0, sizeof(raw_tx_ring_t));
+
+    /* protocol 0, the socket only transmits */
+    r->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (r->fd < 0) {
+        fprintf(stderr, "socket(AF_PACKET) error, %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0) {
+        fprintf(stderr, "setsockopt(PACKET_VERSION) error, %s\n", strerror(errno));
+        goto fail;
+    }
+
+    /* frames skip the qdisc layer, best effort */
+    setsockopt(r->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = RAW_TX_BLOCK_SIZE;
+    req.tp_block_nr = (frame_nr + frames_per_block - 1) / frames_per_block;
+    req.tp_frame_size = RAW_FRAME_SIZE;
+    req.tp_frame_nr = req.tp_block_nr * frames_per_block;
+
+    if (setsockopt(r->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+        fprintf(stderr, "setsockopt(PACKET_TX_RING) error, %s\n", strerror(errno));
+        goto fail;
+    }
+
+    r->frame_nr = req.tp_frame_nr;
+    r->map_len = (size_t)req.tp_block_size * req.tp_block_nr;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (r->map == MAP_FAILED) {
+        fprintf(stderr, "mmap() error, %s\n", strerror(errno));
+        r->map = NULL;
+        goto fail;
+    }
+
+    if (BindPacketSocket(r->fd, ifindex, ETH_P_IP) < 0)
+        goto fail;
+
+    return 0;
+
+fail :
+    raw_tx_ring_close(r);
+    return -1;
+}
+
+void
+raw_tx_ring_close(raw_tx_ring_t *r)
+{
+    if (r->map)
+        munmap(r->map, r->map_len);
+    if (r->fd >= 0)
+        close(r->fd);
+    r->map = NULL;
+    r->fd = -1;
+}
+
+/* Returns where the next frame is written, NULL while the kernel still
+ * owns it */
+uint8_t *
+raw_tx_ring_get_frame(raw_tx_ring_t *r)
+{
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)(r->map + (size_t)r->head * RAW_FRAME_SIZE);
+    uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+
+    if (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+        return NULL;
+
+    return (uint8_t *)hdr + RAW_DATA_OFFSET;
+}
+
+void
+raw_tx_ring_commit(raw_tx_ring_t *r, const uint32_t len)
+{
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)(r->map + (size_t)r->head * RAW_FRAME_SIZE);
+
+    hdr->tp_len = len;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+    r->head = (r->head + 1) % r->frame_nr;
+    r->pending++;
+}
+
+/* One send() hands every committed frame to the kernel */
+int
+raw_tx_ring_flush(raw_tx_ring_t *r)
+{
+    int ret;
+
+    if (r->pending == 0)
+        return 0;
+
+    ret = send(r->fd, NULL, 0, MSG_DONTWAIT);
+    if (ret < 0 && errno != EAGAIN && errno != ENOBUFS) {
+        fprintf(stderr, "send() error, %s\n", strerror(errno));
+        return -1;
+    }
+    r->pending = 0;
+
+    return ret;
+}
+
+int
+raw_rx_ring_open(raw_rx_ring_t *r, const int ifindex, const in_port_t sport)
+{
+    struct tpacket_req3 req;
+    struct sock_fprog prog;
+    int ver = TPACKET_V3;
+    int one = 1;
+
+    /* accepts unfragmented IPv4/UDP to sport */
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 8),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 4, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohs(sport), 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0x40000),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+
+    memset(r, 0, sizeof(raw_rx_ring_t));
+
+    /* no protocol until the filter is in place */
+    r->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (r->fd < 0) {
+        fprintf(stderr, "socket(AF_PACKET) error, %s\n", strerror(errno));
+        return -1;
+    }
+
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (setsockopt(r->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        fprintf(stderr, "setsockopt(SO_ATTACH_FILTER) error, %s\n", strerror(errno));
+        goto fail;
+    }
+
+    if (setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0) {
+        fprintf(stderr, "setsockopt(PACKET_VERSION) error, %s\n", strerror(errno));
+        goto fail;
+    }
+
+    /* on loopback every frame would show up twice otherwise */
+    setsockopt(r->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = RAW_RX_BLOCK_SIZE;
+    req.tp_block_nr = RAW_RX_BLOCK_NR;
+    req.tp_frame_size = RAW_FRAME_SIZE;
+    req.tp_frame_nr = (RAW_RX_BLOCK_SIZE / RAW_FRAME_SIZE) * RAW_RX_BLOCK_NR;
+    req.tp_retire_blk_tov = 1;      /* ms, hand over partially filled blocks */
+
+    if (setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        fprintf(stderr, "setsockopt(PACKET_RX_RING) error, %s\n", strerror(errno));
+        goto fail;
+    }
+
+    r->block_nr = req.tp_block_nr;
+    r->map_len = (size_t)req.tp_block_size * req.tp_block_nr;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (r->map == MAP_FAILED) {
+        fprintf(stderr, "mmap() error, %s\n", strerror(errno));
+        r->map = NULL;
+        goto fail;
+    }
+
+    if (BindPacketSocket(r->fd, ifindex, ETH_P_IP) < 0)
+        goto fail;
+
+    return 0;
+
+fail :
+    raw_rx_ring_close(r);
+    return -1;
+}
+
+void
+raw_rx_ring_close(raw_rx_ring_t *r)
+{
+    if (r->map)
+        munmap(r->map, r->map_len);
+    if (r->fd >= 0)
+        close(r->fd);
+    r->map = NULL;
+    r->fd = -1;
+}
+
+/* Hands the UDP payload of every packet in the next retired block to fn
+ * and gives the block back. Waits up to timeout_ms for a block, returns
+ * the number of packets. */
+int
+raw_rx_ring_poll(raw_rx_ring_t *r, const int timeout_ms, raw_rx_handler_t fn, void *arg)
+{
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *ppd;
+    struct pollfd pfd;
+    struct iphdr *iph;
+    struct udphdr *udph;
+    uint32_t i, num_pkts, hdr_len;
+
+    bd = (struct tpacket_block_desc *)(r->map + (size_t)r->head * RAW_RX_BLOCK_SIZE);
+
+    if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+        if (timeout_ms == 0)
+            return 0;
+
+        pfd.fd = r->fd;
+        pfd.events = POLLIN | POLLERR;
+        pfd.revents = 0;
+        poll(&pfd, 1, timeout_ms);
+
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+            return 0;
+    }
+
+    num_pkts = bd->hdr.bh1.num_pkts;
+    ppd = (struct tpacket3_hdr *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+
+    for (i = 0; i < num_pkts; i++) {
+        /* truncated packets cannot be verified, and the IP and UDP
+         * lengths are only trusted as far as the captured bytes go */
+        if (ppd->tp_snaplen == ppd->tp_len &&
+                ppd->tp_snaplen >= 14 + sizeof(struct iphdr) + sizeof(struct udphdr)) {
+            iph = (struct iphdr *)((uint8_t *)ppd + ppd->tp_mac + 14);
+            hdr_len = 14 + iph->ihl * 4;
+            udph = (struct udphdr *)((uint8_t *)iph + iph->ihl * 4);
+            if (iph->ihl >= 5 && ppd->tp_snaplen >= hdr_len + sizeof(struct udphdr) &&
+                    ntohs(udph->len) >= sizeof(struct udphdr) &&
+                    ntohs(udph->len) <= ppd->tp_snaplen - hdr_len)
+                fn(arg, (uint8_t *)(udph + 1), ntohs(udph->len) - sizeof(struct udphdr));
+        }
+        ppd = (struct tpacket3_hdr *)((uint8_t *)ppd + ppd->tp_next_offset);
+    }
+
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    r->head = (r->head + 1) % r->block_nr;
+
+    return num_pkts;
+}
+
+uint32_t
+raw_build_udp_frame(uint8_t *frame, const raw_endpoint_t *ep, const in_port_t sport,
+        const void *payload, const uint32_t payload_len)
+{
+    struct ether_header *eth = (struct ether_header *)frame;
+    struct iphdr *iph = IP_HDR(frame);
+    struct udphdr *udph = UDP_HDR(frame);
+    uint32_t sum;
+
+    memcpy(eth->ether_dhost, ep->dmac, ETH_ALEN);
+    memcpy(eth->ether_shost, ep->smac, ETH_ALEN);
+    eth->ether_type = htons(ETHERTYPE_IP);
+
+    iph->version = 4;
+    iph->ihl = 5;
+    iph->tos = 0;
+    iph->tot_len = htons(20 + 8 + payload_len);
+    iph->id = 0;
+    iph->frag_off = htons(IP_DF);
+    iph->ttl = 64;
+    iph->protocol = IPPROTO_UDP;
+    iph->check = 0;
+    iph->saddr = ep->saddr;
+    iph->daddr = ep->daddr;
+    iph->check = CsumFold(CsumPartial(iph, 20, 0));
+
+    udph->source = sport;
+    udph->dest = ep->dport;
+    udph->len = htons(8 + payload_len);
+    udph->check = 0;
+
+    memcpy(udph + 1, payload, payload_len);
+
+    /* pseudo header + udp header + payload */
+    sum = CsumPartial(&iph->saddr, 8, 0);
+    sum += htons(IPPROTO_UDP) + udph->len;
+    sum = CsumPartial(udph, 8 + payload_len, sum);
+    udph->check = CsumFold(sum);
+    if (udph->check == 0)
+        udph->check = 0xffff;
+
+    return RAW_HDR_LEN + payload_len;
+}
+
+void
+raw_set_ip_id(uint8_t *frame, const uint16_t id)
+{
+    struct iphdr *iph = IP_HDR(frame);
+    uint16_t new_id = htons(id);
+
+    iph->check = CsumReplace16(iph->check, iph->id, new_id);
+    iph->id = new_id;
+}
+
+void
+raw_set_udp_sport(uint8_t *frame, const in_port_t sport)
+{
+    struct udphdr *udph = UDP_HDR(frame);
+
+    udph->check = CsumReplace16(udph->check, udph->source, sport);
+    if (udph->check == 0)
+        udph->check = 0xffff;
+    udph->source = sport;
+}
+
+/* off must be even, relative to the start of the UDP payload */
+void
+raw_set_payload32(uint8_t *frame, const uint32_t off, const uint32_t val)
+{
+    struct udphdr *udph = UDP_HDR(frame);
+    uint16_t *p = (uint16_t *)(frame + RAW_HDR_LEN + off);
+    const uint16_t *v = (const uint16_t *)&val;
+
+    udph->check = CsumReplace16(udph->check, p[0], v[0]);
+    udph->check = CsumReplace16(udph->check, p[1], v[1]);
+    if (udph->check == 0)
+        udph->check = 0xffff;
+    p[0] = v[0];
+    p[1] = v[1];
+}
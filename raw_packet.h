@@ -0,0 +1,66 @@
+#ifndef __RAW_PACKET_H__
+#define __RAW_PACKET_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <net/ethernet.h>
+
+#define RAW_HDR_LEN         (14 + 20 + 8)   /* ethernet + ipv4 + udp */
+#define RAW_FRAME_SIZE      (2048)
+#define RAW_RX_BLOCK_SIZE   (1 << 20)
+#define RAW_RX_BLOCK_NR     (16)
+
+typedef struct raw_endpoint_s {
+    uint8_t smac[ETH_ALEN];
+    uint8_t dmac[ETH_ALEN];
+    in_addr_t saddr;            /* network order */
+    in_addr_t daddr;            /* network order */
+    in_port_t dport;            /* network order */
+} raw_endpoint_t;
+
+/* PACKET_TX_RING of fixed size frames, filled in order */
+typedef struct raw_tx_ring_s {
+    int fd;
+    uint8_t *map;
+    size_t map_len;
+    uint32_t frame_nr;
+    uint32_t head;
+    uint32_t pending;           /* frames handed to the kernel since the last flush */
+} raw_tx_ring_t;
+
+/* PACKET_RX_RING of TPACKET_V3 blocks, each holding several packets */
+typedef struct raw_rx_ring_s {
+    int fd;
+    uint8_t *map;
+    size_t map_len;
+    uint32_t block_nr;
+    uint32_t head;
+} raw_rx_ring_t;
+
+typedef void (*raw_rx_handler_t)(void *arg, uint8_t *payload, const uint32_t len);
+
+int raw_get_ifinfo(const char *ifname, int *ifindex, uint8_t *mac);
+
+int raw_tx_ring_open(raw_tx_ring_t *r, const int ifindex, const uint32_t frame_nr);
+void raw_tx_ring_close(raw_tx_ring_t *r);
+uint8_t *raw_tx_ring_get_frame(raw_tx_ring_t *r);
+void raw_tx_ring_commit(raw_tx_ring_t *r, const uint32_t len);
+int raw_tx_ring_flush(raw_tx_ring_t *r);
+
+/* only unfragmented UDP datagrams to sport reach the ring */
+int raw_rx_ring_open(raw_rx_ring_t *r, const int ifindex, const in_port_t sport);
+void raw_rx_ring_close(raw_rx_ring_t *r);
+int raw_rx_ring_poll(raw_rx_ring_t *r, const int timeout_ms, raw_rx_handler_t fn, void *arg);
+
+/* Builds ethernet/ipv4/udp headers in front of payload, with source port,
+ * IP id and checksums valid. Returns the frame length. */
+uint32_t raw_build_udp_frame(uint8_t *frame, const raw_endpoint_t *ep, const in_port_t sport,
+        const void *payload, const uint32_t payload_len);
+
+/* Field updates that keep the IP and UDP checksums valid (RFC 1624) */
+void raw_set_ip_id(uint8_t *frame, const uint16_t id);
+void raw_set_udp_sport(uint8_t *frame, const in_port_t sport);
+void raw_set_payload32(uint8_t *frame, const uint32_t off, const uint32_t val);
+
+#endif
@@ -136,3 +136,71 @@ rng_zipfian(void) {
 }
 #endif
 
+
+/* xoshiro256** seeded through splitmix64, cheap enough to run one per
+ * thread or per block of work */
+static inline uint64_t
+Rotl(const uint64_t x, const int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t
+SplitMix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* uniform in (0, 1), both ends open so that log() and pow() stay finite */
+static inline double
+UniformOpen(rng_state_t *st) {
+    return ((rng_next(st) >> 11) + 0.5) * (1.0 / (1ULL << 53));
+}
+
+void
+rng_state_init(rng_state_t *st, const uint64_t seed, const uint64_t stream) {
+
+    uint64_t x = seed ^ SplitMix64(&(uint64_t){stream});
+    int i;
+
+    for (i = 0; i < 4; i++)
+        st->s[i] = SplitMix64(&x);
+}
+
+uint64_t
+rng_next(rng_state_t *st) {
+
+    uint64_t *s = st->s;
+    const uint64_t result = Rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = Rotl(s[3], 45);
+
+    return result;
+}
+
+uint64_t
+rng_gev_r(rng_state_t *st, const double mu, const double sigma, const double xi) {
+
+    double p = UniformOpen(st);
+
+    if (xi == 0) {
+        return (uint64_t)(mu - sigma * log(-log(p)));
+    } else {
+        return (uint64_t)(mu + (sigma / xi) * (pow(-log(p), -xi) - 1));
+    }
+}
+
+uint64_t
+rng_gpd_r(rng_state_t *st, const double mu, const double sigma, const double xi) {
+
+    double p = UniformOpen(st);
+
+    return (uint64_t)((sigma / xi) * (pow(1-p, -xi) - 1) + mu);
+}
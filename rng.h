@@ -20,4 +20,15 @@ uint64_t rng_gpd(const double mu, const double sigma, const double xi);
 //uint64_t rng_zipfian(void);
 #endif
 uint64_t rng_int32(void);
+
+/* Independent generators for threads, one stream per (seed, stream)
+ * pair, the same numbers on every run */
+typedef struct rng_state_s {
+    uint64_t s[4];
+} rng_state_t;
+
+void rng_state_init(rng_state_t *st, const uint64_t seed, const uint64_t stream);
+uint64_t rng_next(rng_state_t *st);
+uint64_t rng_gev_r(rng_state_t *st, const double mu, const double sigma, const double xi);
+uint64_t rng_gpd_r(rng_state_t *st, const double mu, const double sigma, const double xi);
 #endif
@@ -0,0 +1,268 @@
+#include "topology.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+
+#define SYSFS_CPU   "/sys/devices/system/cpu"
+
+static topology_cpu_t cpus_[TOPOLOGY_MAX_CPUS];
+static int num_cpus_ = 0;
+static int nic_node_ = -1;
+
+/* "0-3,8,10-11" into out, returns the number of CPUs or -1 */
+static int
+ParseCpuList(const char *s, int *out, const int max)
+{
+    char *end;
+    long first, last;
+    int n = 0;
+
+    while (*s && *s != '\n') {
+        first = strtol(s, &end, 10);
+        if (end == s || first < 0)
+            return -1;
+        last = first;
+        s = end;
+        if (*s == '-') {
+            last = strtol(s + 1, &end, 10);
+            if (end == s + 1 || last < first)
+                return -1;
+            s = end;
+        }
+        for (; first <= last; first++) {
+            if (n == max)
+                return -1;
+            out[n++] = first;
+        }
+        if (*s == ',')
+            s++;
+        else if (*s && *s != '\n')
+            return -1;
+    }
+
+    return n;
+}
+
+static int
+ReadInt(const char *path, int *val)
+{
+    FILE *f = fopen(path, "r");
+    int ret;
+
+    if (!f)
+        return -1;
+    ret = fscanf(f, "%d", val) == 1 ? 0 : -1;
+    fclose(f);
+    return ret;
+}
+
+static int
+ReadList(const char *path, int *out, const int max)
+{
+    char buf[4096];
+    FILE *f = fopen(path, "r");
+    int ret = -1;
+
+    if (!f)
+        return -1;
+    if (fgets(buf, sizeof(buf), f))
+        ret = ParseCpuList(buf, out, max);
+    fclose(f);
+    return ret;
+}
+
+static int
+CpuNode(const int cpu)
+{
+    char path[128];
+    struct dirent *de;
+    DIR *d;
+    int node = 0;
+
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d", cpu);
+    d = opendir(path);
+    if (!d)
+        return 0;
+
+    while ((de = readdir(d))) {
+        if (strncmp(de->d_name, "node", 4) == 0 && de->d_name[4] >= '0' && de->d_name[4] <= '9') {
+            node = atoi(de->d_name + 4);
+            break;
+        }
+    }
+
+    closedir(d);
+    return node;
+}
+
+static int
+LoadTopology(void)
+{
+    int online[TOPOLOGY_MAX_CPUS];
+    int siblings[TOPOLOGY_MAX_CPUS];
+    char path[128];
+    topology_cpu_t *t;
+    int i, j, n, num_siblings;
+
+    if (num_cpus_ > 0)
+        return 0;
+
+    n = ReadList(SYSFS_CPU "/online", online, TOPOLOGY_MAX_CPUS);
+    if (n <= 0) {
+        fprintf(stderr, "cannot read " SYSFS_CPU "/online\n");
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        t = &cpus_[i];
+        t->cpu = online[i];
+        t->node = CpuNode(t->cpu);
+        t->nic_irq = false;
+
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/core_id", t->cpu);
+        if (ReadInt(path, &t->core) < 0)
+            t->core = t->cpu;
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/physical_package_id", t->cpu);
+        if (ReadInt(path, &t->package) < 0)
+            t->package = 0;
+
+        t->smt_index = 0;
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/thread_siblings_list", t->cpu);
+        num_siblings = ReadList(path, siblings, TOPOLOGY_MAX_CPUS);
+        for (j = 0; j < num_siblings; j++) {
+            if (siblings[j] == t->cpu) {
+                t->smt_index = j;
+                break;
+            }
+        }
+    }
+    num_cpus_ = n;
+
+    return 0;
+}
+
+/* Marks the CPUs that the NIC's MSI interrupts are steered to and
+ * remembers the NIC's node */
+static void
+LoadNic(const char *ifname)
+{
+    char path[512];
+    int irq_cpus[TOPOLOGY_MAX_CPUS];
+    struct dirent *de;
+    DIR *d;
+    int i, j, n;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", ifname);
+    if (ReadInt(path, &nic_node_) < 0 || nic_node_ < 0)
+        nic_node_ = -1;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", ifname);
+    d = opendir(path);
+    if (!d)
+        return;
+
+    while ((de = readdir(d))) {
+        if (de->d_name[0] < '0' || de->d_name[0] > '9')
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/irq/%s/effective_affinity_list", de->d_name);
+        n = ReadList(path, irq_cpus, TOPOLOGY_MAX_CPUS);
+        if (n <= 0) {
+            snprintf(path, sizeof(path), "/proc/irq/%s/smp_affinity_list", de->d_name);
+            n = ReadList(path, irq_cpus, TOPOLOGY_MAX_CPUS);
+        }
+
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < num_cpus_; j++) {
+                if (cpus_[j].cpu == irq_cpus[i])
+                    cpus_[j].nic_irq = true;
+            }
+        }
+    }
+
+    closedir(d);
+}
+
+static int
+CompareCpu(const void *a, const void *b)
+{
+    const topology_cpu_t *x = *(const topology_cpu_t **)a;
+    const topology_cpu_t *y = *(const topology_cpu_t **)b;
+
+    if (nic_node_ >= 0 && (x->node == nic_node_) != (y->node == nic_node_))
+        return x->node == nic_node_ ? -1 : 1;
+    if (x->smt_index != y->smt_index)
+        return x->smt_index - y->smt_index;
+    if (x->nic_irq != y->nic_irq)
+        return x->nic_irq ? 1 : -1;
+    if (x->node != y->node)
+        return x->node - y->node;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+int
+topology_placement(const char *policy, int *cpus, const int max_cpus)
+{
+    topology_cpu_t *order[TOPOLOGY_MAX_CPUS];
+    int i, n;
+
+    if (LoadTopology() < 0)
+        return -1;
+
+    if (strcmp(policy, "linear") == 0) {
+        n = num_cpus_ < max_cpus ? num_cpus_ : max_cpus;
+        for (i = 0; i < n; i++)
+            cpus[i] = cpus_[i].cpu;
+        return n;
+    }
+
+    if (strcmp(policy, "physical") == 0 || strncmp(policy, "nic:", 4) == 0) {
+        if (policy[0] == 'n')
+            LoadNic(policy + 4);
+
+        for (i = 0; i < num_cpus_; i++)
+            order[i] = &cpus_[i];
+        qsort(order, num_cpus_, sizeof(topology_cpu_t *), CompareCpu);
+
+        n = num_cpus_ < max_cpus ? num_cpus_ : max_cpus;
+        for (i = 0; i < n; i++)
+            cpus[i] = order[i]->cpu;
+        return n;
+    }
+
+    n = ParseCpuList(policy, cpus, max_cpus);
+    if (n <= 0) {
+        fprintf(stderr, "invalid placement %s\n", policy);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (!topology_cpu(cpus[i])) {
+            fprintf(stderr, "cpu %d is not online\n", cpus[i]);
+            return -1;
+        }
+    }
+
+    return n;
+}
+
+const topology_cpu_t *
+topology_cpu(const int cpu)
+{
+    int i;
+
+    if (LoadTopology() < 0)
+        return NULL;
+
+    for (i = 0; i < num_cpus_; i++) {
+        if (cpus_[i].cpu == cpu)
+            return &cpus_[i];
+    }
+
+    return NULL;
+}
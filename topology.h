@@ -0,0 +1,31 @@
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TOPOLOGY_MAX_CPUS   (1024)
+
+typedef struct topology_cpu_s {
+    int cpu;
+    int core;           /* core_id within the package */
+    int package;
+    int node;           /* NUMA node, 0 when the kernel has none */
+    int smt_index;      /* position among the thread siblings of its core */
+    bool nic_irq;       /* serves an interrupt of the NIC given to the policy */
+} topology_cpu_t;
+
+/* Fills cpus with the order threads are pinned in, thread i goes to
+ * cpus[i % n]. policy is one of
+ *   linear         online CPUs in number order
+ *   physical       one CPU per physical core first, then the SMT siblings
+ *   nic:<ifname>   like physical, the NIC's node first and the CPUs taking
+ *                  its interrupts last
+ *   <cpu list>     explicit, e.g. 0,2,4-7
+ * Returns n, or -1 on error. */
+int topology_placement(const char *policy, int *cpus, const int max_cpus);
+
+/* Description of an online CPU, NULL if it is not one */
+const topology_cpu_t *topology_cpu(const int cpu);
+
+#endif
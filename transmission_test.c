@@ -4,6 +4,7 @@
 #include <sys/uio.h>
 #include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <stddef.h>
 #include <unistd.h>
@@ -15,11 +16,25 @@
 #include <sched.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <xxhash.h>
+#include <linux/filter.h>
+#ifdef _USE_IO_URING
+#include <liburing.h>
+#endif
+#ifdef _USE_NUMA
+#include <numa.h>
+#endif
 
 #include "hashtable.h"
 #include "connection.h"
 #include "rng.h"
+#include "raw_packet.h"
+#include "topology.h"
+#include "coroutine.h"
+#include "dataset.h"
+#include "latency.h"
 
 #define log_error(_f, _m...) do{\
     fprintf(stderr, "[Error][%10s:%4d]" _f, __FUNCTION__, __LINE__, ##_m);\
@@ -29,41 +44,232 @@
     fprintf(stdout, "[TRACE][%10s:%4d]" _f, __FUNCTION__, __LINE__, ##_m);\
 } while(0)
 
-#define GET 0
+/* request types, a SET carries set_hdr and the value after its key and
+ * the replies to SET and DELETE carry no value. A multi-get puts the
+ * number of keys in keyLen, each key follows with a length byte in
+ * front, and is answered by one rep_hdr+value per key in key order. */
+#define GET     0
+#define SET     1
+#define DELETE  2
+#define MGET    3
+#define NUM_OPS 4
 
 #define FIRST_BITMASK       (UINT32_MAX)
 #define SECOND_BITMASK      ((1LU << 48) - 1) & (~((1LU << 16) - 1))
 #define THIRD_BITMASK       (UINT64_MAX) & ~((1LU << 32) - 1)
 #define CONNECTION_BUFSIZE  (16384)
 
+enum io_backend {
+    IO_BACKEND_EPOLL    =   0,
+    IO_BACKEND_URING    =   1,
+    IO_BACKEND_CORO     =   2,  /* epoll, the connection logic as coroutines */
+};
+
+enum verify_mode {
+    VERIFY_MEMCMP   =   0,  /* compare against the stored or synthesized value */
+    VERIFY_DIGEST   =   1,  /* compare the XXH3 digest, values are not kept */
+};
+
 typedef struct req_hdr_ req_hdr;
 typedef struct rep_hdr_ rep_hdr;
+typedef struct udp_hdr_ udp_hdr;
+typedef struct set_hdr_ set_hdr;
 
 struct req_hdr_ {
     uint8_t reqtype;
     uint8_t keyLen;
 } __attribute__((packed));
 
+/* the server may put hdr_pad_ bytes of padding between rep_hdr and the
+ * value, they stand for metadata riding along with the reply */
 struct rep_hdr_ {
     uint8_t replyType;
     uint16_t valLen;
     uint8_t val[];
 } __attribute__((packed));
 
-static uint8_t num_threads_;
-static uint16_t max_concurrency_;
+struct set_hdr_ {
+    uint16_t valLen;
+} __attribute__((packed));
+
+/* Prefixes req_hdr+key and rep_hdr+value in UDP mode, one frame per
+ * datagram. The server echoes reqId back. */
+struct udp_hdr_ {
+    uint32_t reqId;
+} __attribute__((packed));
+
+/* Target of a share of the keys */
+typedef struct server_s {
+    struct sockaddr_in addr;
+    uint32_t num_items;         /* items whose key maps to this server */
+} server_t;
+
+typedef struct server_stats_s {
+    uint64_t num_requests;
+    uint64_t num_replies;
+    uint64_t rx_bytes;
+    uint64_t total_latency_ns;  /* queued to reply, summed over replies */
+} server_stats_t;
+
+#define MAX_SERVERS         (64)
+
+typedef struct op_stats_s {
+    uint64_t num_requests;      /* frames */
+    uint64_t num_replies;       /* frames fully answered */
+    uint64_t num_keys;          /* keys answered, more than frames for multi-gets */
+    uint64_t num_misses;        /* GETs answered without a value */
+    uint64_t total_latency_ns;
+    latency_hist_t hist;
+} op_stats_t;
+
+/* Counters of one transmission thread, summed by PrintLog. Every thread
+ * owns its cache lines, so hundreds of threads do not contend. */
+typedef struct thread_stats_s {
+    uint64_t num_requests;
+    uint64_t num_writev;
+    uint64_t num_verify_fail;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t num_connect;
+    uint64_t num_close;
+    uint64_t total_setup_ns;
+    uint64_t num_setup;
+    uint64_t total_short_conn_ns;
+    uint64_t num_short_conn;
+    uint64_t num_udp_replies;
+    uint64_t num_udp_timeouts;
+    uint64_t num_udp_late;
+    op_stats_t op[NUM_OPS];
+    server_stats_t server[MAX_SERVERS];
+} __attribute__((aligned(64))) thread_stats_t;
+
+/* Counters here and in the latency histograms have a single writer,
+ * their thread, and are read by PrintLog and the concurrency search while
+ * it runs. A relaxed load and store keeps every read whole at the cost
+ * of a plain add. */
+static inline void
+StatAdd(uint64_t *p, const uint64_t n)
+{
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+#define STAT_ADD(_x, _n)    StatAdd(&(_x), _n)
+#define STAT_INC(_x)        StatAdd(&(_x), 1)
+#define STAT_LOAD(_x)       __atomic_load_n(&(_x), __ATOMIC_RELAXED)
+
+#define EPOLL_MAX_EVENTS    (1024)      /* events taken per epoll_wait() */
+#define SHARD_STASH_SIZE    (64)        /* must be a power of 2 */
+
+/* Items drawn for other servers, kept per thread until a connection to
+ * their server asks for one */
+typedef struct shard_stash_s {
+    kv_hashtable_item_t *items[SHARD_STASH_SIZE];
+    uint16_t head;
+    uint16_t count;
+} shard_stash_t;
+
+/* One measured step of the concurrency search */
+typedef struct search_point_s {
+    uint32_t concurrency;
+    double throughput;          /* replies/sec */
+    double p50_us;
+    double p99_us;
+} search_point_t;
+
+#define SEARCH_MAX_POINTS   (64)
+
+#define REBALANCE_INTERVAL_NS   (100 * 1000000LU)
+#define REBALANCE_MARGIN        (100)       /* permille of busy time */
+
+#define UDP_BATCH           32
+#define UDP_MAX_SOCKETS     (1024)      /* -U, sockets per thread */
+#define UDP_RCV_BUFSIZE     (1 << 16)
+#define UDP_SCAN_INTERVAL   (10)        /* ms between timeout scans */
+
+static uint16_t num_threads_;
+static uint32_t max_concurrency_;
 static bool *run_;
 static pthread_t *transmission_thread_tid_;
-static uint8_t *thread_no_;
+static uint16_t *thread_no_;
 static uint32_t num_items_;
 static kv_hashtable_item_t **items_;
 static struct timespec global_test_start_ts_;
-static uint32_t num_close_ = 0;
-static uint32_t num_connect_ = 0;
-static uint64_t num_requests = 0;
 static bool persistent_connection_ = false;
+static uint16_t pipeline_depth_ = 1;
+static enum verify_mode verify_mode_ = VERIFY_MEMCMP;
+static uint32_t verify_sample_rate_ = 1;
+/* percentage of GET, SET and DELETE requests */
+static uint8_t op_mix_[NUM_OPS] = {100, 0, 0};
+static bool write_mix_ = false;
+static const char *op_name_[NUM_OPS] = {"GET", "SET", "DELETE", "MGET"};
+/* keys per multi-get, 1 sends plain GETs. A ring slot holds one key, so a
+ * connection has pipeline_depth_ frames of up to mget_fanout_ keys. */
+static uint16_t mget_fanout_ = 1;
+static uint16_t ring_slots_ = 1;
+static uint16_t hdr_pad_ = 0;       /* reply header padding, set like the server's */
+static const char *dataset_path_ = DATASET_PATH;
+static uint64_t synth_seed_;        /* of a DATASET_FLAG_SYNTH dataset */
+static uint32_t tx_buf_size_ = CONNECTION_BUFSIZE;    /* io_uring staging, fits the largest frame */
+static enum io_backend io_backend_ = IO_BACKEND_EPOLL;
+static bool uring_sqpoll_ = false;
+static bool fast_open_ = false;
+static bool udp_mode_ = false;
+static int udp_sockets_per_thread_ = 4;
+static uint32_t udp_timeout_ms_ = 100;
+static const char *raw_ifname_ = NULL;
+static int raw_ifindex_;
+static raw_endpoint_t raw_ep_;
+static uint8_t *raw_templates_ = NULL;
+static uint16_t *raw_template_len_ = NULL;
 
 static struct sockaddr_in daddr_;
+static server_t servers_[MAX_SERVERS];
+static uint16_t num_servers_ = 0;
+static __thread shard_stash_t *stash_;
+static const char *placement_ = "linear";
+static int *thread_cpu_;
+/* per NUMA node copy of items_ with keys and values, NULL where unused */
+static kv_hashtable_item_t ***node_items_ = NULL;
+static size_t *node_items_len_ = NULL;
+static int num_nodes_ = 1;
+static __thread kv_hashtable_item_t **local_items_;
+/* connections of all threads together, lowered and raised at runtime by
+ * the concurrency search */
+static uint32_t concurrency_limit_;
+static uint32_t search_slo_us_ = 0;
+static uint32_t search_window_ms_ = 2000;
+static latency_hist_t **lat_hist_ = NULL;
+static __thread latency_hist_t *hist_ = NULL;
+static __thread int *local_concurrency_;
+/* -B, threads hand connection slots to each other by how busy they are.
+ * Quotas and busy shares are written by their owner only, the spare
+ * slots move through spare_slots_ with atomic operations. */
+static bool rebalance_ = false;
+static uint32_t *thread_quota_ = NULL;
+static uint32_t *thread_busy_ = NULL;      /* permille of the last interval spent outside the wait */
+static uint32_t spare_slots_ = 0;
+static uint64_t num_handoffs_ = 0;         /* slots handed to the spare pool */
+static __thread uint32_t *local_quota_;
+/* Phases of a run: the threads open their connections, -r of them per
+ * second each, then the load warms up for -w seconds, with -K after
+ * touching every key once, and only then the measurement window opens.
+ * It lasts -L seconds, or until interrupted. */
+static uint32_t ramp_rate_ = 0;             /* 0 opens them all at once */
+static uint32_t warmup_sec_ = 10;
+static bool warmup_touch_ = false;
+static uint32_t measure_sec_ = 0;
+static uint32_t num_ramped_ = 0;            /* threads through their ramp */
+static uint32_t num_touched_ = 0;           /* threads through their key slice */
+static bool measuring_ = false;
+static thread_stats_t *base_stats_ = NULL;  /* sums at the start of the window */
+static uint64_t *base_replies_ = NULL;      /* per thread */
+static double base_cpu_sec_;
+static uint64_t base_ns_;                   /* CLOCK_MONOTONIC start of the window */
+static __thread bool ramp_done_ = false;
+static __thread uint64_t ramp_next_ns_ = 0;
+static __thread uint32_t ramp_opened_ = 0;
+static __thread uint32_t touch_next_, touch_end_;
+static struct sockaddr_in saddr_;
 static in_port_t dport;
 static in_addr_t dIp;
 
@@ -72,15 +278,57 @@ static void TeardownTransmissionTest(void);
 static void *RunTransmissionTestThread(void *arg);
 
 static void SetCoreAffinity(const int thread_no);
+static void SetupPlacement(void);
 
-static connection_t *CreateConnection(connection_pool_t *cp, int *thread_concurrency, int ep);
+static int SetupSocket(const int fd);
+static connection_t *CreateConnection(connection_pool_t **cp, int *thread_concurrency, int ep);
 static connection_t *TryConnection(connection_t *c, const int ep, int *thread_concurrency);
-static int SendRandomGetRequest(connection_t *c, const int ep, connection_pool_t *cp, int *thread_concurrency);
-static int ReceiveReply(connection_t *c, const int ep, connection_pool_t *cp, int *thread_concurrency);
-static void CloseConnection(connection_t *c, connection_pool_t *cp, int *thread_concurrency);
+static uint16_t FillRequestRing(connection_t *c);
+static int SendRandomGetRequest(connection_t *c, const int ep, connection_pool_t **cp, int *thread_concurrency);
+static int ReceiveReply(connection_t *c, const int ep, connection_pool_t **cp, int *thread_concurrency);
+static int ReadReplies(connection_t *c);
+static int ConnectStep(connection_t *c, const uint32_t events, const int ep, int *thread_concurrency);
+static int ReplyStep(connection_t *c, const uint32_t events, const int ep,
+        connection_pool_t **cp, int *thread_concurrency);
+static int ConnectionTask(connection_t *c, const uint32_t events, const int ep,
+        connection_pool_t **cp, int *thread_concurrency);
+static void CloseConnection(connection_t *c, connection_pool_t **cp, int *thread_concurrency);
+static uint64_t ElapsedNs(const struct timespec *from);
+static int AddServers(char *list);
+static int LoadServerFile(const char *path);
+static uint16_t ItemServer(const kv_hashtable_item_t *it);
+static kv_hashtable_item_t *NextItem(const uint16_t server);
+static uint8_t NextOp(void);
+static uint32_t FrameLen(const uint8_t op, const kv_hashtable_item_t *it);
+static bool RingHasRoom(const connection_t *c);
+static connection_t *AllocateConnection(connection_pool_t **cp);
+static int ThreadConcurrencyLimit(void);
+static bool OverConcurrencyLimit(void);
+static void Rebalance(const uint16_t thread_number, const uint64_t idle_ns);
+static uint32_t DrawIndex(void);
+static bool RampAllows(void);
+static int RampTimeout(void);
+static void RampCheck(const int *thread_concurrency);
+static void MarkRamped(void);
+static void RunPhases(void);
+static void StopTest(void);
+static void RecordLatency(const uint64_t ns);
+static void RunConcurrencySearch(void);
+static void AccountSetup(connection_t *c);
 
 static void SignalInterruptHandler(int signo);
-static bool CheckReply(connection_t *c, uint8_t *buf, const ssize_t buf_size);
+static int ParseReplies(connection_t *c, uint8_t *buf, const ssize_t buf_size);
+static bool CheckReply(kv_hashtable_item_t *it, const uint32_t off, uint8_t *buf, const ssize_t buf_size);
+static bool CheckReplyDigest(connection_t *c, kv_hashtable_item_t *it);
+
+static void RunEpollLoop(const uint16_t thread_number, connection_pool_t **cp,
+        int *thread_concurrency, const int thread_max_concurrency);
+static void RunUdpLoop(const uint16_t thread_number, const int thread_max_concurrency);
+static void RunRawLoop(const uint16_t thread_number, const int thread_max_concurrency);
+#ifdef _USE_IO_URING
+static void RunUringLoop(const uint16_t thread_number, connection_pool_t **cp,
+        int *thread_concurrency, const int thread_max_concurrency);
+#endif
 
 static void MixItems(const uint64_t hv_bitmask);
 static void QuickSort(const uint64_t hv_bitmask, const int left, const int right);
@@ -88,10 +336,12 @@ static void QuickSort(const uint64_t hv_bitmask, const int left, const int right
 static void *PrintLog(void *arg);
 static pthread_mutex_t logMtx_ = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t logCnd_ = PTHREAD_COND_INITIALIZER;
-static uint64_t total_rx_bytes = 0;
-static uint64_t total_tx_bytes = 0;
 static bool run_log_ = true;
-static int *per_thread_concurrency[16];
+static int **per_thread_concurrency;
+static thread_stats_t **thread_stats_;
+static __thread thread_stats_t *stats_;
+static __thread uint8_t *rx_buf_;       /* epoll backend reads replies here */
+static long rss_baseline_;              /* bytes resident before the threads start */
 
 static void
 SignalInterruptHandler(int signo)
@@ -103,24 +353,26 @@ SignalInterruptHandler(int signo)
     }
     run_log_ = false;
 }
-/* (keyLen,key,valLen,val)*/
+/* Items come from the dataset, see dataset.h */
 static void
 SetupTransmissionTest(void) {
 
-    FILE *sample_key_value_file = NULL;
-    char line[1 << 16];
-    char *key, *val, *saveptr, *endptr, *p;
-    uint16_t keyLen;
-    uint32_t valLen;
+    dataset_t *ds;
     uint16_t flags;
     kv_hashtable_item_t *it;
     uint32_t count = 0;
 
     hashtable_setup(20);
 
-    sample_key_value_file = fopen("sample_key_value.txt", "r");
-    if (!sample_key_value_file) {
-        log_error("fopen() error, %s\n", strerror(errno));
+    ds = dataset_open(dataset_path_);
+    if (!ds) {
+        log_error("no dataset at %s, make one with gen_random_key_value or dataset_convert\n",
+                dataset_path_);
+        exit(EXIT_FAILURE);
+    }
+
+    if (ds->num_items < num_items_) {
+        log_error("%s holds %lu items, %u requested\n", dataset_path_, ds->num_items, num_items_);
         exit(EXIT_FAILURE);
     }
 
@@ -130,23 +382,48 @@ SetupTransmissionTest(void) {
         exit(EXIT_FAILURE);
     }
 
-    while (count < num_items_) {
-        if (!fgets(line, 1 << 16, sample_key_value_file))
-            break;
-        p = strtok_r(line, ",", &saveptr);
-        keyLen = strtol(p, &endptr, 10);
-        key = strtok_r(NULL, ",", &saveptr);
-        p = strtok_r(NULL, ",", &saveptr);
-        valLen = strtol(p, &endptr, 10);
-        val = strtok_r(NULL, ",", &saveptr);
-        it = hashtable_put(key, keyLen, val, valLen, &flags);
+    /* A synthesized dataset never has its values kept, they are
+     * regenerated from the key hash to verify replies */
+    if (ds->synth && write_mix_) {
+        log_error("%s synthesizes its values, SETs need them stored\n", dataset_path_);
+        exit(EXIT_FAILURE);
+    }
+    synth_seed_ = ds->seed;
+
+    /* keyLen is one byte on the wire, and the -R templates are sized
+     * by it */
+    if (dataset_check_key_len(ds, num_items_, UINT8_MAX) < 0)
+        exit(EXIT_FAILURE);
+
+    for (count = 0; count < num_items_; count++) {
+        if (verify_mode_ == VERIFY_DIGEST || ds->synth)
+            it = hashtable_put_digest((void *)dataset_key(ds, count), dataset_key_len(ds, count),
+                    dataset_value_len(ds, count), dataset_digest(ds, count), &flags);
+        else
+            it = hashtable_put((void *)dataset_key(ds, count), dataset_key_len(ds, count),
+                    (void *)dataset_value(ds, count), dataset_value_len(ds, count), &flags);
         items_[count] = it;
-        count++;
+        if (FrameLen(SET, it) > tx_buf_size_)
+            tx_buf_size_ = FrameLen(SET, it);
     }
+    if (sizeof(req_hdr) + mget_fanout_ * (1 + UINT8_MAX) > tx_buf_size_)
+        tx_buf_size_ = sizeof(req_hdr) + mget_fanout_ * (1 + UINT8_MAX);
 
     MixItems(FIRST_BITMASK);
 
-    fclose(sample_key_value_file);
+    dataset_close(ds);
+
+    for (count = 0; count < num_items_; count++)
+        servers_[ItemServer(items_[count])].num_items++;
+
+    for (count = 0; count < num_servers_; count++) {
+        log_trace("server %u %s:%u, %u items\n", count, inet_ntoa(servers_[count].addr.sin_addr),
+                ntohs(servers_[count].addr.sin_port), servers_[count].num_items);
+        if (servers_[count].num_items == 0) {
+            log_error("no item maps to server %u, use more items or fewer servers\n", count);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     run_ = malloc(sizeof(bool) * num_threads_);
     if (!run_) {
@@ -160,12 +437,19 @@ SetupTransmissionTest(void) {
         exit(EXIT_FAILURE);
     }
 
-    thread_no_ = malloc((sizeof(uint8_t) * num_threads_));
+    thread_no_ = malloc((sizeof(uint16_t) * num_threads_));
     if (!thread_no_) {
         log_error("malloc() error, %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
+    per_thread_concurrency = calloc(num_threads_, sizeof(int *));
+    thread_stats_ = calloc(num_threads_, sizeof(thread_stats_t *));
+    if (!per_thread_concurrency || !thread_stats_) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
     signal(SIGINT, SignalInterruptHandler);
 
 }
@@ -219,19 +503,73 @@ QuickSort(const uint64_t hv_bitmask, const int left, const int right)
     QuickSort(hv_bitmask, i, right);
 }
 
+/* One descriptor per connection, the soft limit is raised as far as the
+ * hard limit allows. Beyond ~64K connections per server address the
+ * local ports run out as well, give more -S addresses or ports. */
+static void
+RaiseFileLimit(void)
+{
+    struct rlimit rl;
+    const rlim_t need = (rlim_t)max_concurrency_ + num_threads_ * 4 + 64;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        log_error("getrlimit() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (rl.rlim_cur >= need)
+        return;
+
+    rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= need ? need : rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        log_error("setrlimit() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (rl.rlim_cur < need)
+        log_trace("open file limit is %lu, %u connections need %lu\n",
+                (unsigned long)rl.rlim_cur, max_concurrency_, (unsigned long)need);
+}
+
 static void
 TeardownTransmissionTest(void) {
+    int i;
+
     free(transmission_thread_tid_);
     free(run_);
     free(thread_no_);
+#ifdef _USE_NUMA
+    for (i = 0; i < num_nodes_; i++) {
+        if (node_items_[i])
+            numa_free(node_items_[i], node_items_len_[i]);
+    }
+#endif
+    free(node_items_);
+    free(node_items_len_);
+    free(thread_cpu_);
+    if (lat_hist_) {
+        for (i = 0; i < num_threads_; i++)
+            free(lat_hist_[i]);
+        free(lat_hist_);
+    }
+    for (i = 0; i < num_threads_; i++) {
+        free(thread_stats_[i]);
+        free(per_thread_concurrency[i]);
+    }
+    free(thread_stats_);
+    free(per_thread_concurrency);
+    free(thread_quota_);
+    free(base_stats_);
+    free(base_replies_);
+    free(thread_busy_);
     free(items_);
+    free(raw_templates_);
+    free(raw_template_len_);
     hashtable_teardown();
 }
 
 static connection_t *
 TryConnection(connection_t *c, const int ep, int *thread_concurrency) 
 {
-    if (connect(c->fd, (struct sockaddr *)&daddr_, sizeof(struct sockaddr_in)) < 0) {
+    if (connect(c->fd, (struct sockaddr *)&servers_[c->server].addr, sizeof(struct sockaddr_in)) < 0) {
         if (errno == EINPROGRESS) {
             c->state = CONNECTION_AGAIN;
             *thread_concurrency = *thread_concurrency + 1;
@@ -246,8 +584,7 @@ TryConnection(connection_t *c, const int ep, int *thread_concurrency)
             *thread_concurrency = *thread_concurrency + 1;
         c->state = CONNECTION_ESTABLISEHD;
         clock_gettime(CLOCK_REALTIME, &c->ts);
-        num_connect_++;
-        num_requests++;
+        STAT_INC(stats_->num_connect);
 
         /*ev.events = EPOLLOUT;
         ev.data.fd = c->fd;
@@ -260,32 +597,430 @@ TryConnection(connection_t *c, const int ep, int *thread_concurrency)
     return c;
 }
 
+static uint64_t
+ElapsedNs(const struct timespec *from)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) * 1000000000LU + now.tv_nsec - from->tv_nsec;
+}
+
+/* Appends "ip:port[,ip:port...]" to the target list */
+static int
+AddServers(char *list)
+{
+    char *tok, *saveptr, *colon;
+    server_t *sv;
+
+    for (tok = strtok_r(list, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        if (num_servers_ == MAX_SERVERS) {
+            log_error("too many servers, max %d\n", MAX_SERVERS);
+            return -1;
+        }
+
+        colon = strchr(tok, ':');
+        if (!colon) {
+            log_error("invalid server %s (ip:port)\n", tok);
+            return -1;
+        }
+        *colon = '\0';
+
+        sv = &servers_[num_servers_];
+        sv->addr.sin_family = AF_INET;
+        sv->addr.sin_port = htons(atoi(colon + 1));
+        if (inet_pton(AF_INET, tok, &sv->addr.sin_addr) != 1) {
+            log_error("invalid server address %s\n", tok);
+            return -1;
+        }
+        num_servers_++;
+    }
+
+    return 0;
+}
+
+/* One ip:port per line, '#' starts a comment */
+static int
+LoadServerFile(const char *path)
+{
+    FILE *f;
+    char line[256];
+    char *p;
+
+    f = fopen(path, "r");
+    if (!f) {
+        log_error("fopen() error, %s, %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if ((p = strchr(line, '#')))
+            *p = '\0';
+        p = line + strspn(line, " \t");
+        p[strcspn(p, " \t\r\n")] = '\0';
+        if (*p == '\0')
+            continue;
+        if (AddServers(p) < 0) {
+            fclose(f);
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/* Jump consistent hash (Lamping, Veach) of the item's hash value, adding
+ * a server moves only 1/n of the keys */
+static uint16_t
+ItemServer(const kv_hashtable_item_t *it)
+{
+    uint64_t key = it->hv;
+    int64_t b = -1, j = 0;
+
+    while (j < num_servers_) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+    }
+
+    return b;
+}
+
+/* Index of the next key to request. During a -K warm-up it walks the
+ * thread's slice of the items, every key once, then draws by popularity.
+ * With several servers a key is skipped if its server's stash is full. */
+static uint32_t
+DrawIndex(void)
+{
+    if (touch_next_ < touch_end_) {
+        if (++touch_next_ == touch_end_)
+            __atomic_add_fetch(&num_touched_, 1, __ATOMIC_RELEASE);
+        return touch_next_ - 1;
+    }
+
+    return rng_zipf(1.0, num_items_) - 1;
+}
+
+/* Draws items by the global popularity and hands out the first one
+ * that maps to server. Draws for other servers are stashed for their
+ * connections, so each server sees the popularity of its own keys. */
+static kv_hashtable_item_t *
+NextItem(const uint16_t server)
+{
+    kv_hashtable_item_t *it;
+    shard_stash_t *st;
+    uint16_t s;
+
+    if (num_servers_ == 1)
+        return local_items_[DrawIndex()];
+
+    st = &stash_[server];
+    if (st->count > 0) {
+        it = st->items[st->head];
+        st->head = (st->head + 1) & (SHARD_STASH_SIZE - 1);
+        st->count--;
+        return it;
+    }
+
+    for (;;) {
+        it = local_items_[DrawIndex()];
+        s = ItemServer(it);
+        if (s == server)
+            return it;
+
+        st = &stash_[s];
+        if (st->count < SHARD_STASH_SIZE) {
+            st->items[(st->head + st->count) & (SHARD_STASH_SIZE - 1)] = it;
+            st->count++;
+        }
+    }
+}
+
+/* "get/set/delete" in percent, e.g. 95/4/1 */
+static int
+ParseMix(const char *s)
+{
+    unsigned int get, set, del;
+    char end;
+
+    if (sscanf(s, "%u/%u/%u%c", &get, &set, &del, &end) != 3 || get + set + del != 100)
+        return -1;
+
+    op_mix_[GET] = get;
+    op_mix_[SET] = set;
+    op_mix_[DELETE] = del;
+    write_mix_ = get < 100;
+
+    return 0;
+}
+
+/* Request type of the next request, drawn by the -m mix */
+static uint8_t
+NextOp(void)
+{
+    uint32_t r;
+
+    if (!write_mix_)
+        return GET;
+
+    r = rng_int32() % 100;
+    if (r < op_mix_[SET])
+        return SET;
+    if (r < op_mix_[SET] + op_mix_[DELETE])
+        return DELETE;
+    return GET;
+}
+
+/* Bytes of one request on the wire, for a multi-get the bytes one of
+ * its keys adds */
+static uint32_t
+FrameLen(const uint8_t op, const kv_hashtable_item_t *it)
+{
+    uint32_t len = sizeof(req_hdr) + item_keyLen(it);
+
+    if (op == SET)
+        len += sizeof(set_hdr) + item_valueLen(it);
+    else if (op == MGET)
+        len = 1 + item_keyLen(it);
+    return len;
+}
+
+/* True if the ring takes another frame of any type */
+static bool
+RingHasRoom(const connection_t *c)
+{
+    return c->ring_count + mget_fanout_ <= ring_slots_;
+}
+
+/* Takes a free connection from the pool of the next server in turn, so
+ * the servers get an equal share of the thread's connections */
+static connection_t *
+AllocateConnection(connection_pool_t **cp)
+{
+    static __thread uint16_t next_server = 0;
+    connection_t *c;
+    uint16_t i, s;
+
+    for (i = 0; i < num_servers_; i++) {
+        s = next_server;
+        next_server = (next_server + 1) % num_servers_;
+        if (cp[s]->num_free_elements == 0)
+            continue;
+
+        c = connection_allocate(cp[s]);
+        if (c)
+            c->server = s;
+        return c;
+    }
+
+    return NULL;
+}
+
+static int
+ThreadConcurrencyLimit(void)
+{
+    if (rebalance_)
+        return __atomic_load_n(local_quota_, __ATOMIC_RELAXED);
+    return __atomic_load_n(&concurrency_limit_, __ATOMIC_RELAXED) / num_threads_;
+}
+
+/* True while the calling thread holds more connections than its share of
+ * the limit or its quota, its persistent connections then close as they
+ * drain */
+static bool
+OverConcurrencyLimit(void)
+{
+    return *local_concurrency_ > ThreadConcurrencyLimit();
+}
+
+/* Called after every wait of the event loop with the time it blocked.
+ * Once per interval a thread compares its busy share with the mean of all
+ * threads. A thread busier than the mean by the margin, e.g. one slowed
+ * by interrupts, hands 1/16 of its quota to the spare pool and its extra
+ * connections drain. A thread at or below the mean takes spare slots and
+ * opens connections for them. */
+static void
+Rebalance(const uint16_t thread_number, const uint64_t idle_ns)
+{
+    static __thread uint64_t start = 0, idle = 0;
+    const uint64_t now = latency_now_ns();
+    uint32_t busy, mean = 0, quota, step, spare, take;
+    int i;
+
+    idle += idle_ns;
+    if (start == 0)
+        start = now;
+    if (now - start < REBALANCE_INTERVAL_NS)
+        return;
+
+    busy = idle >= now - start ? 0 : 1000 - idle * 1000 / (now - start);
+    __atomic_store_n(&thread_busy_[thread_number], busy, __ATOMIC_RELAXED);
+    start = now;
+    idle = 0;
+
+    for (i = 0; i < num_threads_; i++)
+        mean += __atomic_load_n(&thread_busy_[i], __ATOMIC_RELAXED);
+    mean /= num_threads_;
+
+    quota = *local_quota_;
+    step = quota / 16 > 0 ? quota / 16 : 1;
+
+    if (busy > mean + REBALANCE_MARGIN && quota > step) {
+        __atomic_store_n(local_quota_, quota - step, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&spare_slots_, step, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&num_handoffs_, step, __ATOMIC_RELAXED);
+    } else if (busy <= mean) {
+        spare = __atomic_load_n(&spare_slots_, __ATOMIC_ACQUIRE);
+        do {
+            take = spare < step ? spare : step;
+            if (take == 0)
+                return;
+        } while (!__atomic_compare_exchange_n(&spare_slots_, &spare, spare - take, true,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+        __atomic_store_n(local_quota_, quota + take, __ATOMIC_RELAXED);
+    }
+}
+
+/* Whether the thread may open another connection now. While it ramps
+ * up, -r spaces the openings 1/rate apart. */
+static bool
+RampAllows(void)
+{
+    uint64_t now;
+
+    if (ramp_done_ || ramp_rate_ == 0)
+        return true;
+
+    now = latency_now_ns();
+    if (ramp_next_ns_ == 0)
+        ramp_next_ns_ = now;
+    if (now < ramp_next_ns_)
+        return false;
+
+    ramp_next_ns_ += 1000000000LU / ramp_rate_;
+    ramp_opened_++;
+    return true;
+}
+
+/* ms the event loop may block before the next opening is due, -1 once
+ * the ramp is over */
+static int
+RampTimeout(void)
+{
+    uint64_t now;
+
+    if (ramp_done_ || ramp_rate_ == 0)
+        return -1;
+
+    now = latency_now_ns();
+    return ramp_next_ns_ > now ? (ramp_next_ns_ - now) / 1000000 + 1 : 0;
+}
+
+static void
+MarkRamped(void)
+{
+    ramp_done_ = true;
+    __atomic_add_fetch(&num_ramped_, 1, __ATOMIC_RELEASE);
+}
+
+/* The ramp is over once the thread has opened its share, short
+ * connections may have closed again by then */
+static void
+RampCheck(const int *thread_concurrency)
+{
+    if (ramp_done_)
+        return;
+
+    if (*thread_concurrency >= ThreadConcurrencyLimit() ||
+            (ramp_rate_ > 0 && ramp_opened_ >= (uint32_t)ThreadConcurrencyLimit()))
+        MarkRamped();
+}
+
+static void
+RecordLatency(const uint64_t ns)
+{
+    if (hist_)
+        STAT_INC(hist_->count[latency_bucket(ns)]);
+}
+
+/* Connection setup lasts from socket() until the first request leaves,
+ * with TCP Fast Open that is when it rides on the SYN */
+static void
+AccountSetup(connection_t *c)
+{
+    if (c->setup_done)
+        return;
+
+    STAT_ADD(stats_->total_setup_ns, ElapsedNs(&c->open_ts));
+    STAT_INC(stats_->num_setup);
+    c->setup_done = true;
+}
+
+/* Socket options shared by the epoll and io_uring backends */
+static int
+SetupSocket(const int fd)
+{
+    int one = 1;
+
+    /* connect() returns at once and the first write goes out with the SYN
+     * when the server's cookie is cached */
+    if (fast_open_ &&
+            setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) < 0) {
+        log_error("setsockopt(TCP_FASTOPEN_CONNECT) fail, %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (saddr_.sin_addr.s_addr != INADDR_ANY) {
+        /* leave the port choice to connect(), which picks it by the full
+         * 4-tuple instead of reserving one port per bind() */
+        if (setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one)) < 0 ||
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
+            log_error("setsockopt() fail, %s\n", strerror(errno));
+            return -1;
+        }
+        if (bind(fd, (struct sockaddr *)&saddr_, sizeof(struct sockaddr_in)) < 0) {
+            log_error("bind() fail, %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static connection_t *
-CreateConnection(connection_pool_t *cp, int *thread_concurrency, int ep) 
+CreateConnection(connection_pool_t **cp, int *thread_concurrency, int ep) 
 {
     connection_t *c;
     struct epoll_event ev;
     int flags;
 
-    c = connection_allocate(cp);
+    c = AllocateConnection(cp);
     if (!c) {
         return NULL;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &c->open_ts);
+
     c->fd = socket(AF_INET, SOCK_STREAM, 0);
     if (c->fd < 0) {
         log_error("socket() faIl, %s\n", strerror(errno));
         goto fail;
     }
 
+    if (SetupSocket(c->fd) < 0)
+        goto fail;
+
     flags = fcntl(c->fd, F_GETFL, 0);
     if (fcntl(c->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
         log_error("fcntl() fail, %s\n", strerror(errno));
         goto fail;
     }
 
+    /* the only registration the socket ever gets, edge-triggered so that
+     * state changes need no epoll_ctl() */
     ev.data.ptr = c;
-    ev.events = EPOLLOUT;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
     if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
         log_error("epoll_ctl() fail, %s\n", strerror(errno));
         goto fail;
@@ -294,277 +1029,2135 @@ CreateConnection(connection_pool_t *cp, int *thread_concurrency, int ep)
     if(!TryConnection(c, ep, thread_concurrency))
         goto fail;
 
+    if (io_backend_ == IO_BACKEND_CORO) {
+        CO_INIT(&c->co);
+        return ConnectionTask(c, 0, ep, cp, thread_concurrency) == CO_DONE ? NULL : c;
+    }
+
+    if (c->state == CONNECTION_ESTABLISEHD &&
+            SendRandomGetRequest(c, ep, cp, thread_concurrency) < 0) {
+        CloseConnection(c, cp, thread_concurrency);
+        return NULL;
+    }
+
     return c;
 
 fail :
     close(c->fd);
-    connection_deallocate(cp, c);
+    connection_deallocate(cp[c->server], c);
     return NULL;
 }
 
 static void
-CloseConnection(connection_t *c, connection_pool_t *cp, int *thread_concurrency)
+CloseConnection(connection_t *c, connection_pool_t **cp, int *thread_concurrency)
 {
     *thread_concurrency = *thread_concurrency - 1;
     close(c->fd);
-    connection_deallocate(cp, c);
-    num_close_++;
+    connection_deallocate(cp[c->server], c);
+    STAT_INC(stats_->num_close);
 //    log_trace("close fd:%d, c:%p, st:%d\n", c->fd, c, c->state);
 }
 
+/* Fills the free slots of the in-flight ring with random requests of the
+ * -m mix, GETs go out as multi-gets with -g. The new requests are left
+ * unsent. Returns the number of keys added. */
+static uint16_t
+FillRequestRing(connection_t *c)
+{
+    uint64_t now = 0;
+    uint16_t idx, i, nkeys, num_new = 0;
+    uint8_t op;
+
+    /* connections above a lowered limit drain and close */
+    if (persistent_connection_ && OverConcurrencyLimit())
+        return 0;
+
+    if (RingHasRoom(c))
+        now = latency_now_ns();
+
+    while (RingHasRoom(c)) {
+        op = NextOp();
+        nkeys = 1;
+        if (op == GET && mget_fanout_ > 1) {
+            op = MGET;
+            nkeys = mget_fanout_;
+        }
+        /* one slot per key, only the first one starts the frame */
+        for (i = 0; i < nkeys; i++) {
+            idx = (c->ring_head + c->ring_count) & CONNECTION_RING_MASK;
+            c->ring[idx] = NextItem(c->server);
+            c->ring_op[idx] = op;
+            c->ring_frame[idx] = i == 0 ? nkeys : 0;
+            c->ring_ts[idx] = now;
+            c->ring_count++;
+            c->ring_unsent++;
+            num_new++;
+        }
+        STAT_INC(stats_->op[op].num_requests);
+    }
+
+    STAT_ADD(stats_->num_requests, num_new);
+    STAT_ADD(stats_->server[c->server].num_requests, num_new);
+
+    return num_new;
+}
+
+/* Fills the free slots of the in-flight ring with random requests and
+ * writes every unsent frame with a single writev(). A partial write leaves the
+ * remainder in the ring (ring_unsent, txoff) to be flushed on the next
+ * EPOLLOUT. */
 static int
-SendRandomGetRequest(connection_t *c, const int ep, connection_pool_t *cp, int *thread_concurrency)
+SendRandomGetRequest(connection_t *c, const int ep, connection_pool_t **cp, int *thread_concurrency)
 {
     int ret;
-    uint32_t prio;
-    req_hdr hdr;
-    struct iovec vec[2];
-    struct epoll_event ev;
-    if (c->state != CONNECTION_ESTABLISEHD)
+    uint16_t i, j, n, nvec, idx;
+    uint32_t sent;
+    req_hdr hdr[CONNECTION_MAX_PIPELINE_DEPTH];
+    set_hdr shdr[CONNECTION_MAX_PIPELINE_DEPTH];
+    uint8_t klen[CONNECTION_MAX_PIPELINE_DEPTH];
+    struct iovec vec[CONNECTION_MAX_PIPELINE_DEPTH * 4];
+    uint16_t frame_end[CONNECTION_MAX_PIPELINE_DEPTH];   /* last iovec of each frame */
+    uint16_t frame_keys[CONNECTION_MAX_PIPELINE_DEPTH];
+    kv_hashtable_item_t *it;
+
+    if (c->state != CONNECTION_ESTABLISEHD && c->state != CONNECTION_WAIT_FOR_REPLY &&
+            c->state != CONNECTION_RCV_REPLY_AGAIN)
         return -1;
 
 //    c->it = hashtable_start_to_access_random_item();
 
-    prio = rng_zipf(1.0, num_items_) - 1;
-    c->it = items_[prio];
-    hdr.reqtype = GET;
-    hdr.keyLen = item_keyLen(c->it);
+    FillRequestRing(c);
+
+    if (c->ring_unsent == 0) {
+        /* ring is full, wait for replies */
+        return 0;
+    }
+
+    n = 0;
+    nvec = 0;
+    for (i = c->ring_count - c->ring_unsent; i < c->ring_count; i += frame_keys[n++]) {
+        idx = (c->ring_head + i) & CONNECTION_RING_MASK;
+        it = c->ring[idx];
+        frame_keys[n] = c->ring_frame[idx];
+        hdr[n].reqtype = c->ring_op[idx];
+
+        vec[nvec].iov_base = &hdr[n];
+        vec[nvec++].iov_len = sizeof(req_hdr);
+        if (c->ring_op[idx] == MGET) {
+            hdr[n].keyLen = frame_keys[n];
+            for (j = i; j < i + frame_keys[n]; j++) {
+                it = c->ring[(c->ring_head + j) & CONNECTION_RING_MASK];
+                klen[j] = item_keyLen(it);
+                vec[nvec].iov_base = &klen[j];
+                vec[nvec++].iov_len = 1;
+                vec[nvec].iov_base = item_key(it);
+                vec[nvec++].iov_len = item_keyLen(it);
+            }
+            frame_end[n] = nvec - 1;
+            continue;
+        }
+
+        hdr[n].keyLen = item_keyLen(it);
+        vec[nvec].iov_base = item_key(it);
+        vec[nvec++].iov_len = item_keyLen(it);
+        if (c->ring_op[idx] == SET) {
+            shdr[n].valLen = item_valueLen(it);
+            vec[nvec].iov_base = &shdr[n];
+            vec[nvec++].iov_len = sizeof(set_hdr);
+            vec[nvec].iov_base = item_value(it);
+            vec[nvec++].iov_len = item_valueLen(it);
+        }
+        frame_end[n] = nvec - 1;
+    }
+
+    /* skip what an earlier partial write already sent, txoff keeps
+     * counting the whole first frame across several partial writes */
+    for (i = 0, sent = c->txoff; sent > 0; i++) {
+        size_t skip = sent < vec[i].iov_len ? sent : vec[i].iov_len;
+        vec[i].iov_base = (uint8_t *)vec[i].iov_base + skip;
+        vec[i].iov_len -= skip;
+        sent -= skip;
+    }
 
-    vec[0].iov_base = &hdr;
-    vec[0].iov_len = sizeof(req_hdr);
-    vec[1].iov_base = item_key(c->it);
-    vec[1].iov_len = item_keyLen(c->it);
+    c->it = c->ring[c->ring_head];
 
-    ret = writev(c->fd, vec, 2);
+    ret = writev(c->fd, vec, nvec);
     if (ret < 0)  {
+        /* EINPROGRESS, a fast open without a cookie sent a plain SYN */
+        if (errno == EAGAIN || errno == EINPROGRESS)
+            return 0;
         log_error("error\n");
         return -1;
     }
 
     clock_gettime(CLOCK_REALTIME, &c->ts);
+    AccountSetup(c);
 
-    total_tx_bytes += ret;
-    c->state = CONNECTION_WAIT_FOR_REPLY;
-    ev.events = EPOLLIN;
-    ev.data.ptr = c;
+    STAT_ADD(stats_->tx_bytes, ret);
+    STAT_INC(stats_->num_writev);
 
-    if (epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
-        log_error("epoll_ctl() fail, %s\n", strerror(errno));
-        CloseConnection(c, cp, thread_concurrency);
+    /* account for written bytes, frame by frame */
+    for (i = 0, n = 0; i < nvec && ret > 0; i++) {
+        if ((size_t)ret < vec[i].iov_len) {
+            c->txoff += ret;
+            break;
+        }
+        ret -= vec[i].iov_len;
+        c->txoff += vec[i].iov_len;
+        if (i == frame_end[n]) {
+            c->ring_unsent -= frame_keys[n];
+            c->txoff = 0;
+            n++;
+        }
     }
 
+    c->state = CONNECTION_WAIT_FOR_REPLY;
+
     return 0;
 }
 
+/* Reads and parses what the socket holds. Returns the number of
+ * completed replies, or -1 once the connection is unusable. */
 static int
-ReceiveReply(connection_t *c, const int ep, connection_pool_t *cp, int *thread_concurrency)
+ReadReplies(connection_t *c)
 {
-    int len;
-    struct timespec ts_now;
-
-    if (c->state != CONNECTION_WAIT_FOR_REPLY && c->state != CONNECTION_RCV_REPLY_AGAIN) {
-        return -1;
-    }
-
-    while((len = read(c->fd, c->buf + c->buflen, CONNECTION_BUFSIZE - c->buflen)) > 0)
-    {
-        total_rx_bytes += len;
-        c->buflen += len;
-    }
+    int len, ret;
+    int completed = 0;
+
+    /* A short read means the socket is drained, and once every sent request
+     * is answered no more data is due. Either way EPOLLET reports the next
+     * arrival, so there is no read() just to see EAGAIN. */
+    do {
+        len = read(c->fd, rx_buf_, CONNECTION_BUFSIZE);
+        if (len <= 0)
+            break;
 
-    clock_gettime(CLOCK_REALTIME, &ts_now);
+        STAT_ADD(stats_->rx_bytes, len);
+        STAT_ADD(stats_->server[c->server].rx_bytes, len);
+        ret = ParseReplies(c, rx_buf_, len);
+        if (ret < 0)
+            return -1;
+        completed += ret;
+    } while (len == CONNECTION_BUFSIZE && c->ring_count > c->ring_unsent);
 
  //   log_trace("fd:%d rcvdLen:%d len:%d,%d,st:%d, c:%p\n", 
   //          c->fd, c->buflen, len, errno, c->state, c);
 
-    if (len == 0) {
-        CloseConnection(c, cp, thread_concurrency);
-        return 0;
-    } else {
-        if (errno == EAGAIN) {
-            if (c->buflen == (sizeof(rep_hdr) + item_valueLen(c->it))) {
-
-   //             log_trace("rcvdLen:%d\n", c->buflen);
-                CheckReply(c, c->buf, c->buflen);
-
-                if (persistent_connection_) {
-
-                    struct epoll_event ev;
-                    ev.events = EPOLLOUT;
-                    ev.data.ptr = c;
-                    
-                    if (epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
-                        log_error("epoll_ctl() fail, %s\n", strerror(errno));
-                        CloseConnection(c, cp ,thread_concurrency);
-                        return 0;
-                    }
+    if (len == 0 || (len < 0 && errno != EAGAIN))
+        return -1;
 
-                    c->state = CONNECTION_ESTABLISEHD;
-                    c->buflen = 0;
+    return completed;
+}
 
-                } else {
-                    CloseConnection(c, cp ,thread_concurrency);
-                }
-                return 0;
+static int
+ReceiveReply(connection_t *c, const int ep, connection_pool_t **cp, int *thread_concurrency)
+{
+    int completed;
+
+    if (c->state != CONNECTION_ESTABLISEHD && c->state != CONNECTION_WAIT_FOR_REPLY &&
+            c->state != CONNECTION_RCV_REPLY_AGAIN) {
+        return -1;
+    }
+
+    completed = ReadReplies(c);
+    if (completed < 0) {
+        CloseConnection(c, cp, thread_concurrency);
+        return -1;
+    }
+
+    if (c->ring_count > 0) {
+        c->state = c->rep_hdrlen > 0 ? CONNECTION_RCV_REPLY_AGAIN :
+                                       CONNECTION_WAIT_FOR_REPLY;
+        if (completed == 0)
+            return -2;
+    }
+
+    if (!persistent_connection_) {
+        if (c->ring_count == 0) {
+            STAT_ADD(stats_->total_short_conn_ns, ElapsedNs(&c->open_ts));
+            STAT_INC(stats_->num_short_conn);
+            CloseConnection(c, cp, thread_concurrency);
+        }
+        return 0;
+    }
+
+    if (c->ring_count == 0) {
+        if (OverConcurrencyLimit()) {
+            CloseConnection(c, cp, thread_concurrency);
+            return 0;
+        }
+        c->state = CONNECTION_ESTABLISEHD;
+    }
+
+    /* refill the freed ring slots right away, the socket is writable */
+    if (SendRandomGetRequest(c, ep, cp, thread_concurrency) < 0) {
+        CloseConnection(c, cp ,thread_concurrency);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* One event of a connection in progress. Returns 1 once it is
+ * connected, 0 while connect() is pending, -1 if it failed. The socket
+ * turns writable when connect() completes. */
+static int
+ConnectStep(connection_t *c, const uint32_t events, const int ep, int *thread_concurrency)
+{
+    if (events & (EPOLLERR | EPOLLHUP) || !TryConnection(c, ep, thread_concurrency))
+        return -1;
+
+    return c->state != CONNECTION_AGAIN;
+}
+
+/* One event of a connection awaiting replies. The rest of a partial
+ * write goes out on EPOLLOUT. Returns the number of completed replies,
+ * or -1 once the connection is unusable. */
+static int
+ReplyStep(connection_t *c, const uint32_t events, const int ep,
+        connection_pool_t **cp, int *thread_concurrency)
+{
+    if (events & (EPOLLERR | EPOLLHUP))
+        return -1;
+    if (events & EPOLLOUT && c->ring_unsent > 0 &&
+            SendRandomGetRequest(c, ep, cp, thread_concurrency) < 0)
+        return -1;
+
+    return events & EPOLLIN ? ReadReplies(c) : 0;
+}
+
+/* The whole life of a connection on the coro backend, written as one
+ * sequential flow. It is resumed with the epoll events of its socket,
+ * the first call comes right after connect() was issued. Returns
+ * CO_DONE once the connection is closed. */
+static int
+ConnectionTask(connection_t *c, const uint32_t events, const int ep,
+        connection_pool_t **cp, int *thread_concurrency)
+{
+    int ret;
+
+    CO_BEGIN(&c->co);
+
+    if (c->state == CONNECTION_AGAIN) {
+        CO_AWAIT(&c->co, (ret = ConnectStep(c, events, ep, thread_concurrency)) != 0);
+        if (ret < 0)
+            goto close;
+    }
+
+    for (;;) {
+        /* fill the ring and send */
+        if (SendRandomGetRequest(c, ep, cp, thread_concurrency) < 0)
+            goto close;
+
+        CO_AWAIT(&c->co, (ret = ReplyStep(c, events, ep, cp, thread_concurrency)) != 0);
+        if (ret < 0)
+            goto close;
+
+        /* replies are verified as they are parsed, the freed slots are
+         * refilled on the next round */
+        if (c->ring_count > 0)
+            continue;
+        if (!persistent_connection_) {
+            STAT_ADD(stats_->total_short_conn_ns, ElapsedNs(&c->open_ts));
+            STAT_INC(stats_->num_short_conn);
+            goto close;
+        }
+        if (OverConcurrencyLimit())
+            goto close;
+    }
+
+close :
+    CloseConnection(c, cp, thread_concurrency);
+    CO_END(&c->co);
+}
+
+/* Consumes a chunk of the reply stream. Replies may span several chunks
+ * and a chunk may hold several replies, each one is matched against the
+ * oldest request in the ring. Returns the number of completed replies. */
+static int
+ParseReplies(connection_t *c, uint8_t *buf, const ssize_t buf_size)
+{
+    static __thread uint32_t num_replies = 0;
+    rep_hdr *hdr;
+    kv_hashtable_item_t *it;
+    ssize_t off = 0, len;
+    uint64_t now = 0, ns;
+    uint8_t op;
+    int completed = 0;
+
+    while (off < buf_size) {
+        if (c->ring_count == c->ring_unsent) {
+            log_trace("Unexpected reply, fd:%d\n", c->fd);
+            return -1;
+        }
+        it = c->ring[c->ring_head];
+        op = c->ring_op[c->ring_head];
+
+        if (c->rep_hdrlen < sizeof(rep_hdr)) {
+            len = sizeof(rep_hdr) - c->rep_hdrlen;
+            if (len > buf_size - off)
+                len = buf_size - off;
+            memcpy(c->rep_hdr + c->rep_hdrlen, buf + off, len);
+            c->rep_hdrlen += len;
+            off += len;
+            if (c->rep_hdrlen < sizeof(rep_hdr))
+                break;
+
+            hdr = (rep_hdr *)c->rep_hdr;
+            c->rep_valLen = hdr->valLen;
+            c->rep_off = 0;
+            c->rep_pad = hdr_pad_;
+
+            if (op != GET && op != MGET) {
+                /* nothing to verify, a value sent anyway is skipped */
+                c->rep_verify = false;
+            } else if (c->rep_valLen == 0 && op_mix_[DELETE] > 0) {
+                /* deleted and not set again yet */
+                STAT_INC(stats_->op[op].num_misses);
+                c->rep_verify = false;
+            } else if (c->rep_valLen != item_valueLen(it)) {
+                log_trace("Value size error, (%u, %u)\n", c->rep_valLen, item_valueLen(it));
+                STAT_INC(stats_->num_verify_fail);
+                c->rep_verify = false;
             } else {
-                /*
-                if (ts_now.tv_sec - c->ts.tv_sec > 30) {
+                c->rep_verify = (++num_replies % verify_sample_rate_ == 0);
+            }
+
+            if (c->rep_verify && verify_mode_ == VERIFY_DIGEST) {
+                if (!c->hstate && !(c->hstate = XXH3_createState())) {
+                    log_error("XXH3_createState() fail\n");
+                    return -1;
+                }
+                XXH3_64bits_reset(c->hstate);
+            }
+        }
+
+        if (c->rep_pad > 0) {
+            len = c->rep_pad < buf_size - off ? c->rep_pad : buf_size - off;
+            c->rep_pad -= len;
+            off += len;
+            if (c->rep_pad > 0)
+                break;
+        }
+
+        len = c->rep_valLen - c->rep_off;
+        if (len > buf_size - off)
+            len = buf_size - off;
+
+        if (len > 0) {
+            if (c->rep_verify) {
+                if (verify_mode_ == VERIFY_DIGEST) {
+                    XXH3_64bits_update(c->hstate, buf + off, len);
+                } else if (!CheckReply(it, c->rep_off, buf + off, len)) {
+                    STAT_INC(stats_->num_verify_fail);
+                    c->rep_verify = false;
+                }
+            }
+            c->rep_off += len;
+            off += len;
+        }
+
+        if (c->rep_off == c->rep_valLen) {
+            if (c->rep_verify && verify_mode_ == VERIFY_DIGEST &&
+                    !CheckReplyDigest(c, it))
+                STAT_INC(stats_->num_verify_fail);
+
+            if (now == 0)
+                now = latency_now_ns();
+            ns = now - c->ring_ts[c->ring_head];
+            STAT_INC(stats_->server[c->server].num_replies);
+            STAT_ADD(stats_->server[c->server].total_latency_ns, ns);
+            STAT_INC(stats_->op[op].num_keys);
+            /* a frame is answered with the reply to its last key, the -X
+             * histogram counts frames too */
+            if (c->ring_count == 1 ||
+                    c->ring_frame[(c->ring_head + 1) & CONNECTION_RING_MASK] != 0) {
+                STAT_INC(stats_->op[op].num_replies);
+                STAT_ADD(stats_->op[op].total_latency_ns, ns);
+                STAT_INC(stats_->op[op].hist.count[latency_bucket(ns)]);
+                RecordLatency(ns);
+            }
+
+            c->ring[c->ring_head] = NULL;
+            c->ring_head = (c->ring_head + 1) & CONNECTION_RING_MASK;
+            c->ring_count--;
+            c->rep_hdrlen = 0;
+            c->rep_off = 0;
+            c->it = c->ring_count > 0 ? c->ring[c->ring_head] : NULL;
+            completed++;
+        }
+    }
+
+    return completed;
+}
+
+/* Verifies buf against bytes [off, off + buf_size) of the item's value */
+static bool
+CheckReply(kv_hashtable_item_t *it, const uint32_t off, uint8_t *buf, const ssize_t buf_size)
+{
+    int ret;
+
+    if (off + buf_size > item_valueLen(it))
+        return false;
+
+    if (!it->value_stored) {
+        if (dataset_synth_cmp(buf, it->hv, synth_seed_, item_valueLen(it), off, buf_size) != 0) {
+            log_trace("Received reply error, off:%u, len:%ld\n", off, buf_size);
+            return false;
+        }
+        return true;
+    }
+
+    if ((ret = memcmp(buf, (uint8_t *)item_value(it) + off, buf_size)) != 0) {
+        log_trace("Received reply error, ret:%d, off:%u, len:%ld\n", ret, off, buf_size);
+        return false;
+    }
+
+    return true;
+}
+
+/* Compares the digest accumulated over the whole reply value */
+static bool
+CheckReplyDigest(connection_t *c, kv_hashtable_item_t *it)
+{
+    uint64_t digest = XXH3_64bits_digest(c->hstate);
+
+    if (digest != item_digest(it)) {
+        log_trace("Received reply digest error, (%016lx, %016lx)\n", digest, item_digest(it));
+        return false;
+    }
+
+    return true;
+}
+
+static void
+SetCoreAffinity(const int thread_no) 
+{
+#ifdef _GNU_SOURCE
+    cpu_set_t cpuset;
+    pthread_t tid = pthread_self();
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(thread_cpu_[thread_no], &cpuset);
+
+    if (pthread_setaffinity_np(tid, sizeof(cpu_set_t), &cpuset) < 0) {
+        log_error("pthread_setaffinity_np() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+#else
+    (void)thread_no;
+#endif
+}
+
+#ifdef _USE_NUMA
+/* Copies every item with its key and value into one block on node, so
+ * that threads there draw, send and verify from local memory */
+static void
+ReplicateItems(const int node)
+{
+    kv_hashtable_item_t **table;
+    kv_hashtable_item_t *copies;
+    uint8_t *data;
+    size_t len;
+    uint32_t i;
+
+    len = (size_t)num_items_ * (sizeof(kv_hashtable_item_t *) + sizeof(kv_hashtable_item_t));
+    for (i = 0; i < num_items_; i++)
+        len += item_dataLen(items_[i]);
+
+    table = numa_alloc_onnode(len, node);
+    if (!table) {
+        log_error("numa_alloc_onnode() error, node %d\n", node);
+        exit(EXIT_FAILURE);
+    }
+
+    copies = (kv_hashtable_item_t *)(table + num_items_);
+    data = (uint8_t *)(copies + num_items_);
+
+    for (i = 0; i < num_items_; i++) {
+        copies[i] = *items_[i];
+        copies[i].data = data;
+        memcpy(data, items_[i]->data, item_dataLen(items_[i]));
+        data += item_dataLen(items_[i]);
+        table[i] = &copies[i];
+    }
+
+    node_items_[node] = table;
+    node_items_len_[node] = len;
+}
+#endif
+
+/* Maps threads to CPUs by placement_, replicates the items on every node
+ * that runs a thread and reports the layout */
+static void
+SetupPlacement(void)
+{
+    int cpus[TOPOLOGY_MAX_CPUS];
+    const topology_cpu_t *t;
+    int i, n;
+
+    n = topology_placement(placement_, cpus, TOPOLOGY_MAX_CPUS);
+    if (n <= 0)
+        exit(EXIT_FAILURE);
+
+    thread_cpu_ = malloc(sizeof(int) * num_threads_);
+    if (!thread_cpu_) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (n < num_threads_)
+        log_trace("%d threads on %d CPUs, some CPUs run several threads\n", num_threads_, n);
+
+#ifdef _USE_NUMA
+    if (numa_available() >= 0)
+        num_nodes_ = numa_max_node() + 1;
+#endif
+
+    node_items_ = calloc(num_nodes_, sizeof(kv_hashtable_item_t **));
+    node_items_len_ = calloc(num_nodes_, sizeof(size_t));
+    if (!node_items_ || !node_items_len_) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_threads_; i++) {
+        thread_cpu_[i] = cpus[i % n];
+        t = topology_cpu(thread_cpu_[i]);
+        log_trace("thread %d -> cpu %d (node %d, package %d, core %d, smt %d%s)\n",
+                i, t->cpu, t->node, t->package, t->core, t->smt_index,
+                t->nic_irq ? ", NIC irq" : "");
+#ifdef _USE_NUMA
+        if (num_nodes_ > 1 && t->node < num_nodes_ && !node_items_[t->node])
+            ReplicateItems(t->node);
+#endif
+    }
+
+    for (i = 0; i < num_nodes_; i++) {
+        if (node_items_[i])
+            log_trace("node %d: item replica %zu KB\n", i, node_items_len_[i] >> 10);
+    }
+#ifndef _USE_NUMA
+    log_trace("items are shared by all threads, build with USE_NUMA=1 for per node replicas\n");
+#endif
+}
+
+static void
+RunEpollLoop(const uint16_t thread_number, connection_pool_t **cp,
+        int *thread_concurrency, const int thread_max_concurrency)
+{
+    int i;
+    int ep;
+    int nevents;
+    uint64_t ts = 0;
+    /* level of readiness is kept by the kernel, a bounded batch per call
+     * is enough however many connections there are */
+    const int num_max_events = thread_max_concurrency < EPOLL_MAX_EVENTS ?
+                               thread_max_concurrency + 1 : EPOLL_MAX_EVENTS;
+    struct epoll_event *events;
+    connection_t *c;
+
+    events = malloc(sizeof(struct epoll_event) * num_max_events);
+    if (!events) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    ep = epoll_create1(0);
+    if (ep < 0) {
+        log_error("epoll_create() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    while (run_[thread_number]) 
+    {
+        while (*thread_concurrency < ThreadConcurrencyLimit() && RampAllows()) {
+            assert(*thread_concurrency >= 0);
+            CreateConnection(cp, thread_concurrency, ep);
+        }
+        RampCheck(thread_concurrency);
+        if (rebalance_)
+            ts = latency_now_ns();
+        nevents = epoll_wait(ep, events, num_max_events, RampTimeout());
+        if (nevents < 0) {
+            break;
+        }
+        if (rebalance_)
+            Rebalance(thread_number, latency_now_ns() - ts);
+
+        for (i = 0; i < nevents; i++) {
+            c = events[i].data.ptr;
+            if (io_backend_ == IO_BACKEND_CORO) {
+                ConnectionTask(c, events[i].events, ep, cp, thread_concurrency);
+                continue;
+            }
+            //log_trace("%u, %p\n", c->state, c);
+            if (events[i].events & EPOLLERR || events[i].events & EPOLLHUP) {
+             //   log_trace("error, fd: %d\n", c->fd);
+                CloseConnection(c, cp, thread_concurrency);
+            } else if (c->state == CONNECTION_AGAIN) {
+                if (!TryConnection(c, ep, thread_concurrency)) {
+                    CloseConnection(c, cp ,thread_concurrency);
+                } else if (c->state == CONNECTION_ESTABLISEHD &&
+                        SendRandomGetRequest(c, ep, cp, thread_concurrency) < 0) {
                     CloseConnection(c, cp, thread_concurrency);
                 }
-                else { */
-                     c->state = CONNECTION_RCV_REPLY_AGAIN;
-                //}
+            } else if (c->state == CONNECTION_ESTABLISEHD ||
+                            c->state == CONNECTION_WAIT_FOR_REPLY ||
+                            c->state == CONNECTION_RCV_REPLY_AGAIN) {
+                if (events[i].events & EPOLLIN) {
+                    ReceiveReply(c, ep, cp, thread_concurrency);
+                    if (c->state == CONNECTION_UNUSED)
+                        continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    if (SendRandomGetRequest(c, ep, cp, thread_concurrency) < 0) {
+                        CloseConnection(c, cp, thread_concurrency);
+                    }
+                }
+            } else {
+                CloseConnection(c, cp, thread_concurrency);
             }
-            return -2;
+        }
+    }
+
+    close(ep);
+    free(events);
+}
+
+#ifdef _USE_IO_URING
+#define URING_ENTRIES       4096
+#define URING_BUF_GROUP     0
+#define URING_BUF_COUNT     1024    /* must be a power of 2 */
+#define URING_BUF_SIZE      4096
+#define URING_OP_MASK       (0x7LU)
+
+/* operation kind is kept in the low bits of the user data, next to the
+ * connection pointer */
+enum uring_op {
+    URING_OP_CONNECT    =   1,
+    URING_OP_SEND       =   2,
+    URING_OP_RECV       =   3,
+};
+
+typedef struct uring_ctx_s {
+    struct io_uring ring;
+    struct io_uring_buf_ring *br;
+    uint8_t *bufs;
+    connection_pool_t **cp;        /* one pool per server */
+    int *thread_concurrency;
+    /* connections to refill once the current batch of completions is done */
+    connection_t **deferred;
+    int num_deferred;
+} uring_ctx_t;
+
+static struct io_uring_sqe *
+UringGetSqe(uring_ctx_t *u)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+
+    if (!sqe) {
+        /* submission queue is full, flush it and retry */
+        io_uring_submit(&u->ring);
+        sqe = io_uring_get_sqe(&u->ring);
+        if (!sqe) {
+            log_error("io_uring_get_sqe() fail\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return sqe;
+}
+
+static void
+UringPrep(connection_t *c, struct io_uring_sqe *sqe, const enum uring_op op)
+{
+    io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)c | op);
+    c->uring_ops++;
+}
+
+/* Serializes the unsent requests of the ring into c->buf, which is free
+ * as replies land in the provided buffers. Requests that do not fit stay
+ * unsent for the next round. */
+static void
+UringStageRequests(connection_t *c)
+{
+    kv_hashtable_item_t *it;
+    req_hdr *hdr;
+    set_hdr *shdr;
+    uint32_t len = 0, flen;
+    uint16_t idx, i, nkeys;
+    uint8_t *p;
+
+    if (!c->buf && !(c->buf = malloc(tx_buf_size_))) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    FillRequestRing(c);
+
+    while (c->ring_unsent > 0) {
+        idx = (c->ring_head + c->ring_count - c->ring_unsent) & CONNECTION_RING_MASK;
+        it = c->ring[idx];
+        nkeys = c->ring_frame[idx];
+
+        if (c->ring_op[idx] == MGET) {
+            flen = sizeof(req_hdr);
+            for (i = 0; i < nkeys; i++)
+                flen += FrameLen(MGET, c->ring[(idx + i) & CONNECTION_RING_MASK]);
+            if (len + flen > tx_buf_size_)
+                break;
+
+            hdr = (req_hdr *)(c->buf + len);
+            hdr->reqtype = MGET;
+            hdr->keyLen = nkeys;
+            p = (uint8_t *)(hdr + 1);
+            for (i = 0; i < nkeys; i++) {
+                it = c->ring[(idx + i) & CONNECTION_RING_MASK];
+                *p++ = item_keyLen(it);
+                memcpy(p, item_key(it), item_keyLen(it));
+                p += item_keyLen(it);
+            }
+            len += flen;
+            c->ring_unsent -= nkeys;
+            continue;
+        }
+
+        flen = FrameLen(c->ring_op[idx], it);
+        if (len + flen > tx_buf_size_)
+            break;
+
+        hdr = (req_hdr *)(c->buf + len);
+        hdr->reqtype = c->ring_op[idx];
+        hdr->keyLen = item_keyLen(it);
+        memcpy(c->buf + len + sizeof(req_hdr), item_key(it), item_keyLen(it));
+        if (c->ring_op[idx] == SET) {
+            shdr = (set_hdr *)(c->buf + len + sizeof(req_hdr) + item_keyLen(it));
+            shdr->valLen = item_valueLen(it);
+            memcpy(shdr + 1, item_value(it), item_valueLen(it));
+        }
+        len += flen;
+        c->ring_unsent--;
+    }
+
+    c->it = c->ring[c->ring_head];
+    c->txlen = len;
+    c->txoff = 0;
+}
+
+static void
+UringSend(uring_ctx_t *u, connection_t *c, const unsigned flags)
+{
+    struct io_uring_sqe *sqe;
+
+    if (c->txlen == 0)
+        UringStageRequests(c);
+    if (c->txlen == 0)
+        return;
+
+    sqe = UringGetSqe(u);
+    io_uring_prep_send(sqe, c->fd, c->buf + c->txoff, c->txlen - c->txoff, 0);
+    io_uring_sqe_set_flags(sqe, flags);
+    UringPrep(c, sqe, URING_OP_SEND);
+    c->tx_busy = true;
+}
+
+static void
+UringArmRecv(uring_ctx_t *u, connection_t *c)
+{
+    struct io_uring_sqe *sqe = UringGetSqe(u);
+
+    io_uring_prep_recv_multishot(sqe, c->fd, NULL, 0, 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+    sqe->buf_group = URING_BUF_GROUP;
+    UringPrep(c, sqe, URING_OP_RECV);
+}
+
+static void
+UringRecycleBuffer(uring_ctx_t *u, const struct io_uring_cqe *cqe)
+{
+    uint16_t bid;
+
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        return;
+
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    io_uring_buf_ring_add(u->br, u->bufs + (size_t)bid * URING_BUF_SIZE, URING_BUF_SIZE,
+            bid, io_uring_buf_ring_mask(URING_BUF_COUNT), 0);
+    io_uring_buf_ring_advance(u->br, 1);
+}
+
+/* A connection is only released once no request references it anymore,
+ * shutdown() makes the pending ones complete. */
+static void
+UringCloseConnection(uring_ctx_t *u, connection_t *c)
+{
+    if (c->uring_ops > 0) {
+        if (c->state != CONNECTION_CLOSING) {
+            c->state = CONNECTION_CLOSING;
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        return;
+    }
+
+    c->tx_busy = false;
+    c->txlen = 0;
+    CloseConnection(c, u->cp, u->thread_concurrency);
+}
+
+static connection_t *
+UringCreateConnection(uring_ctx_t *u)
+{
+    connection_t *c;
+    struct io_uring_sqe *sqe;
+
+    c = AllocateConnection(u->cp);
+    if (!c) {
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &c->open_ts);
+
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        log_error("socket() faIl, %s\n", strerror(errno));
+        connection_deallocate(u->cp[c->server], c);
+        return NULL;
+    }
+
+    if (SetupSocket(c->fd) < 0) {
+        close(c->fd);
+        connection_deallocate(u->cp[c->server], c);
+        return NULL;
+    }
+
+    c->state = CONNECTION_AGAIN;
+    *u->thread_concurrency = *u->thread_concurrency + 1;
+
+    sqe = UringGetSqe(u);
+    io_uring_prep_connect(sqe, c->fd, (struct sockaddr *)&servers_[c->server].addr, sizeof(struct sockaddr_in));
+    UringPrep(c, sqe, URING_OP_CONNECT);
+
+    if (!persistent_connection_) {
+        /* the request goes out as soon as the handshake completes */
+        io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        UringSend(u, c, 0);
+    }
+
+    return c;
+}
+
+static void
+UringHandleCompletion(uring_ctx_t *u, const struct io_uring_cqe *cqe)
+{
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    connection_t *c = (connection_t *)(uintptr_t)(data & ~URING_OP_MASK);
+    int ret;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        c->uring_ops--;
+
+    if (c->state == CONNECTION_CLOSING) {
+        UringRecycleBuffer(u, cqe);
+        UringCloseConnection(u, c);
+        return;
+    }
+
+    switch (data & URING_OP_MASK) {
+        case URING_OP_CONNECT :
+            if (cqe->res < 0) {
+                UringCloseConnection(u, c);
+                return;
+            }
+            c->state = CONNECTION_ESTABLISEHD;
+            clock_gettime(CLOCK_REALTIME, &c->ts);
+            STAT_INC(stats_->num_connect);
+            UringArmRecv(u, c);
+            if (persistent_connection_)
+                UringSend(u, c, 0);
+            break;
+
+        case URING_OP_SEND :
+            if (cqe->res < 0) {
+                UringCloseConnection(u, c);
+                return;
+            }
+            STAT_ADD(stats_->tx_bytes, cqe->res);
+            STAT_INC(stats_->num_writev);
+            AccountSetup(c);
+            c->txoff += cqe->res;
+            c->tx_busy = false;
+            c->state = CONNECTION_WAIT_FOR_REPLY;
+
+            if (c->txoff < c->txlen) {
+                /* short send, push the remainder */
+                UringSend(u, c, 0);
+            } else {
+                c->txlen = 0;
+                if (persistent_connection_ && RingHasRoom(c))
+                    UringSend(u, c, 0);
+            }
+            break;
+
+        case URING_OP_RECV :
+            if (cqe->res == -ENOBUFS) {
+                /* ran out of provided buffers, data waits in the socket */
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    UringArmRecv(u, c);
+                return;
+            }
+            if (cqe->res <= 0) {
+                UringRecycleBuffer(u, cqe);
+                UringCloseConnection(u, c);
+                return;
+            }
+
+            STAT_ADD(stats_->rx_bytes, cqe->res);
+            STAT_ADD(stats_->server[c->server].rx_bytes, cqe->res);
+            ret = ParseReplies(c, u->bufs + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUF_SIZE,
+                    cqe->res);
+            UringRecycleBuffer(u, cqe);
+
+            if (ret < 0) {
+                UringCloseConnection(u, c);
+                return;
+            }
+
+            if (!persistent_connection_ && c->ring_count == 0) {
+                STAT_ADD(stats_->total_short_conn_ns, ElapsedNs(&c->open_ts));
+                STAT_INC(stats_->num_short_conn);
+                UringCloseConnection(u, c);
+                return;
+            }
+
+            if (c->ring_count == 0 && OverConcurrencyLimit()) {
+                UringCloseConnection(u, c);
+                return;
+            }
+
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                UringArmRecv(u, c);
+
+            if (ret > 0 && !c->tx_busy && persistent_connection_) {
+                /* let the other replies of this batch free their slots too */
+                c->tx_busy = true;
+                u->deferred[u->num_deferred++] = c;
+            }
+            break;
+    }
+}
+
+static void
+RunUringLoop(const uint16_t thread_number, connection_pool_t **cp,
+        int *thread_concurrency, const int thread_max_concurrency)
+{
+    uring_ctx_t u;
+    struct io_uring_params params;
+    struct io_uring_cqe *cqe;
+    unsigned head, n;
+    int i, ret;
+    uint64_t ts = 0;
+    struct __kernel_timespec kts;
+
+    memset(&params, 0, sizeof(params));
+    if (uring_sqpoll_) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 2000;
+    }
+
+    ret = io_uring_queue_init_params(URING_ENTRIES, &u.ring, &params);
+    if (ret < 0) {
+        log_error("io_uring_queue_init_params() error, %s\n", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    u.br = io_uring_setup_buf_ring(&u.ring, URING_BUF_COUNT, URING_BUF_GROUP, 0, &ret);
+    if (!u.br) {
+        log_error("io_uring_setup_buf_ring() error, %s\n", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    u.bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!u.bufs) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < URING_BUF_COUNT; i++) {
+        io_uring_buf_ring_add(u.br, u.bufs + (size_t)i * URING_BUF_SIZE, URING_BUF_SIZE,
+                i, io_uring_buf_ring_mask(URING_BUF_COUNT), i);
+    }
+    io_uring_buf_ring_advance(u.br, URING_BUF_COUNT);
+
+    u.cp = cp;
+    u.thread_concurrency = thread_concurrency;
+    u.num_deferred = 0;
+    u.deferred = malloc(sizeof(connection_t *) * thread_max_concurrency);
+    if (!u.deferred) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    while (run_[thread_number])
+    {
+        while (*thread_concurrency < ThreadConcurrencyLimit() && RampAllows()) {
+            if (!UringCreateConnection(&u))
+                break;
+        }
+        RampCheck(thread_concurrency);
+
+        /* every SQE queued since the last round goes out in one call */
+        if (rebalance_)
+            ts = latency_now_ns();
+        if ((ret = RampTimeout()) >= 0) {
+            kts.tv_sec = ret / 1000;
+            kts.tv_nsec = (ret % 1000) * 1000000L;
+            ret = io_uring_submit_and_wait_timeout(&u.ring, &cqe, 1, &kts, NULL);
+            if (ret == -ETIME)
+                ret = 0;
         } else {
-            CloseConnection(c, cp, thread_concurrency);
-            return -1;
+            ret = io_uring_submit_and_wait(&u.ring, 1);
         }
+        if (ret < 0 && ret != -EINTR) {
+            log_error("io_uring_submit_and_wait() error, %s\n", strerror(-ret));
+            break;
+        }
+        if (rebalance_)
+            Rebalance(thread_number, latency_now_ns() - ts);
+
+        n = 0;
+        io_uring_for_each_cqe(&u.ring, head, cqe) {
+            UringHandleCompletion(&u, cqe);
+            n++;
+        }
+        io_uring_cq_advance(&u.ring, n);
+
+        for (i = 0; i < u.num_deferred; i++) {
+            u.deferred[i]->tx_busy = false;
+            if (u.deferred[i]->state == CONNECTION_ESTABLISEHD ||
+                    u.deferred[i]->state == CONNECTION_WAIT_FOR_REPLY)
+                UringSend(&u, u.deferred[i], 0);
+        }
+        u.num_deferred = 0;
     }
+
+    io_uring_free_buf_ring(&u.ring, u.br, URING_BUF_COUNT, URING_BUF_GROUP);
+    io_uring_queue_exit(&u.ring);
+    free(u.deferred);
+    free(u.bufs);
 }
+#endif /* _USE_IO_URING */
+
+/* One outstanding datagram request. A slot is reused with reqId advanced
+ * by the number of slots, so the slot of a reply is reqId & mask and a
+ * late reply to an expired request no longer matches. */
+typedef struct udp_request_s {
+    uint32_t reqId;
+    bool inflight;
+    udp_hdr uhdr;
+    req_hdr hdr;
+    kv_hashtable_item_t *it;
+    uint64_t ts;                /* latency_now_ns() at send */
+} udp_request_t;
 
-static bool
-CheckReply(connection_t *c, uint8_t *buf, const ssize_t buf_size)
+static int
+CreateUdpSocket(const int ep)
+{
+    struct epoll_event ev;
+    int fd, flags;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        log_error("socket() fail, %s\n", strerror(errno));
+        return -1;
+    }
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        log_error("fcntl() fail, %s\n", strerror(errno));
+        goto fail;
+    }
+
+    if (saddr_.sin_addr.s_addr != INADDR_ANY &&
+            bind(fd, (struct sockaddr *)&saddr_, sizeof(struct sockaddr_in)) < 0) {
+        log_error("bind() fail, %s\n", strerror(errno));
+        goto fail;
+    }
+
+    /* connected, so replies from anyone else are filtered by the kernel */
+    if (connect(fd, (struct sockaddr *)&daddr_, sizeof(struct sockaddr_in)) < 0) {
+        log_error("connect() fail, %s\n", strerror(errno));
+        goto fail;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_error("epoll_ctl() fail, %s\n", strerror(errno));
+        goto fail;
+    }
+
+    return fd;
+
+fail :
+    close(fd);
+    return -1;
+}
+
+static int
+SendUdpBatch(const int fd, struct mmsghdr *msgs, udp_request_t **batch, const int n)
+{
+    int i, ret;
+
+    ret = sendmmsg(fd, msgs, n, 0);
+    if (ret < 0)
+        ret = 0;
+
+    for (i = 0; i < ret; i++)
+        STAT_ADD(stats_->tx_bytes, msgs[i].msg_len);
+    STAT_ADD(stats_->num_requests, ret);
+    STAT_ADD(stats_->op[GET].num_requests, ret);
+    STAT_ADD(stats_->server[0].num_requests, ret);
+    STAT_INC(stats_->num_writev);
+
+    /* unsent ones are retried on the next round */
+    for (i = ret; i < n; i++)
+        batch[i]->inflight = false;
+
+    return ret;
+}
+
+/* Issues a new random GET from every idle slot among the first
+ * num_active that belongs to socket sock_idx, UDP_BATCH datagrams per
+ * sendmmsg() */
+static void
+SendUdpRequests(udp_request_t *req, const uint32_t num_active, const int fd,
+        const int sock_idx, const int num_sockets)
+{
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec vec[UDP_BATCH][3];
+    udp_request_t *batch[UDP_BATCH];
+    udp_request_t *r;
+    uint32_t i;
+    int n = 0;
+
+    for (i = sock_idx; i < num_active; i += num_sockets) {
+        r = &req[i];
+        if (r->inflight)
+            continue;
+
+        r->it = local_items_[DrawIndex()];
+        r->uhdr.reqId = r->reqId;
+        r->hdr.reqtype = GET;
+        r->hdr.keyLen = item_keyLen(r->it);
+        r->inflight = true;
+        r->ts = latency_now_ns();
+
+        vec[n][0].iov_base = &r->uhdr;
+        vec[n][0].iov_len = sizeof(udp_hdr);
+        vec[n][1].iov_base = &r->hdr;
+        vec[n][1].iov_len = sizeof(req_hdr);
+        vec[n][2].iov_base = item_key(r->it);
+        vec[n][2].iov_len = item_keyLen(r->it);
+
+        memset(&msgs[n], 0, sizeof(struct mmsghdr));
+        msgs[n].msg_hdr.msg_iov = vec[n];
+        msgs[n].msg_hdr.msg_iovlen = 3;
+        batch[n] = r;
+
+        if (++n == UDP_BATCH) {
+            if (SendUdpBatch(fd, msgs, batch, n) < n)
+                return;
+            n = 0;
+        }
+    }
+
+    if (n > 0)
+        SendUdpBatch(fd, msgs, batch, n);
+}
+
+/* Matches one reply datagram, starting at its udp_hdr, to its slot and
+ * verifies the value */
+static void
+HandleUdpReply(udp_request_t *req, const uint32_t slot_mask, uint8_t *buf, const uint32_t len)
+{
+    static __thread uint32_t num_replies = 0;
+    udp_request_t *r;
+    rep_hdr *hdr;
+    uint8_t *val;
+    uint32_t reqId;
+    uint64_t ns;
+
+    /* UDP takes a single server, server 0 */
+    STAT_ADD(stats_->rx_bytes, len);
+    STAT_ADD(stats_->server[0].rx_bytes, len);
+    if (len < sizeof(udp_hdr) + sizeof(rep_hdr) + hdr_pad_)
+        return;
+
+    reqId = ((udp_hdr *)buf)->reqId;
+    r = &req[reqId & slot_mask];
+    if (!r->inflight || r->reqId != reqId) {
+        STAT_INC(stats_->num_udp_late);
+        return;
+    }
+
+    hdr = (rep_hdr *)(buf + sizeof(udp_hdr));
+    val = hdr->val + hdr_pad_;
+    if (hdr->valLen != item_valueLen(r->it) ||
+            len != sizeof(udp_hdr) + sizeof(rep_hdr) + hdr_pad_ + hdr->valLen) {
+        log_trace("Value size error, (%u, %u)\n", hdr->valLen, item_valueLen(r->it));
+        STAT_INC(stats_->num_verify_fail);
+    } else if (++num_replies % verify_sample_rate_ == 0) {
+        if (verify_mode_ == VERIFY_DIGEST) {
+            if (CAL_HASH_VAL(val, hdr->valLen) != item_digest(r->it)) {
+                log_trace("Received reply digest error\n");
+                STAT_INC(stats_->num_verify_fail);
+            }
+        } else if (!CheckReply(r->it, 0, val, hdr->valLen)) {
+            STAT_INC(stats_->num_verify_fail);
+        }
+    }
+
+    /* the same accounting as a TCP reply */
+    ns = latency_now_ns() - r->ts;
+    STAT_INC(stats_->server[0].num_replies);
+    STAT_ADD(stats_->server[0].total_latency_ns, ns);
+    STAT_INC(stats_->op[GET].num_keys);
+    STAT_INC(stats_->op[GET].num_replies);
+    STAT_ADD(stats_->op[GET].total_latency_ns, ns);
+    STAT_INC(stats_->op[GET].hist.count[latency_bucket(ns)]);
+    RecordLatency(ns);
+
+    STAT_INC(stats_->num_udp_replies);
+    r->inflight = false;
+    r->reqId += slot_mask + 1;
+}
+
+static void
+ReceiveUdpReplies(udp_request_t *req, const uint32_t slot_mask, const int fd,
+        uint8_t (*bufs)[UDP_RCV_BUFSIZE])
+{
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec vec[UDP_BATCH];
+    int i, ret;
+
+    do {
+        for (i = 0; i < UDP_BATCH; i++) {
+            vec[i].iov_base = bufs[i];
+            vec[i].iov_len = UDP_RCV_BUFSIZE;
+            memset(&msgs[i], 0, sizeof(struct mmsghdr));
+            msgs[i].msg_hdr.msg_iov = &vec[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        ret = recvmmsg(fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (ret <= 0)
+            break;
+
+        for (i = 0; i < ret; i++)
+            HandleUdpReply(req, slot_mask, bufs[i], msgs[i].msg_len);
+    } while (ret == UDP_BATCH);
+}
+
+/* Requests whose reply did not arrive in time are counted as lost and
+ * their slots are freed for new requests */
+static void
+ExpireUdpRequests(udp_request_t *req, const uint32_t num_slots)
+{
+    uint32_t i;
+
+    for (i = 0; i < num_slots; i++) {
+        if (req[i].inflight && latency_now_ns() - req[i].ts > udp_timeout_ms_ * 1000000LU) {
+            STAT_INC(stats_->num_udp_timeouts);
+            req[i].inflight = false;
+            req[i].reqId += num_slots;
+        }
+    }
+}
+
+static void
+RunUdpLoop(const uint16_t thread_number, const int thread_max_concurrency)
+{
+    int i, ep, nevents;
+    const int num_sockets = udp_sockets_per_thread_;
+    /* a bounded batch per epoll_wait(), like the TCP loop */
+    const int num_max_events = num_sockets < EPOLL_MAX_EVENTS ? num_sockets : EPOLL_MAX_EVENTS;
+    int *fds;
+    struct epoll_event *events;
+    struct timespec last_scan;
+    uint32_t num_slots = 1;
+    udp_request_t *req;
+    uint8_t (*bufs)[UDP_RCV_BUFSIZE];
+
+    /* slots rounded up to a power of 2 for the reqId mask, only the
+     * first thread_max_concurrency of them are ever sent */
+    while (num_slots < (uint32_t)thread_max_concurrency)
+        num_slots <<= 1;
+
+    req = calloc(num_slots, sizeof(udp_request_t));
+    bufs = malloc(UDP_BATCH * UDP_RCV_BUFSIZE);
+    fds = malloc(sizeof(int) * num_sockets);
+    events = malloc(sizeof(struct epoll_event) * num_max_events);
+    if (!req || !bufs || !fds || !events) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < (int)num_slots; i++)
+        req[i].reqId = i;
+
+    ep = epoll_create1(0);
+    if (ep < 0) {
+        log_error("epoll_create() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_sockets; i++) {
+        fds[i] = CreateUdpSocket(ep);
+        if (fds[i] < 0)
+            exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &last_scan);
+
+    while (run_[thread_number])
+    {
+        for (i = 0; i < num_sockets; i++)
+            SendUdpRequests(req, thread_max_concurrency, fds[i], i, num_sockets);
+
+        nevents = epoll_wait(ep, events, num_max_events, UDP_SCAN_INTERVAL);
+        if (nevents < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (i = 0; i < nevents; i++)
+            ReceiveUdpReplies(req, num_slots - 1, events[i].data.fd, bufs);
+
+        if (ElapsedNs(&last_scan) > UDP_SCAN_INTERVAL * 1000000LU) {
+            ExpireUdpRequests(req, num_slots);
+            clock_gettime(CLOCK_MONOTONIC, &last_scan);
+        }
+    }
+
+    for (i = 0; i < num_sockets; i++)
+        close(fds[i]);
+    close(ep);
+    free(events);
+    free(fds);
+    free(bufs);
+    free(req);
+}
+
+/* Frame of one GET, headers included, built once per item. Only the
+ * source port, IP id and reqId change per request. */
+#define RAW_TEMPLATE_SIZE   (RAW_HDR_LEN + sizeof(udp_hdr) + sizeof(req_hdr) + UINT8_MAX + 1)
+#define RAW_SPORT_BASE      (40000)
+
+static void
+BuildRawTemplates(void)
+{
+    uint8_t payload[sizeof(udp_hdr) + sizeof(req_hdr) + UINT8_MAX];
+    req_hdr *hdr = (req_hdr *)(payload + sizeof(udp_hdr));
+    uint32_t i;
+
+    raw_templates_ = malloc((size_t)num_items_ * RAW_TEMPLATE_SIZE);
+    raw_template_len_ = malloc(num_items_ * sizeof(uint16_t));
+    if (!raw_templates_ || !raw_template_len_) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    memset(payload, 0, sizeof(udp_hdr));
+    hdr->reqtype = GET;
+
+    for (i = 0; i < num_items_; i++) {
+        hdr->keyLen = item_keyLen(items_[i]);
+        memcpy(hdr + 1, item_key(items_[i]), item_keyLen(items_[i]));
+        raw_template_len_[i] = raw_build_udp_frame(raw_templates_ + (size_t)i * RAW_TEMPLATE_SIZE,
+                &raw_ep_, 0, payload, sizeof(udp_hdr) + sizeof(req_hdr) + hdr->keyLen);
+    }
+}
+
+/* Holds the source port of a raw thread so the host stack neither hands
+ * it out nor answers replies with ICMP port unreachable. Everything
+ * arriving on it is dropped by the filter; replies are read from the ring. */
+static int
+CreateRawGuardSocket(const in_port_t sport)
+{
+    struct sockaddr_in addr = saddr_;
+    struct sock_filter code[] = { { BPF_RET | BPF_K, 0, 0, 0 } };
+    struct sock_fprog prog = { .len = 1, .filter = code };
+    int fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        log_error("socket() fail, %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        log_error("setsockopt() fail, %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    addr.sin_port = sport;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0) {
+        log_error("bind() fail, port %u, %s\n", ntohs(sport), strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+typedef struct raw_rx_ctx_s {
+    udp_request_t *req;
+    uint32_t slot_mask;
+} raw_rx_ctx_t;
+
+static void
+HandleRawReply(void *arg, uint8_t *payload, const uint32_t len)
+{
+    raw_rx_ctx_t *ctx = arg;
+
+    HandleUdpReply(ctx->req, ctx->slot_mask, payload, len);
+}
+
+/* Copies the template of a random item into a TX frame for every idle
+ * slot among the first num_active, until the ring is full. Returns the
+ * number of frames queued. */
+static int
+SendRawRequests(raw_tx_ring_t *tx, udp_request_t *req, const uint32_t num_active,
+        const in_port_t sport, uint16_t *ip_id)
 {
-    int ret;
-    rep_hdr *hdr = (rep_hdr *)buf;
-    if (buf_size < hdr->valLen) {
-        log_trace("buffer size : %lu, received value size : %u\n",
-                buf_size, hdr->valLen);
-    }
+    udp_request_t *r;
+    uint8_t *frame;
+    uint32_t i, idx;
+    int n = 0;
+
+    for (i = 0; i < num_active; i++) {
+        r = &req[i];
+        if (r->inflight)
+            continue;
+
+        frame = raw_tx_ring_get_frame(tx);
+        if (!frame)
+            break;
 
-    hdr->val[hdr->valLen] = '\0';
+        idx = DrawIndex();
+        r->it = local_items_[idx];
+        r->inflight = true;
+        r->ts = latency_now_ns();
 
-    if (item_valueLen(c->it) == hdr->valLen) {
-        if ((ret = memcmp(hdr->val, item_value(c->it), hdr->valLen)) != 0) {
-            log_trace("Received reply error, ret:%d\n", ret);
+        memcpy(frame, raw_templates_ + (size_t)idx * RAW_TEMPLATE_SIZE, raw_template_len_[idx]);
+        raw_set_udp_sport(frame, sport);
+        raw_set_ip_id(frame, (*ip_id)++);
+        raw_set_payload32(frame, offsetof(udp_hdr, reqId), r->reqId);
+        raw_tx_ring_commit(tx, raw_template_len_[idx]);
 
-            log_trace("original : %s\n", (char *)item_value(c->it));
-            log_trace("rcvd : %s\n", hdr->val);
-            return false;
-        }
-    } else {
-        log_trace("Value size error, (%u, %u)\n", hdr->valLen, item_valueLen(c->it));
-        return false;
+        STAT_ADD(stats_->tx_bytes, raw_template_len_[idx] - RAW_HDR_LEN);
+        n++;
     }
 
-    return true;
+    return n;
 }
 
+/* UDP mode over a PACKET_TX_RING/PACKET_RX_RING pair instead of sockets,
+ * the kernel UDP stack is bypassed on both paths */
 static void
-SetCoreAffinity(const int thread_no) 
+RunRawLoop(const uint16_t thread_number, const int thread_max_concurrency)
 {
-#ifdef _GNU_SOURCE
-    cpu_set_t cpuset;
-    pthread_t tid = pthread_self();
+    const in_port_t sport = htons(RAW_SPORT_BASE + thread_number);
+    raw_tx_ring_t tx;
+    raw_rx_ring_t rx;
+    raw_rx_ctx_t ctx;
+    struct timespec last_scan;
+    uint32_t i, num_slots = 1;
+    uint16_t ip_id = 0;
+    udp_request_t *req;
+    int guard_fd, n;
+
+    /* slots rounded up to a power of 2 for the reqId mask, only the first
+     * thread_max_concurrency of them are ever sent */
+    while (num_slots < (uint32_t)thread_max_concurrency)
+        num_slots <<= 1;
+
+    req = calloc(num_slots, sizeof(udp_request_t));
+    if (!req) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    CPU_ZERO(&cpuset);
-    CPU_SET(thread_no, &cpuset);
+    for (i = 0; i < num_slots; i++)
+        req[i].reqId = i;
 
-    if (pthread_setaffinity_np(tid, sizeof(cpu_set_t), &cpuset) < 0) {
-        log_error("pthread_setaffinity_np() error, %s\n", strerror(errno));
+    guard_fd = CreateRawGuardSocket(sport);
+    if (guard_fd < 0 ||
+            raw_tx_ring_open(&tx, raw_ifindex_, num_slots) < 0 ||
+            raw_rx_ring_open(&rx, raw_ifindex_, sport) < 0)
         exit(EXIT_FAILURE);
+
+    ctx.req = req;
+    ctx.slot_mask = num_slots - 1;
+    clock_gettime(CLOCK_MONOTONIC, &last_scan);
+
+    while (run_[thread_number])
+    {
+        n = SendRawRequests(&tx, req, thread_max_concurrency, sport, &ip_id);
+        if (n > 0) {
+            if (raw_tx_ring_flush(&tx) < 0)
+                break;
+            STAT_ADD(stats_->num_requests, n);
+            STAT_ADD(stats_->op[GET].num_requests, n);
+            STAT_ADD(stats_->server[0].num_requests, n);
+            STAT_INC(stats_->num_writev);
+        }
+
+        /* block only when there was nothing to send */
+        if (raw_rx_ring_poll(&rx, n > 0 ? 0 : UDP_SCAN_INTERVAL, HandleRawReply, &ctx) > 0) {
+            while (raw_rx_ring_poll(&rx, 0, HandleRawReply, &ctx) > 0)
+                ;
+        }
+
+        if (ElapsedNs(&last_scan) > UDP_SCAN_INTERVAL * 1000000LU) {
+            ExpireUdpRequests(req, num_slots);
+            clock_gettime(CLOCK_MONOTONIC, &last_scan);
+        }
     }
-#else
-    (void)thread_no;
-#endif
+
+    raw_rx_ring_close(&rx);
+    raw_tx_ring_close(&tx);
+    close(guard_fd);
+    free(req);
 }
 
 static void *
 RunTransmissionTestThread(void *arg) 
 {
+    uint16_t thread_number = *(uint16_t *)arg;
+    /* with rebalancing a thread may end up holding every connection, pools
+     * only take memory for the connections actually opened */
+    const int thread_max_conncurrency = rebalance_ ? max_concurrency_ : max_concurrency_ / num_threads_;
+    int *thread_concurrency;
+    connection_pool_t *cp[num_servers_];
+    const topology_cpu_t *t;
     int i;
-    int ep;
-    int nevents;
-    struct epoll_event events[max_concurrency_ / num_threads_ * 3];
-    connection_t *c;
 
-    uint8_t thread_number = *(uint8_t *)arg;
-    const int thread_max_conncurrency = max_concurrency_ / num_threads_;
-    const int num_max_events = thread_max_conncurrency * 3;
-    int thread_concurrency = 0;
-    connection_pool_t *cp = connection_create_pool(thread_max_conncurrency);
+    /* pinned before anything is allocated, so that pools and per thread
+     * state are first touched on the local node */
+    SetCoreAffinity(thread_number);
+
+    t = topology_cpu(thread_cpu_[thread_number]);
+    local_items_ = t && t->node < num_nodes_ && node_items_[t->node] ?
+                   node_items_[t->node] : items_;
+
+    stats_ = aligned_alloc(64, sizeof(thread_stats_t));
+    rx_buf_ = malloc(CONNECTION_BUFSIZE);
+    /* a line of its own, it is bumped on every connect and close */
+    thread_concurrency = aligned_alloc(64, 64);
+    if (!stats_ || !rx_buf_ || !thread_concurrency) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    memset(stats_, 0, sizeof(thread_stats_t));
+
+    /* every server may get its equal share, rounded up, datagram modes
+     * open no connections */
+    for (i = 0; i < num_servers_ && !udp_mode_; i++)
+        cp[i] = connection_create_pool((thread_max_conncurrency + num_servers_ - 1) / num_servers_);
+
+    stash_ = calloc(num_servers_, sizeof(shard_stash_t));
+    if (!stash_) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    per_thread_concurrency[thread_number] = &thread_concurrency;
+    /* like the stats, freed only after the join, PrintLog may read it
+     * while the thread exits */
+    *thread_concurrency = 0;
+    __atomic_store_n(&per_thread_concurrency[thread_number], thread_concurrency, __ATOMIC_RELEASE);
+    local_concurrency_ = thread_concurrency;
+    if (rebalance_)
+        local_quota_ = &thread_quota_[thread_number];
+
+    if (warmup_touch_) {
+        touch_next_ = (uint64_t)num_items_ * thread_number / num_threads_;
+        touch_end_ = (uint64_t)num_items_ * (thread_number + 1) / num_threads_;
+        if (touch_next_ == touch_end_)
+            __atomic_add_fetch(&num_touched_, 1, __ATOMIC_RELEASE);
+    }
+    /* datagram modes have no connections to ramp up */
+    if (udp_mode_)
+        MarkRamped();
+    __atomic_store_n(&thread_stats_[thread_number], stats_, __ATOMIC_RELEASE);
+
+    if (lat_hist_) {
+        hist_ = calloc(1, sizeof(latency_hist_t));
+        if (!hist_) {
+            log_error("malloc() error, %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        __atomic_store_n(&lat_hist_[thread_number], hist_, __ATOMIC_RELEASE);
+    }
 
     run_[thread_number] = true;
 
-    SetCoreAffinity(thread_number);
+    if (raw_ifname_)
+        RunRawLoop(thread_number, thread_max_conncurrency);
+    else if (udp_mode_)
+        RunUdpLoop(thread_number, thread_max_conncurrency);
+#ifdef _USE_IO_URING
+    else if (io_backend_ == IO_BACKEND_URING)
+        RunUringLoop(thread_number, cp, thread_concurrency, thread_max_conncurrency);
+#endif
+    else
+        RunEpollLoop(thread_number, cp, thread_concurrency, thread_max_conncurrency);
+
+    for (i = 0; i < num_servers_ && !udp_mode_; i++)
+        connection_destroy_pool(&cp[i]);
+    __atomic_store_n(thread_concurrency, 0, __ATOMIC_RELAXED);
+    free(stash_);
+    free(rx_buf_);
+    pthread_exit(NULL);
+    return NULL;
+}
 
-    ep = epoll_create(num_max_events);
-    if (ep < 0) {
-        log_error("epoll_create() error, %s\n", strerror(errno));
+/* Sum of the histograms of all threads. Counters are read while the
+ * threads update them, a window is the difference of two sums. */
+static void
+SumLatency(latency_hist_t *sum)
+{
+    latency_hist_t *h;
+    int i, j;
+
+    memset(sum, 0, sizeof(latency_hist_t));
+    for (i = 0; i < num_threads_; i++) {
+        if (!(h = __atomic_load_n(&lat_hist_[i], __ATOMIC_ACQUIRE)))
+            continue;
+        for (j = 0; j < LAT_NUM_BUCKETS; j++)
+            sum->count[j] += STAT_LOAD(h->count[j]);
+    }
+}
+
+/* Runs c connections for one window after letting them settle for half
+ * a window */
+static void
+MeasurePoint(const uint32_t c, search_point_t *pt)
+{
+    latency_hist_t *before, *after;
+    uint64_t total = 0;
+    uint32_t i;
+
+    before = malloc(sizeof(latency_hist_t));
+    after = malloc(sizeof(latency_hist_t));
+    if (!before || !after) {
+        log_error("malloc() error, %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    while (run_[thread_number]) 
-    {
-        while (thread_concurrency < thread_max_conncurrency) {
-            assert(thread_concurrency >= 0);
-            CreateConnection(cp, &thread_concurrency, ep);
+    __atomic_store_n(&concurrency_limit_, c, __ATOMIC_RELAXED);
+    usleep(search_window_ms_ * 500);
+
+    SumLatency(before);
+    usleep(search_window_ms_ * 1000);
+    SumLatency(after);
+
+    for (i = 0; i < LAT_NUM_BUCKETS; i++) {
+        after->count[i] -= before->count[i];
+        total += after->count[i];
+    }
+
+    pt->concurrency = c;
+    pt->throughput = total * 1000.0 / search_window_ms_;
+    pt->p50_us = latency_percentile(after, total, 500) / 1000;
+    pt->p99_us = latency_percentile(after, total, 990) / 1000;
+
+    fprintf(stdout, "[Search] concurrency:%-6u #replies/sec:%-10.0lf p50:%.1lfus    p99:%.1lfus%s\n",
+            c, pt->throughput, pt->p50_us, pt->p99_us,
+            pt->p99_us > search_slo_us_ ? "    (SLO broken)" : "");
+
+    free(before);
+    free(after);
+}
+
+static int
+ComparePoint(const void *a, const void *b)
+{
+    return (int)((const search_point_t *)a)->concurrency -
+           (int)((const search_point_t *)b)->concurrency;
+}
+
+/* Doubles the concurrency while p99 stays within the SLO and throughput
+ * still grows by 5%, then bisects between the last good and the first
+ * bad step. Concurrency moves in multiples of the thread count, so every
+ * thread gets the same share. */
+static void
+RunConcurrencySearch(void)
+{
+    search_point_t pts[SEARCH_MAX_POINTS];
+    const uint32_t step = num_threads_;
+    const uint32_t max = max_concurrency_ / step * step;
+    uint32_t lo = 0, hi = 0, c, mid;
+    int n = 0, lo_idx = -1, i;
+
+    for (c = step; run_log_ && n < SEARCH_MAX_POINTS; c *= 2) {
+        if (c > max)
+            c = max;
+        MeasurePoint(c, &pts[n]);
+        if (pts[n].p99_us > search_slo_us_ ||
+                (lo_idx >= 0 && pts[n].throughput < pts[lo_idx].throughput * 1.05)) {
+            hi = c;
+            n++;
+            break;
         }
-        nevents = epoll_wait(ep, events, num_max_events, -1);
-        if (nevents < 0) {
+        lo = c;
+        lo_idx = n++;
+        if (c == max)
             break;
+    }
+
+    while (run_log_ && hi > 0 && lo > 0 && hi - lo > step && hi - lo > lo / 8 &&
+            n < SEARCH_MAX_POINTS) {
+        mid = (lo + hi) / 2 / step * step;
+        MeasurePoint(mid, &pts[n]);
+        if (pts[n].p99_us <= search_slo_us_ &&
+                pts[n].throughput >= pts[lo_idx].throughput * 1.02) {
+            lo = mid;
+            lo_idx = n;
+        } else {
+            hi = mid;
         }
+        n++;
+    }
 
-        for (i = 0; i < nevents; i++) {
-            c = events[i].data.ptr;
-            //log_trace("%u, %p\n", c->state, c);
-            if (events[i].events & EPOLLERR || events[i].events & EPOLLHUP) {
-             //   log_trace("error, fd: %d\n", c->fd);
-                CloseConnection(c, cp, &thread_concurrency);
-            } else if (c->state == CONNECTION_AGAIN) {
-                if (!TryConnection(c, ep, &thread_concurrency)) {
-                    CloseConnection(c, cp ,&thread_concurrency);
-                }
-            } else if (c->state == CONNECTION_ESTABLISEHD) {
-                if (SendRandomGetRequest(c, ep, cp, &thread_concurrency) < 0) {
-                    CloseConnection(c, cp, &thread_concurrency);
-                }
-            } else if (c->state == CONNECTION_WAIT_FOR_REPLY || 
-                            c->state == CONNECTION_RCV_REPLY_AGAIN) {
-                ReceiveReply(c, ep, cp, &thread_concurrency);
+    if (n == 0)
+        return;
+
+    fprintf(stdout, "\n[Search] p99 SLO %uus, window %ums\n", search_slo_us_, search_window_ms_);
+    fprintf(stdout, "%12s %14s %10s %10s\n", "concurrency", "replies/sec", "p50(us)", "p99(us)");
+    if (lo_idx >= 0)
+        lo = pts[lo_idx].concurrency;
+    qsort(pts, n, sizeof(search_point_t), ComparePoint);
+    for (i = 0; i < n; i++) {
+        fprintf(stdout, "%12u %14.0lf %10.1lf %10.1lf%s\n", pts[i].concurrency, pts[i].throughput,
+                pts[i].p50_us, pts[i].p99_us,
+                lo_idx >= 0 && pts[i].concurrency == lo ? "    <- operating point" : "");
+    }
+    if (lo_idx < 0)
+        fprintf(stdout, "no concurrency meets the SLO, even %u\n", step);
+}
 
-            } else {
-                CloseConnection(c, cp, &thread_concurrency);
-            }
+/* Adds up the counters of every started thread */
+static void
+SumStats(thread_stats_t *sum)
+{
+    thread_stats_t *t;
+    int i, j, k;
+
+    memset(sum, 0, sizeof(thread_stats_t));
+    for (i = 0; i < num_threads_; i++) {
+        if (!(t = __atomic_load_n(&thread_stats_[i], __ATOMIC_ACQUIRE)))
+            continue;
+        sum->num_requests += STAT_LOAD(t->num_requests);
+        sum->num_writev += STAT_LOAD(t->num_writev);
+        sum->num_verify_fail += STAT_LOAD(t->num_verify_fail);
+        sum->rx_bytes += STAT_LOAD(t->rx_bytes);
+        sum->tx_bytes += STAT_LOAD(t->tx_bytes);
+        sum->num_connect += STAT_LOAD(t->num_connect);
+        sum->num_close += STAT_LOAD(t->num_close);
+        sum->total_setup_ns += STAT_LOAD(t->total_setup_ns);
+        sum->num_setup += STAT_LOAD(t->num_setup);
+        sum->total_short_conn_ns += STAT_LOAD(t->total_short_conn_ns);
+        sum->num_short_conn += STAT_LOAD(t->num_short_conn);
+        sum->num_udp_replies += STAT_LOAD(t->num_udp_replies);
+        sum->num_udp_timeouts += STAT_LOAD(t->num_udp_timeouts);
+        sum->num_udp_late += STAT_LOAD(t->num_udp_late);
+        for (j = 0; (write_mix_ || mget_fanout_ > 1 || udp_mode_) && j < NUM_OPS; j++) {
+            sum->op[j].num_requests += STAT_LOAD(t->op[j].num_requests);
+            sum->op[j].num_replies += STAT_LOAD(t->op[j].num_replies);
+            sum->op[j].num_keys += STAT_LOAD(t->op[j].num_keys);
+            sum->op[j].num_misses += STAT_LOAD(t->op[j].num_misses);
+            sum->op[j].total_latency_ns += STAT_LOAD(t->op[j].total_latency_ns);
+            for (k = 0; k < LAT_NUM_BUCKETS; k++)
+                sum->op[j].hist.count[k] += STAT_LOAD(t->op[j].hist.count[k]);
+        }
+        for (j = 0; j < num_servers_; j++) {
+            sum->server[j].num_requests += STAT_LOAD(t->server[j].num_requests);
+            sum->server[j].num_replies += STAT_LOAD(t->server[j].num_replies);
+            sum->server[j].rx_bytes += STAT_LOAD(t->server[j].rx_bytes);
+            sum->server[j].total_latency_ns += STAT_LOAD(t->server[j].total_latency_ns);
         }
     }
+}
 
-    connection_destroy_pool(&cp);
-    pthread_exit(NULL);
-    return NULL;
+/* sum -= base, thread_stats_t holds nothing but uint64_t counters */
+static void
+SubStats(thread_stats_t *sum, const thread_stats_t *base)
+{
+    uint64_t *a = (uint64_t *)sum;
+    const uint64_t *b = (const uint64_t *)base;
+    size_t i;
+
+    for (i = 0; i < sizeof(thread_stats_t) / sizeof(uint64_t); i++)
+        a[i] -= b[i];
+}
+
+static uint64_t
+ThreadReplies(const thread_stats_t *t)
+{
+    uint64_t replies = 0;
+    int i;
+
+    for (i = 0; i < num_servers_; i++)
+        replies += STAT_LOAD(t->server[i].num_replies);
+    return replies;
+}
+
+/* Sleeps ms or until the test is interrupted */
+static void
+SleepWhileRunning(const uint64_t ms)
+{
+    const uint64_t end = latency_now_ns() + ms * 1000000;
+
+    while (run_log_ && latency_now_ns() < end)
+        usleep(10000);
+}
+
+static void
+StartMeasurement(void)
+{
+    struct timespec cpu_ts;
+    thread_stats_t *t;
+    int i;
+
+    base_stats_ = malloc(sizeof(thread_stats_t));
+    base_replies_ = calloc(num_threads_, sizeof(uint64_t));
+    if (!base_stats_ || !base_replies_) {
+        log_error("malloc() error, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    SumStats(base_stats_);
+    for (i = 0; i < num_threads_; i++) {
+        if ((t = __atomic_load_n(&thread_stats_[i], __ATOMIC_ACQUIRE)))
+            base_replies_[i] = ThreadReplies(t);
+    }
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_ts);
+    base_cpu_sec_ = cpu_ts.tv_sec + cpu_ts.tv_nsec / 1e9;
+    base_ns_ = latency_now_ns();
+
+    pthread_mutex_lock(&logMtx_);
+    __atomic_store_n(&measuring_, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&logCnd_);
+    pthread_mutex_unlock(&logMtx_);
+}
+
+/* Ramp-up and warm-up, then opens the measurement window. Called by main
+ * while the threads run. */
+static void
+RunPhases(void)
+{
+    const uint64_t start = latency_now_ns();
+
+    while (run_log_ && __atomic_load_n(&num_ramped_, __ATOMIC_ACQUIRE) < num_threads_)
+        usleep(10000);
+    if (!run_log_)
+        return;
+    log_trace("ramp-up done in %.1lfs\n", (latency_now_ns() - start) / 1e9);
+
+    SleepWhileRunning(warmup_sec_ * 1000LU);
+    while (run_log_ && warmup_touch_ &&
+            __atomic_load_n(&num_touched_, __ATOMIC_ACQUIRE) < num_threads_)
+        usleep(10000);
+    if (!run_log_)
+        return;
+    log_trace("warm-up done, measuring%s\n", warmup_touch_ ? " (every key touched)" : "");
+
+    StartMeasurement();
+}
+
+/* Stops the threads and wakes PrintLog to exit */
+static void
+StopTest(void)
+{
+    SignalInterruptHandler(SIGINT);
+    pthread_mutex_lock(&logMtx_);
+    pthread_cond_signal(&logCnd_);
+    pthread_mutex_unlock(&logMtx_);
+}
+
+/* Spread of the reply rate over the threads, with -B also the spread of
+ * busy time and quotas */
+static void
+PrintBalance(const double sec)
+{
+    uint64_t replies, min = UINT64_MAX, max = 0, total = 0;
+    uint32_t busy_min = UINT32_MAX, busy_max = 0, quota_min = UINT32_MAX, quota_max = 0;
+    thread_stats_t *t;
+    int i, n = 0;
+
+    for (i = 0; i < num_threads_; i++) {
+        if (!(t = __atomic_load_n(&thread_stats_[i], __ATOMIC_ACQUIRE)))
+            continue;
+        replies = ThreadReplies(t) - base_replies_[i];
+        min = replies < min ? replies : min;
+        max = replies > max ? replies : max;
+        total += replies;
+        n++;
+        if (rebalance_) {
+            busy_min = thread_busy_[i] < busy_min ? thread_busy_[i] : busy_min;
+            busy_max = thread_busy_[i] > busy_max ? thread_busy_[i] : busy_max;
+            quota_min = thread_quota_[i] < quota_min ? thread_quota_[i] : quota_min;
+            quota_max = thread_quota_[i] > quota_max ? thread_quota_[i] : quota_max;
+        }
+    }
+    if (n < 2 || total == 0)
+        return;
+
+    fprintf(stdout, "[Balance] #replies/sec per thread min:%lu mean:%lu max:%lu    imbalance(max/mean):%.2lf",
+            (uint64_t)(min / sec), (uint64_t)(total / n / sec), (uint64_t)(max / sec),
+            (double)max * n / total);
+    if (rebalance_)
+        fprintf(stdout, "    busy:%.1lf~%.1lf%%    quota:%u~%u    spare:%u    # handoffs : %lu",
+                busy_min / 10.0, busy_max / 10.0, quota_min, quota_max,
+                __atomic_load_n(&spare_slots_, __ATOMIC_RELAXED),
+                __atomic_load_n(&num_handoffs_, __ATOMIC_RELAXED));
+    fprintf(stdout, "\n");
+}
+
+/* Memory the kernel holds for TCP sockets, system wide */
+static long
+KernelTcpBytes(void)
+{
+    FILE *f = fopen("/proc/net/sockstat", "r");
+    char line[256];
+    long pages = 0;
+    char *p;
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "TCP:", 4) == 0 && (p = strstr(line, " mem ")))
+            pages = atol(p + 5);
+    }
+    fclose(f);
+    return pages * sysconf(_SC_PAGESIZE);
 }
 
 static void *
 PrintLog(void *arg) {
-    //int i;
+    int i;
     struct timespec ts;
+    struct timespec cpu_ts;
+    thread_stats_t st;
+    server_stats_t *sv;
+    op_stats_t *os;
     double rx_byte_ratio;
     double tx_byte_ratio;
-    uint32_t sec;
-    sleep(10);
-    sec = 10;
+    double cpu_sec, last_cpu_sec = 0;
+    uint64_t num_live;
+    int *live;
+    double sec;
+    bool last = false;
+
+    /* nothing before the measurement window is reported, SIGINT does not
+     * signal so the wait is timed */
+    pthread_mutex_lock(&logMtx_);
+    while (run_log_ && !__atomic_load_n(&measuring_, __ATOMIC_ACQUIRE)) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&logCnd_, &logMtx_, &ts);
+    }
+    pthread_mutex_unlock(&logMtx_);
+    last_cpu_sec = base_cpu_sec_;
 
-    while(run_log_) {
+    /* one report per second, and a last one for the whole window when
+     * the test stops */
+    while(!last && __atomic_load_n(&measuring_, __ATOMIC_ACQUIRE)) {
         pthread_mutex_lock(&logMtx_);
         clock_gettime(CLOCK_REALTIME, &ts);
         ts.tv_sec += 1;
-        sec++;
-        rx_byte_ratio = (double)total_rx_bytes / (sec * (1 << 20));
-        tx_byte_ratio = (double)total_tx_bytes / (sec * (1 << 20));
+        if (run_log_)
+            pthread_cond_timedwait(&logCnd_, &logMtx_, &ts);
+        pthread_mutex_unlock(&logMtx_);
+        last = !run_log_;
+        sec = (latency_now_ns() - base_ns_) / 1e9;
+        if (last)
+            fprintf(stdout, "[Result] measurement window of %.1lfs\n", sec);
+        SumStats(&st);
+        SubStats(&st, base_stats_);
+        rx_byte_ratio = (double)st.rx_bytes / (sec * (1 << 20));
+        tx_byte_ratio = (double)st.tx_bytes / (sec * (1 << 20));
+        /* requests per second of CPU time, comparable across backends */
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_ts);
+        cpu_sec = cpu_ts.tv_sec + cpu_ts.tv_nsec / 1e9;
         fprintf(stdout, "rx:%-10lf(MB/sec)\ttx:%-10lf(MB/sec)\t#reqs/sec:%lu/sec\t"
-                        "# connects : %-8u    # closes : %-8u\n", 
-                rx_byte_ratio, tx_byte_ratio, num_requests / sec,
-                num_connect_, num_close_);
+                        "# connects : %-8lu    # closes : %-8lu    #reqs/writev:%-6.2lf"
+                        "    # verify fails : %lu    #reqs/cpu-sec:%.0lf"
+                        "    setup:%.1lfus    short-conn req:%.1lfus\n", 
+                rx_byte_ratio, tx_byte_ratio, (uint64_t)(st.num_requests / sec),
+                st.num_connect, st.num_close,
+                st.num_writev ? (double)st.num_requests / st.num_writev : 0,
+                st.num_verify_fail,
+                cpu_sec > base_cpu_sec_ ? st.num_requests / (cpu_sec - base_cpu_sec_) : 0,
+                st.num_setup ? (double)st.total_setup_ns / st.num_setup / 1000 : 0,
+                st.num_short_conn ? (double)st.total_short_conn_ns / st.num_short_conn / 1000 : 0);
+        if (udp_mode_) {
+            os = &st.op[GET];
+            fprintf(stdout, "[%s] #replies/sec:%lu/sec\t# timeouts : %-8lu    # late : %-8lu"
+                            "    loss:%.4lf%%    Mpps/core:%.3lf    latency:%.1lfus    p99:%.1lfus\n",
+                    raw_ifname_ ? "RAW" : "UDP",
+                    (uint64_t)(st.num_udp_replies / sec), st.num_udp_timeouts, st.num_udp_late,
+                    st.num_requests ? 100.0 * st.num_udp_timeouts / st.num_requests : 0,
+                    cpu_sec > base_cpu_sec_ ? st.num_requests / (cpu_sec - base_cpu_sec_) / 1e6 : 0,
+                    os->num_replies ? (double)os->total_latency_ns / os->num_replies / 1000 : 0,
+                    latency_percentile(&os->hist, os->num_replies, 990) / 1000);
+        } else {
+            /* cost of one open connection: resident memory grown since
+             * start, kernel TCP memory and CPU time of the last second */
+            num_live = 0;
+            for (i = 0; i < num_threads_; i++) {
+                if ((live = __atomic_load_n(&per_thread_concurrency[i], __ATOMIC_ACQUIRE)))
+                    num_live += __atomic_load_n(live, __ATOMIC_RELAXED);
+            }
+            if (num_live > 0) {
+                fprintf(stdout, "[Conn] #live:%-8lu    user mem/conn:%.0lfB    kernel tcp mem/conn:%.0lfB"
+                                "    cpu/conn:%.2lfus/sec\n",
+                        num_live, (double)(latency_resident_bytes() - rss_baseline_) / num_live,
+                        (double)KernelTcpBytes() / num_live,
+                        (cpu_sec - last_cpu_sec) * 1e6 / num_live);
+            }
+            PrintBalance(sec);
+        }
+        last_cpu_sec = cpu_sec;
+        /* per request type, updates to hot keys show up in GET latency.
+         * Latency is per frame, a multi-get lasts until its last key. */
+        for (i = 0; (write_mix_ || mget_fanout_ > 1) && i < NUM_OPS; i++) {
+            os = &st.op[i];
+            if (os->num_requests == 0)
+                continue;
+            fprintf(stdout, "[%-6s] #reqs/sec:%lu/sec\t#replies/sec:%lu/sec    #keys/sec:%lu/sec"
+                            "    latency:%.1lfus    p99:%.1lfus    # misses : %lu\n",
+                    op_name_[i], (uint64_t)(os->num_requests / sec), (uint64_t)(os->num_replies / sec),
+                    (uint64_t)(os->num_keys / sec),
+                    os->num_replies ? (double)os->total_latency_ns / os->num_replies / 1000 : 0,
+                    latency_percentile(&os->hist, os->num_replies, 990) / 1000, os->num_misses);
+        }
+        for (i = 0; num_servers_ > 1 && i < num_servers_; i++) {
+            sv = &st.server[i];
+            fprintf(stdout, "[Server%d %s:%u] #reqs/sec:%lu/sec\trx:%-10lf(MB/sec)"
+                            "    #items:%-8u    latency:%.1lfus\n",
+                    i, inet_ntoa(servers_[i].addr.sin_addr), ntohs(servers_[i].addr.sin_port),
+                    (uint64_t)(sv->num_requests / sec),
+                    (double)sv->rx_bytes / (sec * (1 << 20)), servers_[i].num_items,
+                    sv->num_replies ? (double)sv->total_latency_ns / sv->num_replies / 1000 : 0);
+        }
 /*
         for (i = 0; i < num_threads_; i++) {
             fprintf(stdout, "[Thread%d] #flows:%d\n", i, *per_thread_concurrency[i]);
         }*/
-
-        pthread_cond_timedwait(&logCnd_, &logMtx_, &ts);
-        pthread_mutex_unlock(&logMtx_);
     }
     pthread_exit(NULL);
     return NULL;
@@ -577,19 +3170,19 @@ main(const int argc, char *argv[]) {
     pthread_t printLogThread;
     bool print_log = false;
 
-    if (argc != 7 && argc != 8 && argc != 9) {
+    if (argc < 7) {
         log_error("invalide number of arguments, %d\n", argc);
         return -1;
     }
 
-    while((opt = getopt(argc, argv, "t:n:c:pP")) != -1) 
+    while((opt = getopt(argc, argv, "t:n:c:d:v:s:b:l:U:T:R:M:S:D:A:X:W:m:g:H:r:w:L:i:pPQFBKu")) != -1) 
     {
         switch(opt) {
             case 't' :
                 num_threads_ = atoi(optarg);
                 break;
             case 'c' :
-                max_concurrency_ = atoi(optarg);
+                max_concurrency_ = strtoul(optarg, NULL, 10);
                 break;
             case 'n' :
                 num_items_ = atoi(optarg);
@@ -600,23 +3193,235 @@ main(const int argc, char *argv[]) {
             case 'P' :
                 persistent_connection_ = true;
                 break;
+            case 'd' :
+                pipeline_depth_ = atoi(optarg);
+                break;
+            case 'v' :
+                if (strcmp(optarg, "memcmp") == 0) {
+                    verify_mode_ = VERIFY_MEMCMP;
+                } else if (strcmp(optarg, "digest") == 0) {
+                    verify_mode_ = VERIFY_DIGEST;
+                } else {
+                    log_error("invalid verify mode %s (memcmp|digest)\n", optarg);
+                    return -1;
+                }
+                break;
+            case 's' :
+                verify_sample_rate_ = atoi(optarg);
+                break;
+            case 'b' :
+                if (strcmp(optarg, "epoll") == 0) {
+                    io_backend_ = IO_BACKEND_EPOLL;
+                } else if (strcmp(optarg, "coro") == 0) {
+                    io_backend_ = IO_BACKEND_CORO;
+                } else if (strcmp(optarg, "uring") == 0) {
+#ifdef _USE_IO_URING
+                    io_backend_ = IO_BACKEND_URING;
+#else
+                    log_error("io_uring backend is not built, rebuild with USE_IO_URING=1\n");
+                    return -1;
+#endif
+                } else {
+                    log_error("invalid backend %s (epoll|coro|uring)\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'Q' :
+                uring_sqpoll_ = true;
+                break;
+            case 'F' :
+                fast_open_ = true;
+                break;
+            case 'u' :
+                udp_mode_ = true;
+                break;
+            case 'U' :
+                udp_sockets_per_thread_ = atoi(optarg);
+                break;
+            case 'T' :
+                udp_timeout_ms_ = atoi(optarg);
+                break;
+            case 'R' :
+                raw_ifname_ = optarg;
+                udp_mode_ = true;
+                break;
+            case 'M' :
+                if (sscanf(optarg, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+                            &raw_ep_.dmac[0], &raw_ep_.dmac[1], &raw_ep_.dmac[2],
+                            &raw_ep_.dmac[3], &raw_ep_.dmac[4], &raw_ep_.dmac[5]) != 6) {
+                    log_error("invalid mac address %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'A' :
+                placement_ = optarg;
+                break;
+            case 'X' :
+                search_slo_us_ = atoi(optarg);
+                break;
+            case 'B' :
+                rebalance_ = true;
+                break;
+            case 'r' :
+                ramp_rate_ = atoi(optarg);
+                break;
+            case 'w' :
+                warmup_sec_ = atoi(optarg);
+                break;
+            case 'K' :
+                warmup_touch_ = true;
+                break;
+            case 'L' :
+                measure_sec_ = atoi(optarg);
+                break;
+            case 'g' :
+                mget_fanout_ = atoi(optarg);
+                break;
+            case 'H' :
+                hdr_pad_ = atoi(optarg);
+                break;
+            case 'i' :
+                dataset_path_ = optarg;
+                break;
+            case 'm' :
+                if (ParseMix(optarg) < 0) {
+                    log_error("invalid request mix %s (get/set/delete percent, e.g. 95/4/1)\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'W' :
+                search_window_ms_ = atoi(optarg);
+                break;
+            case 'S' :
+                if (AddServers(optarg) < 0)
+                    return -1;
+                break;
+            case 'D' :
+                if (LoadServerFile(optarg) < 0)
+                    return -1;
+                break;
+            case 'l' :
+                saddr_.sin_family = AF_INET;
+                if (inet_pton(AF_INET, optarg, &saddr_.sin_addr) != 1) {
+                    log_error("invalid local address %s\n", optarg);
+                    return -1;
+                }
+                saddr_.sin_port = 0;
+                break;
             default :
                 log_error("invalid argument %c error\n", (char)opt);
                 return -1;
         }
     }
 
+    if (uring_sqpoll_ && io_backend_ != IO_BACKEND_URING) {
+        log_error("-Q (SQPOLL) needs the io_uring backend, -b uring\n");
+        return -1;
+    }
+
+    if (pipeline_depth_ < 1 || pipeline_depth_ > CONNECTION_MAX_PIPELINE_DEPTH) {
+        log_error("pipeline depth must be in [1, %d]\n", CONNECTION_MAX_PIPELINE_DEPTH);
+        return -1;
+    }
+
+    if (verify_sample_rate_ < 1) {
+        log_error("verify sample rate must be >= 1\n");
+        return -1;
+    }
+
+    if (udp_mode_ && (udp_sockets_per_thread_ < 1 || udp_sockets_per_thread_ > UDP_MAX_SOCKETS ||
+                io_backend_ != IO_BACKEND_EPOLL)) {
+        log_error("UDP mode needs -U in [1, %d] and the epoll backend\n", UDP_MAX_SOCKETS);
+        return -1;
+    }
+
+    if (!persistent_connection_ && pipeline_depth_ > 1) {
+        log_trace("pipelining needs persistent connections (-P), depth is set to 1\n");
+        pipeline_depth_ = 1;
+    }
+
+    if (mget_fanout_ < 1 || pipeline_depth_ * mget_fanout_ > CONNECTION_MAX_PIPELINE_DEPTH ||
+            (mget_fanout_ > 1 && udp_mode_)) {
+        log_error("multi-gets need TCP and depth x fan-out <= %d\n", CONNECTION_MAX_PIPELINE_DEPTH);
+        return -1;
+    }
+    ring_slots_ = pipeline_depth_ * mget_fanout_;
+
     clock_gettime(CLOCK_REALTIME, &global_test_start_ts_);
 
-    //dIp = inet_addr("10.0.30.210");
-    dIp = inet_addr("10.0.30.110");
-    dport = htons(65000);
+    if (num_servers_ == 0) {
+        //AddServers("10.0.30.210:65000");
+        char default_server[] = "10.0.30.110:65000";
+        AddServers(default_server);
+    }
+
+    if (search_slo_us_ > 0) {
+        if (udp_mode_ || max_concurrency_ < num_threads_ || search_window_ms_ < 100) {
+            log_error("the concurrency search needs TCP, -c >= -t and -W >= 100\n");
+            return -1;
+        }
+        lat_hist_ = calloc(num_threads_, sizeof(latency_hist_t *));
+        if (!lat_hist_) {
+            log_error("malloc() error, %s\n", strerror(errno));
+            return -1;
+        }
+        concurrency_limit_ = num_threads_;
+    } else {
+        concurrency_limit_ = max_concurrency_;
+    }
+
+    if (rebalance_) {
+        if (udp_mode_ || search_slo_us_ > 0 || max_concurrency_ < num_threads_) {
+            log_error("rebalancing needs TCP, -c >= -t and no concurrency search\n");
+            return -1;
+        }
+        thread_quota_ = malloc(sizeof(uint32_t) * num_threads_);
+        thread_busy_ = calloc(num_threads_, sizeof(uint32_t));
+        if (!thread_quota_ || !thread_busy_) {
+            log_error("malloc() error, %s\n", strerror(errno));
+            return -1;
+        }
+        for (i = 0; i < num_threads_; i++)
+            thread_quota_[i] = max_concurrency_ / num_threads_;
+    }
+
+    if (write_mix_ && (udp_mode_ || verify_mode_ == VERIFY_DIGEST)) {
+        log_error("SET and DELETE need TCP and the memcmp verify mode, SETs send the stored values\n");
+        return -1;
+    }
+
+    if (udp_mode_ && num_servers_ > 1) {
+        log_error("UDP and raw modes take a single server\n");
+        return -1;
+    }
+
+    dIp = servers_[0].addr.sin_addr.s_addr;
+    dport = servers_[0].addr.sin_port;
 
     daddr_.sin_family = AF_INET;
     daddr_.sin_addr.s_addr = dIp;
     daddr_.sin_port = dport;
 
+    if (!udp_mode_)
+        RaiseFileLimit();
+
     SetupTransmissionTest();
+    SetupPlacement();
+
+    if (raw_ifname_) {
+        if (saddr_.sin_addr.s_addr == INADDR_ANY) {
+            log_error("raw mode needs the local address (-l)\n");
+            return -1;
+        }
+        if (raw_get_ifinfo(raw_ifname_, &raw_ifindex_, raw_ep_.smac) < 0)
+            return -1;
+        raw_ep_.saddr = saddr_.sin_addr.s_addr;
+        raw_ep_.daddr = dIp;
+        raw_ep_.dport = dport;
+        BuildRawTemplates();
+    }
+
+    rss_baseline_ = latency_resident_bytes();
 
     for (i = 0; i < num_threads_; i++) {
         thread_no_[i] = i;
@@ -634,7 +3439,18 @@ main(const int argc, char *argv[]) {
         }
     }
 
-    pthread_join(printLogThread, NULL);
+    RunPhases();
+
+    if (search_slo_us_ > 0) {
+        RunConcurrencySearch();
+        StopTest();
+    } else if (measure_sec_ > 0) {
+        SleepWhileRunning(measure_sec_ * 1000LU);
+        StopTest();
+    }
+
+    if (print_log)
+        pthread_join(printLogThread, NULL);
 
     for (i = 0; i < num_threads_; i++) {
         pthread_join(transmission_thread_tid_[i], NULL);